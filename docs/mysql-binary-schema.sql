@@ -0,0 +1,179 @@
+-- Migration of the master server/updater and content databases to the
+-- binary schema: IP addresses are stored as VARBINARY(16), like INET6_ATON
+-- returns them (4 bytes for IPv4, 16 bytes for IPv6), and MD5 checksums as
+-- BINARY(16). Enable MYSQL_MSU_BINARY_SCHEMA respectively
+-- MYSQL_CONTENT_BINARY_SCHEMA in mysql_data.h after running the part for
+-- that database, and restart the services.
+--
+-- Requires MySQL 5.6.3 or later for INET6_ATON and INET6_NTOA.
+-- Stop the master server and updater before migrating their database.
+
+-- --------------------------------------------------------
+-- Master server/updater database
+-- --------------------------------------------------------
+
+--
+-- Table `servers_ips`: ip as VARBINARY(16)
+--
+
+ALTER TABLE `servers_ips` ADD `ip_bin` varbinary(16) NULL AFTER `ip`;
+UPDATE `servers_ips` SET `ip_bin` = INET6_ATON(`ip`);
+DELETE FROM `servers_ips` WHERE `ip_bin` IS NULL;
+ALTER TABLE `servers_ips`
+  DROP INDEX `ip_port`,
+  DROP `ip`,
+  CHANGE `ip_bin` `ip` varbinary(16) NOT NULL,
+  ADD UNIQUE KEY `ip_port` (`ip`,`port`);
+
+--
+-- Table `newgrfs`: md5sum as BINARY(16)
+--
+
+ALTER TABLE `newgrfs` ADD `md5sum_bin` binary(16) NULL AFTER `md5sum`;
+UPDATE `newgrfs` SET `md5sum_bin` = UNHEX(`md5sum`);
+DELETE FROM `newgrfs` WHERE `md5sum_bin` IS NULL;
+ALTER TABLE `newgrfs`
+  DROP PRIMARY KEY,
+  DROP `md5sum`,
+  CHANGE `md5sum_bin` `md5sum` binary(16) NOT NULL,
+  ADD PRIMARY KEY (`grfid`,`md5sum`);
+
+--
+-- Table `servers_newgrfs`: md5sum as BINARY(16)
+--
+
+ALTER TABLE `servers_newgrfs` ADD `md5sum_bin` binary(16) NULL AFTER `md5sum`;
+UPDATE `servers_newgrfs` SET `md5sum_bin` = UNHEX(`md5sum`);
+DELETE FROM `servers_newgrfs` WHERE `md5sum_bin` IS NULL;
+ALTER TABLE `servers_newgrfs`
+  DROP INDEX `server_id`,
+  DROP `md5sum`,
+  CHANGE `md5sum_bin` `md5sum` binary(16) NOT NULL,
+  ADD UNIQUE KEY `server_id` (`server_id`,`grfid`,`md5sum`);
+
+--
+-- View `servers_list`: show the IP addresses as text
+--
+
+DROP VIEW IF EXISTS `servers_list`;
+CREATE VIEW `servers_list` AS select `s`.`id` AS `id`,group_concat((case `i`.`online` when 1 then concat(inet6_ntoa(`i`.`ip`),_utf8':',cast(`i`.`port` as char(6) charset utf8)) else NULL end) separator ', ') AS `ips`,max(`i`.`last_queried`) AS `last_queried`,max(`i`.`online`) AS `online`,`s`.`last_online` AS `last_online`,`s`.`created` AS `created`,`s`.`info_version` AS `info_version`,`s`.`name` AS `name`,`s`.`revision` AS `revision`,`s`.`server_lang` AS `server_lang`,`s`.`use_password` AS `use_password`,`s`.`clients_max` AS `clients_max`,`s`.`clients_on` AS `clients_on`,`s`.`companies_max` AS `companies_max`,`s`.`companies_on` AS `companies_on`,`s`.`spectators_max` AS `spectators_max`,`s`.`spectators_on` AS `spectators_on`,`s`.`game_date` AS `game_date`,`s`.`start_date` AS `start_date`,`s`.`map_name` AS `map_name`,`s`.`map_width` AS `map_width`,`s`.`map_height` AS `map_height`,`s`.`map_set` AS `map_set`,`s`.`dedicated` AS `dedicated`,`s`.`num_grfs` AS `num_grfs` from (`servers` `s` join `servers_ips` `i` on((`s`.`id` = `i`.`server_id`))) group by `s`.`id`;
+
+--
+-- Procedures and functions taking an IP address
+--
+
+DROP PROCEDURE IF EXISTS `MakeOffline`;
+DROP PROCEDURE IF EXISTS `MakeOnline`;
+DROP FUNCTION IF EXISTS `UpdateGameInfo`;
+
+DELIMITER $$
+CREATE PROCEDURE `MakeOffline`(IN p_ip VARBINARY(16), IN p_port INT)
+BEGIN
+	UPDATE servers_ips SET online='0', last_queried='0000-00-00 00:00:00' WHERE ip=p_ip AND port=p_port;
+END$$
+
+CREATE PROCEDURE `MakeOnline`(
+	IN p_ipv6 BOOL,
+	IN p_ip VARBINARY(16),
+	IN p_port INT,
+	IN p_session_key BIGINT)
+BEGIN
+	DECLARE v_server_id INT;
+	DECLARE v_session_key BIGINT;
+	SELECT server_id INTO v_server_id FROM servers_ips WHERE ip=p_ip AND port=p_port;
+	IF v_server_id IS NULL OR v_server_id = 0 THEN
+		INSERT INTO servers SET session_key=p_session_key, created=NOW(), last_online=NOW() ON DUPLICATE KEY UPDATE last_online=NOW();
+		SELECT id INTO v_server_id FROM servers WHERE session_key=p_session_key;
+	ELSE
+		SELECT session_key INTO v_session_key FROM servers WHERE id=v_server_id;
+		IF v_session_key <> p_session_key THEN
+			UPDATE servers_ips SET server_id=0 WHERE server_id=v_server_id;
+			UPDATE servers SET session_key=p_session_key WHERE id=v_server_id;
+		END IF;
+	END IF;
+	INSERT INTO servers_ips SET server_id=v_server_id, ipv6=p_ipv6, ip=p_ip, port=p_port, last_queried='0000-00-00 00:00:00', last_advertised=NOW(), online='1' ON DUPLICATE KEY UPDATE online='1', server_id=v_server_id, last_advertised=NOW();
+END$$
+
+--
+-- Functions
+--
+CREATE FUNCTION `UpdateGameInfo`(
+	p_ip VARBINARY(16),
+	p_port INT,
+	p_info_version INT,
+	p_name TINYTEXT,
+	p_revision TINYTEXT,
+	p_server_lang INT,
+	p_use_password INT,
+	p_clients_max INT,
+	p_clients_on INT,
+	p_spectators_max INT,
+	p_spectators_on INT,
+	p_companies_max INT,
+	p_companies_on INT,
+	p_game_date TINYTEXT,
+	p_start_date TINYTEXT,
+	p_map_name TINYTEXT,
+	p_map_width INT,
+	p_map_height INT,
+	p_map_set INT,
+	p_dedicated INT,
+	p_num_grfs INT) RETURNS int(11)
+BEGIN
+	DECLARE r_server_id INT;
+	SELECT server_id INTO r_server_id FROM servers_ips WHERE ip=p_ip AND port=p_port;
+	IF r_server_id IS NULL THEN
+		RETURN 0;
+	END IF;
+	UPDATE
+		servers_ips
+	SET
+		last_queried=NOW(),
+		online='1'
+	WHERE
+		ip=p_ip AND
+		port=p_port;
+	UPDATE
+		servers
+	SET
+		last_online=NOW(),
+		info_version=p_info_version,
+		name=p_name,
+		revision=p_revision,
+		server_lang=p_server_lang,
+		use_password=p_use_password,
+		clients_max=p_clients_max,
+		clients_on=p_clients_on,
+		spectators_max=p_spectators_max,
+		spectators_on=p_spectators_on,
+		companies_max=p_companies_max,
+		companies_on=p_companies_on,
+		game_date=p_game_date,
+		start_date=p_start_date,
+		map_name=p_map_name,
+		map_width=p_map_width,
+		map_height=p_map_height,
+		map_set=p_map_set,
+		dedicated=p_dedicated,
+		num_grfs=p_num_grfs
+	WHERE
+		id=r_server_id;
+	RETURN r_server_id;
+END$$
+
+DELIMITER ;
+
+-- --------------------------------------------------------
+-- Content database
+-- --------------------------------------------------------
+
+--
+-- Table `bananas_file`: uniquemd5 as BINARY(16)
+--
+
+ALTER TABLE `bananas_file` ADD `uniquemd5_bin` binary(16) NULL AFTER `uniquemd5`;
+UPDATE `bananas_file` SET `uniquemd5_bin` = UNHEX(`uniquemd5`);
+UPDATE `bananas_file` SET `uniquemd5_bin` = '' WHERE `uniquemd5_bin` IS NULL;
+ALTER TABLE `bananas_file`
+  DROP `uniquemd5`,
+  CHANGE `uniquemd5_bin` `uniquemd5` binary(16) NOT NULL;
@@ -0,0 +1,40 @@
+-- Migration of the content database for the in-memory content catalog of
+-- the content server: every file gets the time it was last modified, which
+-- changes when a column the content server serves changes, or when its tags
+-- or dependencies change. Other updates, like counting the downloads, leave
+-- it alone. The content server reads the files that were modified since its
+-- last check every 30 seconds; content that is deleted from `bananas_file`
+-- instead of being deactivated is only forgotten when the whole catalog is
+-- read again, once an hour.
+-- Run this before starting a content server that uses the catalog.
+
+ALTER TABLE `bananas_file`
+  ADD `modified` timestamp NOT NULL default CURRENT_TIMESTAMP,
+  ADD KEY `modified` (`modified`);
+
+DELIMITER $$
+
+CREATE TRIGGER `bananas_file_update` BEFORE UPDATE ON `bananas_file`
+FOR EACH ROW BEGIN
+	IF NOT (NEW.`name` <=> OLD.`name` AND NEW.`filename` <=> OLD.`filename` AND NEW.`filesize` <=> OLD.`filesize` AND
+			NEW.`type_id` <=> OLD.`type_id` AND NEW.`version` <=> OLD.`version` AND NEW.`url` <=> OLD.`url` AND
+			NEW.`description` <=> OLD.`description` AND NEW.`uniqueid` <=> OLD.`uniqueid` AND NEW.`uniquemd5` <=> OLD.`uniquemd5` AND
+			NEW.`active` <=> OLD.`active` AND NEW.`published` <=> OLD.`published` AND
+			NEW.`minimalVersion` <=> OLD.`minimalVersion` AND NEW.`maximalVersion` <=> OLD.`maximalVersion`) THEN
+		SET NEW.`modified` = NOW();
+	END IF;
+END$$
+
+CREATE TRIGGER `bananas_file_tags_insert` AFTER INSERT ON `bananas_file_tags`
+FOR EACH ROW UPDATE `bananas_file` SET `modified` = NOW() WHERE `id` = NEW.`file_id`$$
+
+CREATE TRIGGER `bananas_file_tags_delete` AFTER DELETE ON `bananas_file_tags`
+FOR EACH ROW UPDATE `bananas_file` SET `modified` = NOW() WHERE `id` = OLD.`file_id`$$
+
+CREATE TRIGGER `bananas_file_deps_insert` AFTER INSERT ON `bananas_file_deps`
+FOR EACH ROW UPDATE `bananas_file` SET `modified` = NOW() WHERE `id` = NEW.`from_file_id`$$
+
+CREATE TRIGGER `bananas_file_deps_delete` AFTER DELETE ON `bananas_file_deps`
+FOR EACH ROW UPDATE `bananas_file` SET `modified` = NOW() WHERE `id` = OLD.`from_file_id`$$
+
+DELIMITER ;
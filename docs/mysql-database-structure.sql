@@ -50,6 +50,7 @@ CREATE TABLE `servers` (
   `map_set` tinyint(3) unsigned default NULL,
   `dedicated` tinyint(1) unsigned default NULL,
   `num_grfs` tinyint(3) NOT NULL default '0',
+  `newgrfs_fingerprint` bigint(20) unsigned NOT NULL default '0',
   PRIMARY KEY  (`id`),
   UNIQUE KEY `session_key` (`session_key`),
   KEY `revision` (`revision`(10))
@@ -69,10 +70,12 @@ CREATE TABLE `servers_ips` (
   `last_queried` datetime NOT NULL default '0000-00-00 00:00:00',
   `last_advertised` datetime NOT NULL default '0000-00-00 00:00:00',
   `online` tinyint(1) NOT NULL default '0',
+  `claim` bigint(20) unsigned NOT NULL default '0',
   UNIQUE KEY `ip_port` (`ip`(40),`port`),
   KEY `last_queried` (`last_queried`,`online`),
   KEY `server_id` (`server_id`),
-  KEY `online` (`online`)
+  KEY `online` (`online`),
+  KEY `claim` (`claim`)
 ) ENGINE=MyISAM DEFAULT CHARSET=utf8 COLLATE=utf8_unicode_ci;
 
 -- --------------------------------------------------------
@@ -0,0 +1,8 @@
+-- Migration of the master server/updater database for skipping the rewrite
+-- of the NewGRFs of a game server when they did not change: the updater
+-- stores a fingerprint of the NewGRFs it wrote to servers_newgrfs with the
+-- game server, and only writes them again when the fingerprint changes.
+-- Run this before starting an updater that uses the fingerprints.
+
+ALTER TABLE `servers`
+  ADD `newgrfs_fingerprint` bigint(20) unsigned NOT NULL default '0' AFTER `num_grfs`;
@@ -0,0 +1,9 @@
+-- Migration of the master server/updater database for claiming the game
+-- servers to query: the updater marks the servers it is going to query with
+-- a token of its own in the same UPDATE that sets last_queried, and then
+-- selects the servers with that token. Run this before starting an updater
+-- that claims the servers it queries.
+
+ALTER TABLE `servers_ips`
+  ADD `claim` bigint(20) unsigned NOT NULL default '0' AFTER `online`,
+  ADD KEY `claim` (`claim`);
@@ -0,0 +1,254 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server/updater and content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shared/stdafx.h"
+#include "shared/address_map.hpp"
+#include "core/math_func.hpp"
+#include "bench.h"
+#include <map>
+#include <vector>
+
+#include "shared/safeguards.h"
+
+/**
+ * @file bench/address_map.cpp Benchmark of the map of the queried servers against the std::map it replaced
+ */
+
+/** The comparator of the std::map the queried servers used to be in */
+struct SockAddrInComparator {
+	/**
+	 * Compare two network addresses on IP address and port
+	 */
+	bool operator()(NetworkAddress *s1, NetworkAddress *s2) const
+	{
+		return *s1 < *s2;
+	}
+};
+
+/** The std::map the queried servers used to be in; the value stands in for the queried server */
+typedef std::map<NetworkAddress *, NetworkAddress *, SockAddrInComparator> OldQueriedServerMap;
+/** The map the queried servers are in now */
+typedef AddressMap<NetworkAddress *> NewQueriedServerMap;
+
+/**
+ * The queried servers of the benchmark. Like the real ones they carry their
+ * address, and the precomputed key of it.
+ */
+struct BenchServer {
+	NetworkAddress address; ///< The address of the game server
+	AddressKey key;         ///< The key of the address
+};
+
+/**
+ * Perform UDPServer::GetQueriedServer on the old map.
+ * @param map  the map to look in
+ * @param addr the address a packet came from
+ * @return the queried server, or NULL
+ */
+static NetworkAddress *OldGet(OldQueriedServerMap &map, NetworkAddress *addr)
+{
+	OldQueriedServerMap::iterator iter = map.find(addr);
+	if (iter == map.end()) return NULL;
+	return iter->second;
+}
+
+/**
+ * Perform UDPServer::RemoveQueriedServer on the old map.
+ * @param map the map to remove from
+ * @param qs  the queried server to remove
+ * @return the removed queried server with the same address, or NULL
+ */
+static NetworkAddress *OldRemove(OldQueriedServerMap &map, BenchServer *qs)
+{
+	OldQueriedServerMap::iterator iter = map.find(&qs->address);
+	if (iter == map.end()) return NULL;
+
+	NetworkAddress *ret = iter->second;
+	map.erase(iter);
+	return ret;
+}
+
+/**
+ * Perform UDPServer::AddQueriedServer on the old map.
+ * @param map the map to add to
+ * @param qs  the queried server to add
+ * @return the replaced queried server with the same address, or NULL
+ */
+static NetworkAddress *OldAdd(OldQueriedServerMap &map, BenchServer *qs)
+{
+	NetworkAddress *ret = OldRemove(map, qs);
+	map[&qs->address] = &qs->address;
+	return ret;
+}
+
+/**
+ * Perform UDPServer::GetQueriedServer on the new map.
+ * @param map  the map to look in
+ * @param addr the address a packet came from
+ * @return the queried server, or NULL
+ */
+static NetworkAddress *NewGet(NewQueriedServerMap &map, NetworkAddress *addr)
+{
+	AddressKey key;
+	if (!key.FromAddress(addr)) return NULL;
+
+	NetworkAddress **qs = map.Find(key);
+	return qs == NULL ? NULL : *qs;
+}
+
+/**
+ * Perform UDPServer::RemoveQueriedServer on the new map.
+ * @param map the map to remove from
+ * @param qs  the queried server to remove
+ * @return the removed queried server with the same address, or NULL
+ */
+static NetworkAddress *NewRemove(NewQueriedServerMap &map, BenchServer *qs)
+{
+	NetworkAddress **iter = map.Find(qs->key);
+	if (iter == NULL) return NULL;
+
+	NetworkAddress *ret = *iter;
+	map.Erase(qs->key);
+	return ret;
+}
+
+/**
+ * Perform UDPServer::AddQueriedServer on the new map.
+ * @param map the map to add to
+ * @param qs  the queried server to add
+ * @return the replaced queried server with the same address, or NULL
+ */
+static NetworkAddress *NewAdd(NewQueriedServerMap &map, BenchServer *qs)
+{
+	NetworkAddress *ret = NewRemove(map, qs);
+	map[qs->key] = &qs->address;
+	return ret;
+}
+
+/**
+ * Make the queried servers, and the addresses their replies come from.
+ * Those are separate objects, just like for real packets.
+ * @param size    the number of servers
+ * @param servers the queried servers to fill
+ * @param replies the addresses of the replies to fill
+ */
+static void MakeServers(uint size, std::vector<BenchServer> &servers, std::vector<NetworkAddress> &replies)
+{
+	AddressKeyList keys;
+	MakeBenchServers(keys, size, false);
+
+	servers.resize(size);
+	replies.clear();
+	for (uint i = 0; i < size; i++) {
+		servers[i].key = keys[i];
+		servers[i].address = keys[i].ToAddress();
+		replies.push_back(keys[i].ToAddress());
+	}
+
+	/* Replies do not come in the order the servers were queried in */
+	for (uint i = size - 1; i > 0; i--) std::swap(replies[i], replies[(i * 7919) % (i + 1)]);
+}
+
+/**
+ * Do a random mix of additions, replacements, removals and lookups on
+ * both maps, and check they keep giving the same answers. With only a
+ * few addresses for many operations, removals from the middle of the
+ * probe sequences of the new map happen all the time.
+ * @param size the number of different addresses
+ */
+static void CheckSameSemantics(uint size)
+{
+	std::vector<BenchServer> servers, replacements;
+	std::vector<NetworkAddress> replies;
+	MakeServers(size, servers, replies);
+	MakeServers(size, replacements, replies);
+
+	OldQueriedServerMap old_map;
+	NewQueriedServerMap new_map;
+
+	uint32 random = 1;
+	for (uint i = 0; i < size * 20; i++) {
+		random = random * 1103515245 + 12345;
+		uint index = (random >> 8) % size;
+		BenchServer *qs = ((random >> 4) & 1) != 0 ? &servers[index] : &replacements[index];
+
+		bool same;
+		switch (random >> 29) {
+			case 0: case 1: case 2:
+				same = OldAdd(old_map, qs) == NewAdd(new_map, qs);
+				break;
+
+			case 3: case 4:
+				same = OldRemove(old_map, qs) == NewRemove(new_map, qs);
+				break;
+
+			default:
+				same = OldGet(old_map, &qs->address) == NewGet(new_map, &qs->address);
+				break;
+		}
+		if (!same || old_map.size() != new_map.Length()) error("The maps differ after operation %u with %u addresses", i, size);
+	}
+
+	/* Also every address the last operations did not touch */
+	for (uint i = 0; i < size; i++) {
+		if (OldGet(old_map, &servers[i].address) != NewGet(new_map, &servers[i].address)) error("The maps differ for address %u of %u", i, size);
+	}
+}
+
+void BenchAddressMap()
+{
+	for (uint i = 0; i < lengthof(_bench_sizes); i++) {
+		uint size = _bench_sizes[i];
+		uint rounds = max(1U, BENCH_ENTRIES_PER_SIZE / size);
+
+		CheckSameSemantics(size);
+
+		std::vector<BenchServer> servers;
+		std::vector<NetworkAddress> replies;
+		MakeServers(size, servers, replies);
+
+		OldQueriedServerMap old_map;
+		NewQueriedServerMap new_map;
+		for (uint j = 0; j < size; j++) {
+			OldAdd(old_map, &servers[j]);
+			NewAdd(new_map, &servers[j]);
+		}
+
+		/* Every reply of a game server looks up its queried server */
+		uint found = 0;
+		uint64 start = GetBenchTime();
+		for (uint r = 0; r < rounds; r++) {
+			for (uint j = 0; j < size; j++) if (OldGet(old_map, &replies[j]) != NULL) found++;
+		}
+		ReportBench("queried servers: std::map lookup", size, rounds, GetBenchTime() - start);
+
+		start = GetBenchTime();
+		for (uint r = 0; r < rounds; r++) {
+			for (uint j = 0; j < size; j++) if (NewGet(new_map, &replies[j]) != NULL) found++;
+		}
+		ReportBench("queried servers: AddressMap lookup", size, rounds, GetBenchTime() - start);
+
+		/* Every answered query removes its queried server, and every new query adds one */
+		start = GetBenchTime();
+		for (uint r = 0; r < rounds; r++) {
+			for (uint j = 0; j < size; j++) OldRemove(old_map, &servers[j]);
+			for (uint j = 0; j < size; j++) OldAdd(old_map, &servers[j]);
+		}
+		ReportBench("queried servers: std::map remove + add", size, rounds, GetBenchTime() - start);
+
+		start = GetBenchTime();
+		for (uint r = 0; r < rounds; r++) {
+			for (uint j = 0; j < size; j++) NewRemove(new_map, &servers[j]);
+			for (uint j = 0; j < size; j++) NewAdd(new_map, &servers[j]);
+		}
+		ReportBench("queried servers: AddressMap remove + add", size, rounds, GetBenchTime() - start);
+
+		if (found != 2 * rounds * size) error("Only %u of %u lookups found their queried server", found, 2 * rounds * size);
+	}
+}
@@ -0,0 +1,127 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server/updater and content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shared/stdafx.h"
+#include "shared/string_func.h"
+#include "core/math_func.hpp"
+#include "masterserver/masterserver.h"
+#include "bench.h"
+#include <vector>
+
+#include "shared/safeguards.h"
+
+/**
+ * @file bench/address_parsing.cpp Benchmark of rebuilding the server list from the textual addresses in the database
+ */
+
+/** Number of game servers in the rebuilt list */
+static const uint BENCH_REBUILD_SERVERS = 10000;
+
+/** A row of the text schema, as MySQL::GetActiveServers gets it */
+struct BenchRow {
+	char ip[NETWORK_HOSTNAME_LENGTH]; ///< The IP address as text
+	char port[8];                     ///< The port as text
+};
+
+/**
+ * Turn the rows into keys, like MySQL::AddressFromSQL used to: through a
+ * NetworkAddress, which asks the resolver to turn the text into an address.
+ * @param rows    the rows to convert
+ * @param servers the list to fill
+ * @return the number of rows the resolver could not handle
+ */
+static uint ParseWithResolver(const std::vector<BenchRow> &rows, AddressKeyList &servers)
+{
+	uint failed = 0;
+	servers.Clear();
+	for (uint i = 0; i < rows.size(); i++) {
+		NetworkAddress address(rows[i].ip, atoi(rows[i].port));
+		if (!servers.Append()->FromAddress(&address)) {
+			servers.Erase(servers.End() - 1);
+			failed++;
+		}
+	}
+	return failed;
+}
+
+/**
+ * Turn the rows into keys, like MySQL::AddressFromSQL does now.
+ * @param rows    the rows to convert
+ * @param servers the list to fill
+ * @return the number of rows that are not a numeric address
+ */
+static uint ParseNumeric(const std::vector<BenchRow> &rows, AddressKeyList &servers)
+{
+	uint failed = 0;
+	servers.Clear();
+	for (uint i = 0; i < rows.size(); i++) {
+		if (!servers.Append()->FromString(rows[i].ip, atoi(rows[i].port))) {
+			servers.Erase(servers.End() - 1);
+			failed++;
+		}
+	}
+	return failed;
+}
+
+/**
+ * Rebuild the server list from scratch out of the given servers.
+ * @param servers the on-line servers; they get sorted
+ */
+static void Rebuild(AddressKeyList &servers)
+{
+	OnlineServerList list;
+	AddressKeyList newer;
+	list.Reconcile(SLT_IPv4, servers, newer);
+	list.Reconcile(SLT_IPv6, servers, newer);
+}
+
+void BenchAddressParsing()
+{
+	/* A quarter of the game servers is reachable over IPv6 */
+	AddressKeyList ipv4, ipv6;
+	MakeBenchServers(ipv4, BENCH_REBUILD_SERVERS - BENCH_REBUILD_SERVERS / 4, false);
+	MakeBenchServers(ipv6, BENCH_REBUILD_SERVERS / 4, true);
+
+	std::vector<BenchRow> rows(BENCH_REBUILD_SERVERS);
+	for (uint i = 0; i < BENCH_REBUILD_SERVERS; i++) {
+		AddressKey *key = i < ipv4.Length() ? &ipv4[i] : &ipv6[i - ipv4.Length()];
+		NetworkAddress address = key->ToAddress();
+		strecpy(rows[i].ip, address.GetHostname(), lastof(rows[i].ip));
+		seprintf(rows[i].port, lastof(rows[i].port), "%u", key->port);
+	}
+
+	uint rounds = max(1U, (uint)BENCH_ENTRIES_PER_SIZE / BENCH_REBUILD_SERVERS);
+	AddressKeyList servers;
+	uint failed = 0;
+
+	uint64 start = GetBenchTime();
+	for (uint r = 0; r < rounds; r++) {
+		failed = ParseWithResolver(rows, servers);
+		Rebuild(servers);
+	}
+	ReportBench("rebuild from text: resolver", BENCH_REBUILD_SERVERS, rounds, GetBenchTime() - start);
+	if (failed != 0) printf("  %u of %u addresses could not be resolved\n", failed, BENCH_REBUILD_SERVERS);
+
+	start = GetBenchTime();
+	for (uint r = 0; r < rounds; r++) {
+		failed = ParseNumeric(rows, servers);
+		Rebuild(servers);
+	}
+	ReportBench("rebuild from text: inet_pton", BENCH_REBUILD_SERVERS, rounds, GetBenchTime() - start);
+	if (failed != 0) error("%u of %u numeric addresses could not be parsed", failed, BENCH_REBUILD_SERVERS);
+
+	/* Both ways must give the same keys for whatever the resolver could handle */
+	AddressKeyList resolved;
+	if (ParseWithResolver(rows, resolved) == 0) {
+		ParseNumeric(rows, servers);
+		for (uint i = 0; i < rows.size(); i++) {
+			if (!(resolved[i] == servers[i])) error("the keys of %s port %s differ", rows[i].ip, rows[i].port);
+		}
+	}
+}
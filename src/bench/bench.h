@@ -0,0 +1,61 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server/updater and content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "shared/address_key.h"
+
+/**
+ * @file bench/bench.h Helpers shared by the benchmarks
+ */
+
+/** The number of entries every benchmark is run with, to show how its cost grows */
+static const uint _bench_sizes[] = { 1000, 10000, 100000 };
+
+/**
+ * Some configuration constants
+ */
+enum {
+	BENCH_ENTRIES_PER_SIZE = 1000000, ///< Number of entries handled per benchmark and size; the smaller sizes are repeated more often
+};
+
+/**
+ * Get the current time, for timing a benchmark.
+ * @return the time in microseconds since some arbitrary moment
+ */
+uint64 GetBenchTime();
+
+/**
+ * Print the outcome of a benchmark.
+ * @param name    what has been measured
+ * @param entries the number of entries it was measured with
+ * @param rounds  the number of times it has been done
+ * @param usecs   the time all rounds took, in microseconds
+ */
+void ReportBench(const char *name, uint entries, uint rounds, uint64 usecs);
+
+/**
+ * Make a list of distinct game server addresses; every run gets the same ones.
+ * @param servers the list to fill
+ * @param count   the number of addresses to make
+ * @param ipv6    whether to make IPv6 instead of IPv4 addresses
+ */
+void MakeBenchServers(AddressKeyList &servers, uint count, bool ipv6);
+
+/** Rebuild the server list packets from the database's list of on-line servers */
+void BenchServerList();
+
+/** Look up, add and remove queried servers; also check the map still behaves like the std::map it replaced */
+void BenchAddressMap();
+
+/** Rebuild the server list from the textual addresses of the database, with and without the resolver */
+void BenchAddressParsing();
+
+#endif /* BENCH_H */
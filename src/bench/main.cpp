@@ -0,0 +1,60 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server/updater and content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shared/stdafx.h"
+#include "shared/string_func.h"
+#include "bench.h"
+#include <sys/time.h>
+
+#include "shared/safeguards.h"
+
+/**
+ * @file bench/main.cpp Benchmarks of the in-memory parts of the servers
+ */
+
+uint64 GetBenchTime()
+{
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void ReportBench(const char *name, uint entries, uint rounds, uint64 usecs)
+{
+	double per_round = (double)usecs / rounds;
+	printf("%-40s %6u entries: %10.1f us per round, %7.1f ns per entry\n", name, entries, per_round, per_round * 1000 / entries);
+}
+
+void MakeBenchServers(AddressKeyList &servers, uint count, bool ipv6)
+{
+	servers.Clear();
+	for (uint i = 0; i < count; i++) {
+		char ip[64];
+		if (ipv6) {
+			seprintf(ip, lastof(ip), "2001:db8::%x:%x", i >> 16, i & 0xFFFF);
+		} else {
+			seprintf(ip, lastof(ip), "10.%u.%u.%u", (i >> 16) & 0xFF, (i >> 8) & 0xFF, i & 0xFF);
+		}
+
+		/* Spread the game servers over a few ports, like on real hosts */
+		AddressKey *key = servers.Append();
+		if (!key->FromString(ip, 3979 + i % 4)) error("Cannot parse %s", ip);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	AddressKey::InitHash();
+
+	BenchServerList();
+	BenchAddressMap();
+	BenchAddressParsing();
+
+	return 0;
+}
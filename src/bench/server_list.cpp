@@ -0,0 +1,72 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shared/stdafx.h"
+#include "core/math_func.hpp"
+#include "masterserver/masterserver.h"
+#include "bench.h"
+
+#include "shared/safeguards.h"
+
+/**
+ * @file bench/server_list.cpp Benchmark of (re)building the server list packets
+ */
+
+void BenchServerList()
+{
+	for (uint i = 0; i < lengthof(_bench_sizes); i++) {
+		uint size = _bench_sizes[i];
+		uint rounds = max(1U, BENCH_ENTRIES_PER_SIZE / size);
+
+		AddressKeyList servers;
+		MakeBenchServers(servers, size, false);
+		AddressKeyList newer;
+
+		/* Everything is new, like when the master server starts */
+		uint64 start = GetBenchTime();
+		for (uint r = 0; r < rounds; r++) {
+			OnlineServerList *list = new OnlineServerList();
+			list->Reconcile(SLT_IPv4, servers, newer);
+			delete list;
+		}
+		ReportBench("server list: build from scratch", size, rounds, GetBenchTime() - start);
+
+		/* Nothing has changed, like most of the periodic reconciliations */
+		OnlineServerList list;
+		list.Reconcile(SLT_IPv4, servers, newer);
+		start = GetBenchTime();
+		for (uint r = 0; r < rounds; r++) {
+			list.Reconcile(SLT_IPv4, servers, newer);
+		}
+		ReportBench("server list: reconcile unchanged", size, rounds, GetBenchTime() - start);
+
+		/* A tenth of the servers went away, and as many others came */
+		AddressKeyList changed;
+		MakeBenchServers(changed, size + size / 10, false);
+		for (uint j = 0; j < size / 10; j++) changed.Erase(changed.Get(j * 10));
+		start = GetBenchTime();
+		for (uint r = 0; r < rounds; r++) {
+			list.Reconcile(SLT_IPv4, (r & 1) != 0 ? servers : changed, newer);
+		}
+		ReportBench("server list: reconcile 10% changed", size, rounds, GetBenchTime() - start);
+
+		/* The list has to be sane afterwards, or the numbers mean nothing */
+		const OnlineServerList::PacketList &packets = list.GetPackets(SLT_IPv4);
+		uint count = 0;
+		for (uint j = 0; j < packets.Length(); j++) {
+			/* Read it like the client does: the packet type, the list type and the count */
+			Packet *p = packets[j];
+			p->PrepareToRead();
+			p->Recv_uint8();
+			p->Recv_uint8();
+			count += p->Recv_uint16();
+		}
+		if (count != list.GetServers(SLT_IPv4).Length()) error("The server list packets hold %u servers instead of %u", count, list.GetServers(SLT_IPv4).Length());
+	}
+}
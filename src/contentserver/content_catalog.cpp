@@ -0,0 +1,423 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shared/stdafx.h"
+#include "shared/debug.h"
+#include "shared/string_func.h"
+#include "shared/core/alloc_func.hpp"
+#include "contentserver.h"
+#include "content_catalog.h"
+
+#include <stdlib.h>
+
+#include "shared/safeguards.h"
+
+/**
+ * @file contentserver/content_catalog.cpp In-memory copy of the content catalog
+ */
+
+/** Initial number of slots of an index; a power of two */
+static const uint INDEX_INITIAL_CAPACITY = 64;
+
+/**
+ * Spread the bits of a key over the slots of an index.
+ * @param key the key
+ * @return the hash of the key
+ */
+static inline uint HashKey(uint64 key)
+{
+	return (uint)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+ContentCatalog::Index::Index() : mask(INDEX_INITIAL_CAPACITY - 1), count(0)
+{
+	this->slots = CallocT<Slot>(INDEX_INITIAL_CAPACITY);
+}
+
+ContentCatalog::Index::~Index()
+{
+	free(this->slots);
+}
+
+ContentCatalog::Index::Slot *ContentCatalog::Index::Lookup(uint64 key) const
+{
+	for (uint i = HashKey(key) & this->mask;; i = (i + 1) & this->mask) {
+		Slot *slot = &this->slots[i];
+		if (slot->entry == 0 || slot->key == key) return slot;
+	}
+}
+
+void ContentCatalog::Index::Reset(uint capacity)
+{
+	/* Keep the load factor below one half, so the probe sequences stay short */
+	uint size = INDEX_INITIAL_CAPACITY;
+	while (size < capacity * 2) size *= 2;
+
+	if (size != this->mask + 1) {
+		free(this->slots);
+		this->slots = CallocT<Slot>(size);
+		this->mask = size - 1;
+	} else {
+		memset(this->slots, 0, sizeof(*this->slots) * size);
+	}
+	this->count = 0;
+}
+
+void ContentCatalog::Index::Add(uint64 key, uint entry)
+{
+	if ((this->count + 1) * 2 > this->mask + 1) {
+		Slot *old_slots = this->slots;
+		uint old_capacity = this->mask + 1;
+
+		this->mask = old_capacity * 2 - 1;
+		this->slots = CallocT<Slot>(this->mask + 1);
+
+		for (uint i = 0; i < old_capacity; i++) {
+			if (old_slots[i].entry != 0) *this->Lookup(old_slots[i].key) = old_slots[i];
+		}
+		free(old_slots);
+	}
+
+	Slot *slot = this->Lookup(key);
+	if (slot->entry != 0) return;
+
+	slot->key = key;
+	slot->entry = entry + 1;
+	this->count++;
+}
+
+uint ContentCatalog::Index::Find(uint64 key) const
+{
+	return this->Lookup(key)->entry - 1;
+}
+
+
+/**
+ * Copy content, including its tags and dependencies, into a content info of a request.
+ * @param dest       the content info to fill
+ * @param src        the content in the catalog
+ * @param extra_data whether to copy the complex data, such as MD5 sum or dependencies
+ */
+static void CopyContentInfo(ContentInfo *dest, const ContentInfo *src, bool extra_data)
+{
+	dest->id = src->id;
+	dest->type = src->type;
+	dest->filesize = src->filesize;
+	strecpy(dest->filename, src->filename, lastof(dest->filename));
+
+	if (!extra_data) return;
+
+	strecpy(dest->name, src->name, lastof(dest->name));
+	strecpy(dest->version, src->version, lastof(dest->version));
+	strecpy(dest->url, src->url, lastof(dest->url));
+	strecpy(dest->description, src->description, lastof(dest->description));
+	dest->unique_id = src->unique_id;
+	memcpy(dest->md5sum, src->md5sum, sizeof(dest->md5sum));
+
+	if (src->tag_count != 0) {
+		dest->tag_count = src->tag_count;
+		dest->tags = MallocT<char[32]>(src->tag_count);
+		memcpy(dest->tags, src->tags, sizeof(*src->tags) * src->tag_count);
+	}
+
+	if (src->dependency_count != 0) {
+		dest->dependency_count = src->dependency_count;
+		dest->dependencies = MallocT<ContentID>(src->dependency_count);
+		memcpy(dest->dependencies, src->dependencies, sizeof(*src->dependencies) * src->dependency_count);
+	}
+}
+
+/**
+ * Check whether content would be encoded the same in a PACKET_CONTENT_SERVER_INFO.
+ * @param a the first content
+ * @param b the second content
+ * @return true if the content is the same
+ */
+static bool IsSameContentInfo(const ContentInfo *a, const ContentInfo *b)
+{
+	if (a->type != b->type || a->id != b->id || a->filesize != b->filesize || a->unique_id != b->unique_id) return false;
+	if (strcmp(a->name, b->name) != 0 || strcmp(a->version, b->version) != 0 || strcmp(a->url, b->url) != 0 || strcmp(a->description, b->description) != 0) return false;
+	if (memcmp(a->md5sum, b->md5sum, sizeof(a->md5sum)) != 0) return false;
+
+	if (a->dependency_count != b->dependency_count) return false;
+	if (a->dependency_count != 0 && memcmp(a->dependencies, b->dependencies, sizeof(*a->dependencies) * a->dependency_count) != 0) return false;
+
+	if (a->tag_count != b->tag_count) return false;
+	for (uint i = 0; i < a->tag_count; i++) {
+		if (strcmp(a->tags[i], b->tags[i]) != 0) return false;
+	}
+	return true;
+}
+
+ContentCatalog::ContentCatalog(SQL *sql) :
+	sql(sql),
+	dirty(false),
+	loaded(false),
+	checked(0),
+	next_poll(0),
+	next_reload(0)
+{
+	this->md5sum_key.Randomize();
+	memset(this->type_begin, 0, sizeof(this->type_begin));
+}
+
+ContentCatalog::~ContentCatalog()
+{
+	this->Clear();
+}
+
+/* static */ int CDECL ContentCatalog::CompareEntries(const void *a, const void *b)
+{
+	const ContentInfo *ca = ((const Entry *)a)->info;
+	const ContentInfo *cb = ((const Entry *)b)->info;
+
+	if (ca == NULL || cb == NULL) return (ca == NULL) - (cb == NULL);
+	if (ca->type != cb->type) return ca->type < cb->type ? -1 : 1;
+	if (ca->unique_id != cb->unique_id) return ca->unique_id > cb->unique_id ? -1 : 1;
+	if (ca->id != cb->id) return ca->id < cb->id ? -1 : 1;
+	return 0;
+}
+
+uint64 ContentCatalog::GetMD5sumKey(ContentType type, uint32 unique_id, const uint8 md5sum[16]) const
+{
+	uint8 key[4 + 4 + 16];
+	uint32 t = type;
+	memcpy(key, &t, 4);
+	memcpy(key + 4, &unique_id, 4);
+	memcpy(key + 8, md5sum, 16);
+	return SipHash(this->md5sum_key, key, sizeof(key));
+}
+
+ContentCatalog::Entry *ContentCatalog::FindEntry(const ContentInfo *ci)
+{
+	if (!this->loaded) return NULL;
+
+	uint i = this->by_id.Find(ci->id);
+	if (i == UINT_MAX) return NULL;
+
+	/* Content that was not found keeps the ID it was asked for, or gets none at all */
+	const ContentInfo *src = this->entries[i].info;
+	if (src == NULL || src->type != ci->type || src->unique_id != ci->unique_id || memcmp(src->md5sum, ci->md5sum, sizeof(src->md5sum)) != 0) return NULL;
+
+	return &this->entries[i];
+}
+
+void ContentCatalog::Clear()
+{
+	for (Entry *e = this->entries.Begin(); e != this->entries.End(); e++) {
+		delete e->info;
+		delete e->previous;
+		free(e->info_packet);
+	}
+	this->entries.Clear();
+	this->by_id.Reset(0);
+	this->dirty = true;
+}
+
+ContentInfo *ContentCatalog::AddContent(ContentID id, bool published, uint32 min_version, int32 max_version)
+{
+	uint i = this->by_id.Find(id);
+	if (i == UINT_MAX) {
+		i = this->entries.Length();
+		Entry *e = this->entries.Append();
+		e->info = NULL;
+		e->previous = NULL;
+		e->info_packet = NULL;
+		this->by_id.Add(id, i);
+	}
+
+	/* Keep the replaced content until the indices are built again, to see whether its encoded info is still valid */
+	Entry *e = &this->entries[i];
+	if (e->previous == NULL) {
+		e->previous = e->info;
+	} else {
+		delete e->info;
+	}
+	e->info = new ContentInfo();
+	e->info->id = id;
+	e->published = published;
+	e->min_version = min_version;
+	e->max_version = max_version;
+
+	this->dirty = true;
+	return e->info;
+}
+
+void ContentCatalog::RemoveContent(ContentID id)
+{
+	uint i = this->by_id.Find(id);
+	if (i == UINT_MAX) return;
+
+	/* The entry is dropped when the indices are built again; until then the ID can be added again */
+	Entry *e = &this->entries[i];
+	delete e->info;
+	delete e->previous;
+	free(e->info_packet);
+	e->info = NULL;
+	e->previous = NULL;
+	e->info_packet = NULL;
+
+	this->dirty = true;
+}
+
+void ContentCatalog::Rebuild()
+{
+	for (Entry *e = this->entries.Begin(); e != this->entries.End(); e++) {
+		if (e->previous == NULL) continue;
+
+		if (e->info_packet != NULL && !IsSameContentInfo(e->previous, e->info)) {
+			free(e->info_packet);
+			e->info_packet = NULL;
+		}
+		delete e->previous;
+		e->previous = NULL;
+	}
+
+	qsort(this->entries.Begin(), this->entries.Length(), sizeof(Entry), CompareEntries);
+
+	while (this->entries.Length() != 0 && this->entries.End()[-1].info == NULL) {
+		this->entries.Erase(this->entries.End() - 1);
+	}
+
+	uint count = this->entries.Length();
+	this->by_id.Reset(count);
+	this->by_unique_id.Reset(count);
+	this->by_md5sum.Reset(count);
+
+	/* Within the same type and unique ID the content with the lowest ID comes first, and that one is kept in the indices */
+	uint type = 0;
+	for (uint i = 0; i < count; i++) {
+		const ContentInfo *ci = this->entries[i].info;
+		this->by_id.Add(ci->id, i);
+		this->by_unique_id.Add((uint64)ci->type << 32 | ci->unique_id, i);
+		this->by_md5sum.Add(this->GetMD5sumKey(ci->type, ci->unique_id, ci->md5sum), i);
+
+		for (; type <= (uint)ci->type && type <= CONTENT_TYPE_END; type++) this->type_begin[type] = i;
+	}
+	for (; type <= CONTENT_TYPE_END; type++) this->type_begin[type] = count;
+
+	this->dirty = false;
+}
+
+bool ContentCatalog::Read(bool full)
+{
+	uint64 modified, now;
+	if (!this->sql->GetContentCatalogModified(&modified, &now)) return false;
+
+	/* Nothing was modified since we read the catalog the last time */
+	if (!full && modified < this->checked) return true;
+
+	if (full) this->Clear();
+	bool success = this->sql->ReadContentCatalog(this, full ? 0 : this->checked);
+	if (this->dirty) this->Rebuild();
+
+	if (!success) {
+		/* Reading all content failed half way, so do not use what we have */
+		if (full) this->loaded = false;
+		DEBUG(misc, 0, "Could not read the content catalog");
+		return false;
+	}
+
+	/* Content modified in the same second as this check is read again the next time, which is harmless */
+	this->checked = now;
+	if (full) {
+		this->loaded = true;
+		this->next_reload = GetTime() + CONTENT_CATALOG_RELOAD_INTERVAL;
+	}
+	DEBUG(misc, full ? 1 : 3, "Read the content catalog; it contains %u items", this->entries.Length());
+	return true;
+}
+
+bool ContentCatalog::Load()
+{
+	this->next_poll = GetTime() + CONTENT_CATALOG_POLL_INTERVAL;
+	return this->Read(true);
+}
+
+void ContentCatalog::Poll()
+{
+	time_t now = GetTime();
+	if (now < this->next_poll) return;
+
+	this->next_poll = now + CONTENT_CATALOG_POLL_INTERVAL;
+	this->Read(!this->loaded || now >= this->next_reload);
+}
+
+bool ContentCatalog::FillContentDetails(ContentInfo info[], int length, SQL::ContentKey key, bool extra_data)
+{
+	if (!this->loaded) return this->sql->FillContentDetails(info, length, key, extra_data);
+
+	for (int i = 0; i < length; i++) {
+		uint e;
+		switch (key) {
+			case SQL::CK_ID:
+				e = this->by_id.Find(info[i].id);
+				break;
+
+			case SQL::CK_UNIQUEID:
+				e = this->by_unique_id.Find((uint64)info[i].type << 32 | info[i].unique_id);
+				break;
+
+			case SQL::CK_UNIQUEID_MD5: {
+				e = this->by_md5sum.Find(this->GetMD5sumKey(info[i].type, info[i].unique_id, info[i].md5sum));
+				if (e == UINT_MAX) break;
+
+				/* The key is a hash, so make sure it is really the content that is asked for */
+				const ContentInfo *ci = this->entries[e].info;
+				if (ci->type != info[i].type || ci->unique_id != info[i].unique_id || memcmp(ci->md5sum, info[i].md5sum, sizeof(ci->md5sum)) != 0) e = UINT_MAX;
+				break;
+			}
+
+			default:
+				return false;
+		}
+
+		if (e != UINT_MAX) CopyContentInfo(&info[i], this->entries[e].info, extra_data);
+	}
+
+	return true;
+}
+
+uint ContentCatalog::FindContentDetails(ContentInfo info[], int length, ContentType type, uint32 version)
+{
+	if (!this->loaded) return this->sql->FindContentDetails(info, length, type, version);
+	if (type < CONTENT_TYPE_BEGIN || type >= CONTENT_TYPE_END) return 0;
+
+	/* The entries of a type are sorted on unique ID, descending */
+	uint count = 0;
+	for (uint i = this->type_begin[type]; i < this->type_begin[type + 1] && (int)count < length; i++) {
+		const Entry &e = this->entries[i];
+		if (!e.published || e.min_version > version) continue;
+		if (e.max_version != -1 && (uint32)e.max_version < version) continue;
+
+		CopyContentInfo(&info[count++], e.info, true);
+	}
+
+	return count;
+}
+
+bool ContentCatalog::GetInfoPacket(const ContentInfo *ci, const byte **data, uint *size)
+{
+	const Entry *e = this->FindEntry(ci);
+	if (e == NULL || e->info_packet == NULL) return false;
+
+	*data = e->info_packet;
+	*size = e->info_packet_size;
+	return true;
+}
+
+void ContentCatalog::SetInfoPacket(const ContentInfo *ci, const byte *data, uint size)
+{
+	Entry *e = this->FindEntry(ci);
+	if (e == NULL || e->info_packet != NULL) return;
+
+	e->info_packet = MallocT<byte>(size);
+	e->info_packet_size = size;
+	memcpy(e->info_packet, data, size);
+}
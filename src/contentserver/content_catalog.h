@@ -0,0 +1,211 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONTENT_CATALOG_H
+#define CONTENT_CATALOG_H
+
+#include "shared/sql.h"
+#include "shared/siphash.h"
+
+#include <time.h>
+
+/**
+ * @file contentserver/content_catalog.h In-memory copy of the content catalog
+ */
+
+/** Timings of keeping the content catalog up to date */
+enum ContentCatalogTimings {
+	CONTENT_CATALOG_POLL_INTERVAL   =   30, ///< How often (in seconds) the database is checked for modified content
+	CONTENT_CATALOG_RELOAD_INTERVAL = 3600, ///< How often (in seconds) the whole catalog is read again, e.g. to forget deleted content
+};
+
+/**
+ * Copy of the active content, its tags and its dependencies, so the
+ * content server does not have to go to the database for every request.
+ * The catalog is read at startup; after that only the content that was
+ * modified since the last check is read again. When the catalog could
+ * not be read, the requests are passed on to the database.
+ */
+class ContentCatalog : public ContentCatalogBuilder {
+private:
+	/** Content in the catalog */
+	struct Entry {
+		ContentInfo *info;     ///< The information about the content, or NULL if it was removed
+		ContentInfo *previous; ///< The information before the content was read again, until the indices are built again
+		bool published;        ///< Whether the content is listed for its type
+		uint32 min_version;    ///< The minimum version of OpenTTD the content is listed for
+		int32 max_version;     ///< The maximum version of OpenTTD the content is listed for, or -1 if there is none
+		byte *info_packet;     ///< The encoded PACKET_CONTENT_SERVER_INFO of the content, or NULL if it has not been sent yet
+		uint info_packet_size; ///< The number of bytes of info_packet
+	};
+
+	/**
+	 * Hash index from a 64 bits key to an entry, using open addressing
+	 * with linear probing in a single flat array.
+	 */
+	class Index {
+	private:
+		/** A slot in the flat array */
+		struct Slot {
+			uint64 key;  ///< The key of the entry
+			uint entry;  ///< The position of the entry, plus one; 0 if the slot is free
+		};
+
+		Slot *slots; ///< The slots; always a power of two of them
+		uint mask;   ///< Number of slots minus one
+		uint count;  ///< Number of used slots
+
+		/**
+		 * Find the slot of the key, or the free slot the key would go in.
+		 * @param key the key to look for
+		 * @return the slot
+		 */
+		Slot *Lookup(uint64 key) const;
+
+	public:
+		/** Create an empty index */
+		Index();
+
+		/** Free the slots */
+		~Index();
+
+		/**
+		 * Remove all keys, and make room for the given number of keys.
+		 * @param capacity the number of keys that are going to be added
+		 */
+		void Reset(uint capacity);
+
+		/**
+		 * Add a key, unless it is in the index already.
+		 * @param key   the key to add
+		 * @param entry the position of the entry
+		 */
+		void Add(uint64 key, uint entry);
+
+		/**
+		 * Find the entry of a key.
+		 * @param key the key to look for
+		 * @return the position of the entry, or UINT_MAX if the key is not in the index
+		 */
+		uint Find(uint64 key) const;
+	};
+
+	SQL *sql;                              ///< The database to read the catalog from
+	SmallVector<Entry, 256> entries;       ///< The content, sorted on type and unique ID when the indices are up to date
+	Index by_id;                           ///< The content by its ID
+	Index by_unique_id;                    ///< The content by its type and unique ID
+	Index by_md5sum;                       ///< The content by its type, unique ID and MD5 checksum
+	SipHashKey md5sum_key;                 ///< Key for hashing the type, unique ID and MD5 checksum
+	uint type_begin[CONTENT_TYPE_END + 1]; ///< The first entry of each type, and the end of the entries of the last type
+	bool dirty;                            ///< Whether the content changed since the indices were built
+
+	bool loaded;                           ///< Whether the catalog has been read from the database
+	uint64 checked;                        ///< The time of the database when the catalog was last checked for modified content
+	time_t next_poll;                      ///< When to check for modified content again
+	time_t next_reload;                    ///< When to read the whole catalog again
+
+	/**
+	 * Get the key of content in the by_md5sum index.
+	 * @param type      the type of the content
+	 * @param unique_id the unique ID of the content
+	 * @param md5sum    the MD5 checksum of the content
+	 * @return the key
+	 */
+	uint64 GetMD5sumKey(ContentType type, uint32 unique_id, const uint8 md5sum[16]) const;
+
+	/**
+	 * Compare entries for sorting them on type, unique ID (descending, like
+	 * the listing is ordered) and ID; the removed entries go last.
+	 * @param a the first entry
+	 * @param b the second entry
+	 * @return the order of the entries
+	 */
+	static int CDECL CompareEntries(const void *a, const void *b);
+
+	/**
+	 * Find the entry a content info of a request was filled from.
+	 * @param ci the content info
+	 * @return the entry, or NULL if the content info does not match content in the catalog
+	 */
+	Entry *FindEntry(const ContentInfo *ci);
+
+	/** Forget all content */
+	void Clear();
+
+	/** Drop the removed content and the encoded info of changed content, sort the content and build the indices again */
+	void Rebuild();
+
+	/**
+	 * Read the content that was modified since the last check.
+	 * @param full whether to read the whole catalog instead
+	 * @return false if the content could not be read
+	 */
+	bool Read(bool full);
+
+public:
+	/**
+	 * Create the catalog; it is empty until Load is called.
+	 * @param sql the database to read the catalog from
+	 */
+	ContentCatalog(SQL *sql);
+
+	/** Free all content */
+	~ContentCatalog();
+
+	ContentInfo *AddContent(ContentID id, bool published, uint32 min_version, int32 max_version);
+	void RemoveContent(ContentID id);
+
+	/**
+	 * Read the whole catalog from the database.
+	 * @return false if the catalog could not be read
+	 */
+	bool Load();
+
+	/** Read the modified content from the database, if it is time to check for that */
+	void Poll();
+
+	/**
+	 * Fill the content information of the given list of infos.
+	 * @param info       table to store the results in (and read the keys from)
+	 * @param length     the length of the table
+	 * @param key        key to search the content with
+	 * @param extra_data whether to copy the complex data, such as MD5 sum or dependencies
+	 * @return true if the lookup was succesfull, false otherwise.
+	 */
+	bool FillContentDetails(ContentInfo info[], int length, SQL::ContentKey key, bool extra_data = true);
+
+	/**
+	 * Fill the content information of the content listed for a type and version of OpenTTD.
+	 * @param info    table to store the results in.
+	 * @param length  the length of the table.
+	 * @param type    the type to get a listing from.
+	 * @param version the version of OpenTTD to get a listing for.
+	 * @return the number of items that were found.
+	 */
+	uint FindContentDetails(ContentInfo info[], int length, ContentType type, uint32 version);
+
+	/**
+	 * Get the encoded PACKET_CONTENT_SERVER_INFO of content, i.e. the data after the packet type.
+	 * @param ci   the content info, as filled by this catalog
+	 * @param data the encoded data; only valid until the catalog is polled again
+	 * @param size the number of bytes of the encoded data
+	 * @return false if the content has not been encoded yet, or is not in the catalog
+	 */
+	bool GetInfoPacket(const ContentInfo *ci, const byte **data, uint *size);
+
+	/**
+	 * Remember the encoded PACKET_CONTENT_SERVER_INFO of content until the content changes.
+	 * @param ci   the content info, as filled by this catalog
+	 * @param data the encoded data, i.e. the data after the packet type
+	 * @param size the number of bytes of the encoded data
+	 */
+	void SetInfoPacket(const ContentInfo *ci, const byte *data, uint size);
+};
+
+#endif /* CONTENT_CATALOG_H */
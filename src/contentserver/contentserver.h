@@ -22,6 +22,9 @@
 /** Timeout for idle sockets: 2 minutes. */
 static const time_t IDLE_SOCKET_TIMEOUT = 60 * 2;
 
+/** Interval for writing the download counts to the database: 1 minute. */
+static const time_t DOWNLOADS_FLUSH_INTERVAL = 60;
+
 /**
  * Gets the monotonic time. The time will never jump back.
  * @return the time.
@@ -31,6 +34,7 @@ time_t GetTime();
 
 /* Forward declare  */
 class ServerNetworkContentSocketHandler;
+class ContentCatalog;
 
 /**
  * The content server "serves" content to the clients. Content can be
@@ -47,8 +51,14 @@ protected:
 	 */
 	void AcceptClients(SOCKET listen_socket);
 
+	/** Write the downloads since the previous flush to the database */
+	void FlushDownloads();
+
 	SocketList listen_sockets;                ///< Sockets we are listening on
 	ServerNetworkContentSocketHandler *first; ///< The first socket, part of linked list
+	ContentCatalog *catalog;                  ///< The content we serve
+	ContentIDList downloads;                  ///< The downloads that are not yet written to the database
+	time_t next_downloads_flush;              ///< When to write the downloads to the database again
 public:
 	/**
 	 * Create a new ContentServer given an SQL connection and host
@@ -70,6 +80,9 @@ protected:
 
 	ContentInfo *contentQueue; ///< Queue of content (files) to send to the client
 	FILE *contentFile;         ///< The currently read file
+	int contentFramed;         ///< The currently sent framed copy of a file, or -1
+	off_t contentFramedOffset; ///< The number of bytes of contentFramed that have been sent
+	off_t contentFramedSize;   ///< The size of contentFramed
 	uint contentFileId;        ///< The Id of the currently read file
 	uint contentQueueIter;     ///< Iterator over the contentQueue
 	uint contentQueueLength;   ///< Number of items in the contentQueue
@@ -88,6 +101,12 @@ protected:
 	 * @param infos the information to send.
 	 */
 	void SendInfo(uint32 count, const ContentInfo *infos);
+
+	/**
+	 * Send the next slice of the framed copy of the current file.
+	 * @return false if the socket cannot take more data for now
+	 */
+	bool SendFramedContent();
 public:
 	/**
 	 * Create a new cs socket handler for a given cs
@@ -102,8 +121,9 @@ public:
 
 	/**
 	 * Send the data of the content queue
+	 * @return false if the socket cannot take more data for now
 	 */
-	void SendQueue();
+	bool SendQueue();
 
 	/**
 	 * Check whether we have a content queue pending.
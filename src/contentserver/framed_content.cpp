@@ -0,0 +1,179 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shared/stdafx.h"
+#include "shared/debug.h"
+#include "shared/string_func.h"
+#include "shared/network/core/config.h"
+#include "shared/network/core/tcp_content.h"
+#include "framed_content.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shared/safeguards.h"
+
+/**
+ * @file contentserver/framed_content.cpp Content files that already contain the packets they are sent in
+ */
+
+/** Size of the header of a packet: its size and its type */
+static const uint FRAME_HEADER_SIZE = sizeof(PacketSize) + sizeof(PacketType);
+
+/** Number of bytes of the content file in a packet */
+static const uint FRAME_DATA_SIZE = SEND_MTU - FRAME_HEADER_SIZE;
+
+/**
+ * Identity of the content file a framed copy was made of. It is stored
+ * after the packets of the framed copy, so a content file that has been
+ * replaced can be detected even when its size and modification time in
+ * seconds are the same.
+ */
+struct FramedContentSource {
+	uint64 size;       ///< Size of the content file
+	uint64 inode;      ///< Inode of the content file; a replacement gets a new one
+	int64 mtime_sec;   ///< Modification time of the content file, in seconds
+	int64 mtime_nsec;  ///< Nanoseconds of the modification time of the content file
+};
+
+/**
+ * Get the identity of a content file.
+ * @param st     the status of the content file
+ * @param source the identity to fill
+ */
+static void GetFramedContentSource(const struct stat *st, FramedContentSource *source)
+{
+	/* Clear the padding as well, so identities can be compared with memcmp */
+	memset(source, 0, sizeof(*source));
+	source->size       = st->st_size;
+	source->inode      = st->st_ino;
+	source->mtime_sec  = st->st_mtim.tv_sec;
+	source->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+off_t GetFramedContentSize(uint32 filesize)
+{
+	/* Every packet with data gets a header, and the file is ended by an empty packet */
+	off_t packets = (filesize + FRAME_DATA_SIZE - 1) / FRAME_DATA_SIZE;
+	return (off_t)filesize + (packets + 1) * FRAME_HEADER_SIZE;
+}
+
+/**
+ * Write a packet to the framed copy of a content file.
+ * @param file   the framed copy
+ * @param buffer the packet, with room for the header before the data
+ * @param length the number of bytes of data in the packet
+ * @return true if the packet was written
+ */
+static bool WriteFrame(FILE *file, byte *buffer, size_t length)
+{
+	/* The size is sent in little endian, like Packet::PrepareToSend does */
+	PacketSize size = (PacketSize)(length + FRAME_HEADER_SIZE);
+	buffer[0] = (byte)(size & 0xFF);
+	buffer[1] = (byte)(size >> 8);
+	buffer[2] = PACKET_CONTENT_SERVER_CONTENT;
+	return fwrite(buffer, 1, size, file) == size;
+}
+
+bool FrameContentFile(const char *file_name)
+{
+	char framed_name[MAX_PATH];
+	char temp_name[MAX_PATH];
+	seprintf(framed_name, lastof(framed_name), "%s" FRAMED_CONTENT_SUFFIX, file_name);
+	seprintf(temp_name, lastof(temp_name), "%s.tmp", framed_name);
+
+	FILE *in = fopen(file_name, "rb");
+	if (in == NULL) {
+		DEBUG(misc, 0, "Opening %s failed (error[%i]: %s)", file_name, errno, strerror(errno));
+		return false;
+	}
+
+	/* Remember the version of the file we actually read, even when it is replaced while we read it */
+	struct stat content;
+	if (fstat(fileno(in), &content) != 0) {
+		DEBUG(misc, 0, "Getting the status of %s failed (error[%i]: %s)", file_name, errno, strerror(errno));
+		fclose(in);
+		return false;
+	}
+	FramedContentSource source;
+	GetFramedContentSource(&content, &source);
+
+	FILE *out = fopen(temp_name, "wb");
+	if (out == NULL) {
+		DEBUG(misc, 0, "Opening %s failed (error[%i]: %s)", temp_name, errno, strerror(errno));
+		fclose(in);
+		return false;
+	}
+
+	/* Split the file like ServerNetworkContentSocketHandler::SendQueue does when there is no framed copy */
+	byte buffer[SEND_MTU];
+	bool success = true;
+	for (;;) {
+		size_t res = fread(buffer + FRAME_HEADER_SIZE, 1, FRAME_DATA_SIZE, in);
+		if (ferror(in)) {
+			DEBUG(misc, 0, "Reading %s failed", file_name);
+			success = false;
+			break;
+		}
+
+		if (res != 0 && !WriteFrame(out, buffer, res)) success = false;
+		if (feof(in)) {
+			if (!WriteFrame(out, buffer, 0)) success = false;
+			if (fwrite(&source, sizeof(source), 1, out) != 1) success = false;
+			break;
+		}
+	}
+
+	fclose(in);
+	if (fclose(out) != 0) success = false;
+
+	/* Only replace the framed copy when the new one is complete, so it can be written while content is being served */
+	if (success && rename(temp_name, framed_name) != 0) {
+		DEBUG(misc, 0, "Renaming %s failed (error[%i]: %s)", temp_name, errno, strerror(errno));
+		success = false;
+	}
+	if (!success) {
+		DEBUG(misc, 0, "Writing %s failed", framed_name);
+		unlink(temp_name);
+		return false;
+	}
+
+	DEBUG(misc, 1, "Wrote %s", framed_name);
+	return true;
+}
+
+int OpenFramedContent(const char *file_name, uint32 filesize)
+{
+	char framed_name[MAX_PATH];
+	seprintf(framed_name, lastof(framed_name), "%s" FRAMED_CONTENT_SUFFIX, file_name);
+
+	int fd = open(framed_name, O_RDONLY);
+	if (fd == -1) return -1;
+
+	/* A framed copy that was made of another version of the content file is of no use */
+	off_t size = GetFramedContentSize(filesize);
+	struct stat framed, content;
+	FramedContentSource expected, stored;
+	bool up_to_date = fstat(fd, &framed) == 0 && stat(file_name, &content) == 0 &&
+			framed.st_size == size + (off_t)sizeof(stored) &&
+			pread(fd, &stored, sizeof(stored), size) == (ssize_t)sizeof(stored);
+	if (up_to_date) {
+		GetFramedContentSource(&content, &expected);
+		up_to_date = memcmp(&expected, &stored, sizeof(stored)) == 0;
+	}
+	if (!up_to_date) {
+		DEBUG(misc, 1, "%s is not up to date", framed_name);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
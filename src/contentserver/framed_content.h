@@ -0,0 +1,53 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMED_CONTENT_H
+#define FRAMED_CONTENT_H
+
+#include <sys/types.h>
+
+/**
+ * @file contentserver/framed_content.h Content files that already contain the packets they are sent in
+ *
+ * Next to a content file a framed copy of it can be stored, with the same
+ * name plus FRAMED_CONTENT_SUFFIX. That copy contains the file split into
+ * PACKET_CONTENT_SERVER_CONTENT packets, including the empty packet that
+ * ends the file, exactly like they are sent to the client. The content
+ * server sends it straight from the page cache to the socket; without an
+ * up to date framed copy the content file is packed into packets while
+ * it is sent. After the packets the framed copy records which version of
+ * the content file it was made of; that part is never sent.
+ */
+
+/** Suffix of the framed copy of a content file */
+#define FRAMED_CONTENT_SUFFIX ".framed"
+
+/**
+ * Get the size of the framed copy of a content file.
+ * @param filesize the size of the content file
+ * @return the size of the framed copy
+ */
+off_t GetFramedContentSize(uint32 filesize);
+
+/**
+ * Write the framed copy of a content file.
+ * @param file_name the name of the content file
+ * @return true if the framed copy was written
+ */
+bool FrameContentFile(const char *file_name);
+
+/**
+ * Open the framed copy of a content file, if it is up to date.
+ * @param file_name the name of the content file
+ * @param filesize  the size of the content file
+ * @return the file descriptor of the framed copy, or -1 if there is no up to date framed copy
+ */
+int OpenFramedContent(const char *file_name, uint32 filesize);
+
+#endif /* FRAMED_CONTENT_H */
@@ -11,6 +11,9 @@
 #include "shared/debug.h"
 #include "shared/network/core/core.h"
 #include "contentserver.h"
+#include "content_catalog.h"
+
+#include <unistd.h>
 
 #include "shared/safeguards.h"
 
@@ -34,6 +37,12 @@ ContentServer::ContentServer(SQL *sql, NetworkAddressList &addresses) : Server(s
 	}
 
 	if (this->listen_sockets.Length() == 0) error("Could not bind.");
+
+	/* Without the catalog the requests go to the database, until the catalog can be read */
+	this->catalog = new ContentCatalog(sql);
+	this->catalog->Load();
+
+	this->next_downloads_flush = GetTime() + DOWNLOADS_FLUSH_INTERVAL;
 }
 
 ContentServer::~ContentServer()
@@ -50,6 +59,12 @@ ContentServer::~ContentServer()
 		cur->cs = NULL;
 		delete cur;
 	}
+
+	/* Do not lose the downloads since the last flush */
+	this->FlushDownloads();
+	if (this->downloads.Length() != 0) DEBUG(misc, 0, "Lost %u downloads while shutting down", this->downloads.Length());
+
+	delete this->catalog;
 }
 
 void ContentServer::AcceptClients(SOCKET listen_socket)
@@ -69,6 +84,20 @@ void ContentServer::AcceptClients(SOCKET listen_socket)
 	}
 }
 
+void ContentServer::FlushDownloads()
+{
+	this->next_downloads_flush = GetTime() + DOWNLOADS_FLUSH_INTERVAL;
+	if (this->downloads.Length() == 0) return;
+
+	DEBUG(misc, 3, "Writing %u downloads", this->downloads.Length());
+	if (!this->sql->AddDownloads(this->downloads)) {
+		/* Keep them, so they are written with the next flush */
+		DEBUG(misc, 0, "Could not write %u downloads to the database", this->downloads.Length());
+		return;
+	}
+	this->downloads.Clear();
+}
+
 void ContentServer::RealRun()
 {
 	while (!this->stop_server) {
@@ -116,6 +145,9 @@ void ContentServer::RealRun()
 			}
 		}
 
+		this->catalog->Poll();
+		if (GetTime() >= this->next_downloads_flush) this->FlushDownloads();
+
 		time_t time = GetTime() - IDLE_SOCKET_TIMEOUT;
 
 		/* read stuff from clients/write to them */
@@ -125,7 +157,10 @@ void ContentServer::RealRun()
 				cs->writable = true;
 
 				while ((sps = cs->SendPackets()) == SPS_ALL_SENT && cs->HasQueue()) {
-					cs->SendQueue();
+					if (!cs->SendQueue()) {
+						sps = SPS_PARTLY_SENT;
+						break;
+					}
 				}
 				cs->last_activity = GetTime();
 			}
@@ -157,6 +192,7 @@ ServerNetworkContentSocketHandler::ServerNetworkContentSocketHandler(ContentServ
 
 	this->contentQueue       = NULL;
 	this->contentFile        = NULL;
+	this->contentFramed      = -1;
 	this->contentFileId      = 0;
 	this->contentQueueIter   = 0;
 	this->contentQueueLength = 0;
@@ -179,5 +215,8 @@ ServerNetworkContentSocketHandler::~ServerNetworkContentSocketHandler()
 	if (this->contentFile != NULL) fclose(this->contentFile);
 	this->contentFile = NULL;
 
+	if (this->contentFramed != -1) close(this->contentFramed);
+	this->contentFramed = -1;
+
 	delete [] this->contentQueue;
 }
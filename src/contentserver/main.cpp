@@ -11,6 +11,7 @@
 #include "shared/mysql.h"
 #include "shared/debug.h"
 #include "contentserver.h"
+#include "framed_content.h"
 
 #include "shared/safeguards.h"
 
@@ -19,13 +20,24 @@ int main(int argc, char *argv[])
 	bool fork = false;
 	NetworkAddressList addresses;
 
+	/* Instead of serving content, write the framed copies of the given content files */
+	if (argc > 1 && strcmp(argv[1], "-F") == 0) {
+		bool success = true;
+		for (int i = 2; i < argc; i++) {
+			if (!FrameContentFile(argv[i])) success = false;
+		}
+		return success ? 0 : 1;
+	}
+
 	ParseCommandArguments(argc, argv, addresses, NETWORK_CONTENT_SERVER_PORT, &fork, "contentserver");
 
-	SQL *sql = new MySQL(MYSQL_CONTENT_HOST, MYSQL_CONTENT_USER, MYSQL_CONTENT_PASS, MYSQL_CONTENT_DB, MYSQL_CONTENT_PORT);
+	MySQLPool *pool = new MySQLPool(MYSQL_CONTENT_HOST, MYSQL_CONTENT_USER, MYSQL_CONTENT_PASS, MYSQL_CONTENT_DB, MYSQL_CONTENT_PORT, 1);
+	SQL *sql = new MySQL(pool, MYSQL_CONTENT_BINARY_SCHEMA);
 	Server *server = new ContentServer(sql, addresses);
 	server->Run("contentserver.log", "contentserver", fork);
 	delete server;
 	delete sql;
+	delete pool;
 
 	return 0;
 }
@@ -11,8 +11,14 @@
 #include "shared/debug.h"
 #include "shared/core/alloc_func.hpp"
 #include "contentserver.h"
+#include "content_catalog.h"
+#include "framed_content.h"
 #include "path.h"
 
+#include <errno.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+
 #include "shared/safeguards.h"
 
 /**
@@ -27,7 +33,7 @@ bool ServerNetworkContentSocketHandler::Receive_CLIENT_INFO_LIST(Packet *p)
 	if (this->HasClientQuit()) return false;
 
 	ContentInfo ci[1024];
-	uint length = this->cs->GetSQLBackend()->FindContentDetails(ci, lengthof(ci), type, ottd_version);
+	uint length = this->cs->catalog->FindContentDetails(ci, lengthof(ci), type, ottd_version);
 
 	this->SendInfo(length, ci);
 
@@ -44,7 +50,7 @@ bool ServerNetworkContentSocketHandler::Receive_CLIENT_INFO_ID(Packet *p)
 	}
 
 	if (!this->HasClientQuit()) {
-		this->cs->GetSQLBackend()->FillContentDetails(ci, count, SQL::CK_ID);
+		this->cs->catalog->FillContentDetails(ci, count, SQL::CK_ID);
 		this->SendInfo(count, ci);
 	}
 
@@ -71,7 +77,7 @@ bool ServerNetworkContentSocketHandler::Receive_CLIENT_INFO_EXTID(Packet *p)
 	}
 
 	if (!this->HasClientQuit()) {
-		this->cs->GetSQLBackend()->FillContentDetails(ci, count, SQL::CK_UNIQUEID);
+		this->cs->catalog->FillContentDetails(ci, count, SQL::CK_UNIQUEID);
 		this->SendInfo(count, ci);
 	}
 
@@ -101,7 +107,7 @@ bool ServerNetworkContentSocketHandler::Receive_CLIENT_INFO_EXTID_MD5(Packet *p)
 	}
 
 	if (!this->HasClientQuit()) {
-		this->cs->GetSQLBackend()->FillContentDetails(ci, count, SQL::CK_UNIQUEID_MD5);
+		this->cs->catalog->FillContentDetails(ci, count, SQL::CK_UNIQUEID_MD5);
 		this->SendInfo(count, ci);
 	}
 
@@ -113,6 +119,17 @@ bool ServerNetworkContentSocketHandler::Receive_CLIENT_INFO_EXTID_MD5(Packet *p)
 void ServerNetworkContentSocketHandler::SendInfo(uint32 count, const ContentInfo *infos)
 {
 	for (; count != 0; count--, infos++) {
+		/* The info is the same for every client, so it is only encoded the first time it is sent */
+		const byte *data;
+		uint size;
+		if (this->cs->catalog->GetInfoPacket(infos, &data, &size)) {
+			Packet *p = new Packet(PACKET_CONTENT_SERVER_INFO);
+			memcpy(p->buffer + p->size, data, size);
+			p->size += size;
+			this->SendPacket(p);
+			continue;
+		}
+
 		/* Size of data + Packet size + packet type (byte) */
 		if (infos->Size() + sizeof(PacketSize) + sizeof(byte) >= SEND_MTU) {
 			DEBUG(misc, 0, "Info data bigger than packet size!");
@@ -120,6 +137,8 @@ void ServerNetworkContentSocketHandler::SendInfo(uint32 count, const ContentInfo
 		}
 
 		Packet *p = new Packet(PACKET_CONTENT_SERVER_INFO);
+		PacketSize header = p->size;
+
 		p->Send_uint8((byte)infos->type);
 		p->Send_uint32(infos->id);
 		p->Send_uint32(infos->filesize);
@@ -138,6 +157,7 @@ void ServerNetworkContentSocketHandler::SendInfo(uint32 count, const ContentInfo
 		p->Send_uint8(infos->tag_count);
 		for (uint i = 0; i < infos->tag_count; i++) p->Send_string(infos->tags[i]);
 
+		this->cs->catalog->SetInfoPacket(infos, p->buffer + header, p->size - header);
 		this->SendPacket(p);
 	}
 }
@@ -158,7 +178,7 @@ bool ServerNetworkContentSocketHandler::Receive_CLIENT_CONTENT(Packet *p)
 
 	assert(this->contentQueue == NULL);
 
-	this->cs->GetSQLBackend()->FillContentDetails(ci, count, SQL::CK_ID);
+	this->cs->catalog->FillContentDetails(ci, count, SQL::CK_ID);
 	this->contentQueue = ci;
 	this->contentQueueIter = 0;
 	this->contentQueueLength = count;
@@ -168,11 +188,47 @@ bool ServerNetworkContentSocketHandler::Receive_CLIENT_CONTENT(Packet *p)
 	return false;
 }
 
-void ServerNetworkContentSocketHandler::SendQueue()
+bool ServerNetworkContentSocketHandler::SendFramedContent()
+{
+	/* The header of the file, and anything else that was queued before it, has to go first */
+	if (this->SendPackets() != SPS_ALL_SENT) return false;
+
+	/* Send the file in slices of roughly 100.000 bytes, like when it is read into packets. */
+	size_t count = (size_t)min(this->contentFramedSize - this->contentFramedOffset, (off_t)(100 * 1000));
+	ssize_t res = sendfile(this->sock, this->contentFramed, &this->contentFramedOffset, count);
+
+	if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		this->writable = false;
+		return false;
+	}
+
+	if (res <= 0) {
+		if (res == 0) {
+			/* Nothing could be read anymore, so the framed copy has been truncated */
+			DEBUG(misc, 0, "Sending file %d failed: the framed copy ended early", this->contentFileId);
+		} else {
+			DEBUG(misc, 0, "Sending file %d failed (error[%i]: %s)", this->contentFileId, errno, strerror(errno));
+		}
+		close(this->contentFramed);
+		this->contentFramed = -1;
+		this->Close();
+		return false;
+	}
+
+	if (this->contentFramedOffset == this->contentFramedSize) {
+		close(this->contentFramed);
+		this->contentFramed = -1;
+	}
+
+	/* Only part of the slice was sent, so the socket is full */
+	return (size_t)res == count;
+}
+
+bool ServerNetworkContentSocketHandler::SendQueue()
 {
 	assert(this->contentQueue != NULL);
 
-	if (this->contentFile == NULL) {
+	if (this->contentFile == NULL && this->contentFramed == -1) {
 		ContentInfo *infos = &this->contentQueue[this->contentQueueIter];
 
 		char file_name[MAX_PATH];
@@ -188,24 +244,36 @@ void ServerNetworkContentSocketHandler::SendQueue()
 				this->contentFile = NULL;
 			} else {
 				fseek(this->contentFile, 0, SEEK_SET);
+
+				/* Rather send the framed copy without copying it; otherwise pack the file into packets ourselves */
+				this->contentFramed = OpenFramedContent(file_name, infos->filesize);
+				if (this->contentFramed != -1) {
+					fclose(this->contentFile);
+					this->contentFile = NULL;
+					this->contentFramedOffset = 0;
+					this->contentFramedSize = GetFramedContentSize(infos->filesize);
+				}
 			}
 		} else {
 			DEBUG(misc, 0, "Opening %s failed (error[%i]: %s)", file_name, errno, strerror(errno));
 		}
 
+		bool found = this->contentFile != NULL || this->contentFramed != -1;
 		Packet *p = new Packet(PACKET_CONTENT_SERVER_CONTENT);
 
 		p->Send_uint8((byte)infos->type);
 		p->Send_uint32(infos->id);
-		p->Send_uint32(this->contentFile == NULL ? 0 : infos->filesize);
+		p->Send_uint32(found ? infos->filesize : 0);
 		p->Send_string(infos->filename);
 
 		this->SendPacket(p);
-		this->cs->GetSQLBackend()->IncrementDownloadCount(infos->id);
+		*this->cs->downloads.Append() = infos->id;
 
 		this->contentFileId = infos->id;
 	}
 
+	if (this->contentFramed != -1 && !this->SendFramedContent()) return false;
+
 	if (this->contentFile != NULL) {
 		/* Read the file in slices of roughly 100.000 bytes. */
 		for (uint i = 0; i < (100 * 1000 / SEND_MTU); i++) {
@@ -218,7 +286,7 @@ void ServerNetworkContentSocketHandler::SendQueue()
 				this->contentFile = NULL;
 				this->Close();
 				delete p;
-				return;
+				return false;
 			}
 
 			if (res == 0) {
@@ -241,7 +309,7 @@ void ServerNetworkContentSocketHandler::SendQueue()
 		this->SendPackets();
 	}
 
-	if (this->contentFile == NULL) {
+	if (this->contentFile == NULL && this->contentFramed == -1) {
 		this->contentQueueIter++;
 
 		if (this->contentQueueIter == this->contentQueueLength) {
@@ -249,6 +317,8 @@ void ServerNetworkContentSocketHandler::SendQueue()
 			this->contentQueue = NULL;
 		}
 	}
+
+	return true;
 }
 
 bool ServerNetworkContentSocketHandler::HasQueue()
@@ -10,27 +10,52 @@
 #include "shared/stdafx.h"
 #include "shared/debug.h"
 #include "shared/mysql.h"
+#include "shared/object_pool.hpp"
 #include "masterserver.h"
 #include <time.h>
 
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
 #include "shared/safeguards.h"
 
 /**
- * @file masterserver/handler.cpp Handler of retries and updating the server list packet sent to clients
+ * @file masterserver/handler.cpp Handler of retries and keeping the list of on-line servers up-to-date
  */
 
 /* Requerying of game servers */
 
+/** The pool the queried servers are allocated from */
+static ObjectPool<MSQueriedServer> _ms_queried_server_pool;
+
+void *MSQueriedServer::operator new(size_t size)
+{
+	return _ms_queried_server_pool.Allocate(size);
+}
+
+void MSQueriedServer::operator delete(void *ptr)
+{
+	_ms_queried_server_pool.Free(ptr);
+}
+
+/* static */ void MSQueriedServer::LogPoolOccupancy()
+{
+	DEBUG(misc, 4, "[pool] %u of %u queried servers in use, %u bytes allocated",
+			_ms_queried_server_pool.GetItemsInUse(), _ms_queried_server_pool.GetItemsAllocated(),
+			(uint)_ms_queried_server_pool.GetBytesAllocated());
+}
+
 MSQueriedServer::MSQueriedServer(const NetworkAddress &query_address, const NetworkAddress &reply_address, uint64 session_key, uint frame) : QueriedServer(query_address, frame)
 {
 	this->reply_address = reply_address;
 	this->session_key = session_key;
 }
 
-void MSQueriedServer::DoAttempt(UDPServer *server)
+bool MSQueriedServer::DoAttempt(UDPServer *server)
 {
 	/* Not yet waited long enough for a next attempt */
-	if (this->frame + SERVER_QUERY_TIMEOUT > server->GetFrame()) return;
+	if (this->frame + SERVER_QUERY_TIMEOUT > server->GetFrame()) return true;
 
 	/* The server did not respond in time, retry */
 	this->attempts++;
@@ -39,9 +64,7 @@ void MSQueriedServer::DoAttempt(UDPServer *server)
 		/* We tried too many times already */
 		DEBUG(net, 4, "[retry] too many server query attempts for %s", this->server_address.GetAddressAsString());
 
-		server->RemoveQueriedServer(this);
-		delete this;
-		return;
+		return false;
 	}
 
 	DEBUG(net, 4, "[retry] querying %s", this->server_address.GetAddressAsString());
@@ -50,15 +73,17 @@ void MSQueriedServer::DoAttempt(UDPServer *server)
 	this->SendFindGameServerPacket(server->GetQuerySocket());
 
 	this->frame = server->GetFrame();
+	return true;
 }
 
-MasterServer::MasterServer(SQL *sql, NetworkAddressList *addresses) : UDPServer(sql)
+MasterServer::MasterServer(SQL *sql, NetworkAddressList *addresses) : UDPServer(sql),
+	cookies(NULL),
+	server_list(NULL),
+	server_list_changed(false),
+	forward_event(-1),
+	reconcile_requested(false),
+	reconcile_skips(0)
 {
-	for (uint i = 0; i < SLT_END; i++) {
-		this->serverlist_packet[i]        = NULL;
-		this->update_serverlist_packet[i] = true;
-		this->next_serverlist_frame[i]    = 0;
-	}
 	/* The first range of 32+16 bits (IPv4 + port) needs to be free for
 	 * backward compatability. As currently time already is beyond 2^31,
 	 * we only need 17 more 'bits'. The other 3 are to make the session
@@ -66,10 +91,26 @@ MasterServer::MasterServer(SQL *sql, NetworkAddressList *addresses) : UDPServer(
 	this->session_key              = time(NULL) << 20;
 	srandom(this->session_key);
 
+	if (REGISTRATION_COOKIE_SLOTS > 0) this->cookies = new RegistrationCookieTable(REGISTRATION_COOKIE_SLOTS);
+
+	pthread_mutex_init(&this->server_list_mutex, NULL);
+	pthread_mutex_init(&this->forward_mutex, NULL);
+
 	this->master_socket = new MasterNetworkUDPSocketHandler(this, addresses);
 
-	/* Bind master socket*/
-	if (!this->master_socket->Listen()) error("Could not bind listening socket\n");
+	/* Bind master socket; the workers bind to the same addresses and port */
+	if (!this->master_socket->Listen(MASTER_SERVER_WORKERS > 0)) error("Could not bind listening socket\n");
+
+	for (uint i = 0; i < MASTER_SERVER_WORKERS; i++) {
+		*this->workers.Append() = new MasterWorker(this, addresses);
+	}
+
+#if defined(__linux__)
+	if (MASTER_SERVER_WORKERS > 0) {
+		this->forward_event = eventfd(0, EFD_NONBLOCK);
+		if (this->forward_event < 0) error("Could not create event for forwarded packets");
+	}
+#endif
 
 	for (NetworkAddress *addr = addresses->Begin(); addr != addresses->End(); addr++) {
 		addr->SetPort(0);
@@ -77,13 +118,120 @@ MasterServer::MasterServer(SQL *sql, NetworkAddressList *addresses) : UDPServer(
 
 	this->query_socket = new QueryNetworkUDPSocketHandler(this, addresses);
 	if (!this->query_socket->Listen()) error("Could not bind query socket\n");
+
+	/* Get the initial list of on-line servers; nothing is waiting for answers yet, so just read it */
+	AddressKeyList active[SLT_END];
+	this->sql->GetActiveServers(active[SLT_IPv4], false);
+	this->sql->GetActiveServers(active[SLT_IPv6], true);
+	this->ReconcileServerList(active);
+	this->PublishServerList();
 }
 
 MasterServer::~MasterServer()
 {
+	/* Do not lose the re-advertisements since the last flush */
+	this->FlushReadvertisements();
+
+	/* The workers have to be gone before the things they use */
+	for (MasterWorker **worker = this->workers.Begin(); worker != this->workers.End(); worker++) {
+		delete *worker;
+	}
+
+	for (ForwardedPacket *fp = this->forwarded_packets.Begin(); fp != this->forwarded_packets.End(); fp++) {
+		delete fp->packet;
+	}
+	if (this->forward_event >= 0) close(this->forward_event);
+
+	if (this->server_list != NULL) this->server_list->Release();
+	pthread_mutex_destroy(&this->forward_mutex);
+	pthread_mutex_destroy(&this->server_list_mutex);
+
 	delete this->master_socket;
-	for (uint i = 0; i < SLT_END; i++) {
-		delete this->serverlist_packet[i];
+	delete this->cookies;
+}
+
+void MasterServer::RealRun()
+{
+	/* Threads do not survive forking, so start them just now */
+	for (MasterWorker **worker = this->workers.Begin(); worker != this->workers.End(); worker++) {
+		if (!(*worker)->Start()) error("Could not start worker thread");
+	}
+
+	UDPServer::RealRun();
+}
+
+void MasterServer::EventsHandled()
+{
+	this->HandleForwardedPackets();
+
+	/* Only publish once per round of events, instead of for every change */
+	if (this->server_list_changed) this->PublishServerList();
+}
+
+void MasterServer::PublishServerList()
+{
+	this->server_list_changed = false;
+
+	/* The main thread sends the live packets; only the workers need a copy */
+	if (this->workers.Length() == 0) return;
+
+	ServerListSnapshot *server_list = new ServerListSnapshot(&this->online_servers, this->server_list);
+	this->online_servers.ClearChanged();
+
+	pthread_mutex_lock(&this->server_list_mutex);
+	ServerListSnapshot *old = this->server_list;
+	this->server_list = server_list;
+	pthread_mutex_unlock(&this->server_list_mutex);
+
+	/* Threads still sending the old one keep it alive until they are done */
+	if (old != NULL) old->Release();
+}
+
+ServerListSnapshot *MasterServer::AcquireServerList()
+{
+	pthread_mutex_lock(&this->server_list_mutex);
+	ServerListSnapshot *server_list = this->server_list;
+	server_list->AddReference();
+	pthread_mutex_unlock(&this->server_list_mutex);
+
+	return server_list;
+}
+
+void MasterServer::ForwardPacket(Packet *p, NetworkAddress *client_addr)
+{
+	Packet *copy = new Packet(this->master_socket);
+	memcpy(copy->buffer, p->buffer, p->size);
+	copy->size = p->size;
+
+	pthread_mutex_lock(&this->forward_mutex);
+	ForwardedPacket *fp = this->forwarded_packets.Append();
+	fp->packet  = copy;
+	fp->address = *client_addr;
+	pthread_mutex_unlock(&this->forward_mutex);
+
+	/* Wake up the main thread */
+	uint64 one = 1;
+	if (this->forward_event >= 0 && write(this->forward_event, &one, sizeof(one)) != sizeof(one)) {
+		DEBUG(net, 1, "[worker] could not wake up the main thread");
+	}
+}
+
+void MasterServer::HandleForwardedPackets()
+{
+	if (this->workers.Length() == 0) return;
+
+	/* Take the packets, so the workers are not blocked while we handle them */
+	SmallVector<ForwardedPacket, 32> packets;
+	pthread_mutex_lock(&this->forward_mutex);
+	for (ForwardedPacket *fp = this->forwarded_packets.Begin(); fp != this->forwarded_packets.End(); fp++) {
+		*packets.Append() = *fp;
+	}
+	this->forwarded_packets.Clear();
+	pthread_mutex_unlock(&this->forward_mutex);
+
+	for (ForwardedPacket *fp = packets.Begin(); fp != packets.End(); fp++) {
+		this->master_socket->HandleForwardedPacket(fp->packet, &fp->address);
+		delete fp->packet;
 	}
 }
 
@@ -99,97 +247,141 @@ void MasterServer::ReceivePackets()
 	this->master_socket->ReceivePackets();
 }
 
-uint64 MasterServer::NextSessionKey()
+void MasterServer::GetSocketHandlers(SocketHandlerList &handlers)
 {
-	this->session_key += 1 + (random() & 0xFF);
-	return this->session_key;
+	UDPServer::GetSocketHandlers(handlers);
+	*handlers.Append() = this->master_socket;
 }
 
-/**
- * Helper to create a packet with addresses.
- * @param servers The server addresses to send.
- * @param count   The amount of servers to send.
- * @param type    The type of address to send.
- * @return The just created packet with addresses.
- */
-Packet *CreateAddressPacket(NetworkAddress *servers, int count, ServerListType type)
-{
-	Packet *p = new Packet(PACKET_UDP_MASTER_RESPONSE_LIST);
-	p->Send_uint8(type + 1);
-	/* Fill the packet */
-	p->Send_uint16(count);
-	for (int i = 0; i < count; i++) {
-		if (type == SLT_IPv6) {
-			byte *addr = (byte*)&((sockaddr_in6*)servers[i].GetAddress())->sin6_addr;
-			for (uint i = 0; i < sizeof(in6_addr); i++) p->Send_uint8(*addr++);
+void MasterServer::CheckServers()
+{
+	/* First handle the requeries of sent packets */
+	UDPServer::CheckServers();
+
+	if (this->GetFrame() % READVERTISE_FLUSH_INTERVAL == 0) this->FlushReadvertisements();
+
+	/* Apply the active servers as soon as the database has read them */
+	if (this->reconcile_requested) this->ReconcileServerList();
+
+	if (this->GetFrame() % SERVER_LIST_RECONCILE_INTERVAL != 0) return;
+	this->RequestServerList();
+	MSQueriedServer::LogPoolOccupancy();
+	this->LogDroppedPackets();
+	this->LogWriteQueue();
+}
+
+void MasterServer::LogDroppedPackets()
+{
+	uint dropped[DR_END];
+	for (uint i = 0; i < DR_END; i++) {
+		dropped[i] = this->master_socket->GetDropped((DropReason)i);
+
+		/* The counters of the workers are only read, so a slightly old value is good enough */
+		for (MasterWorker **worker = this->workers.Begin(); worker != this->workers.End(); worker++) {
+			dropped[i] += (*worker)->GetSocket()->GetDropped((DropReason)i);
+		}
+	}
+
+	DEBUG(net, 2, "[drop] %u packets dropped for rate limiting, %u for load shedding", dropped[DR_RATE_LIMITED], dropped[DR_SHED]);
+}
+
+void MasterServer::LogWriteQueue()
+{
+	DEBUG(sql, 2, "[backlog] %u writes queued, %u dropped for a full queue", this->sql->GetWriteBacklog(), this->sql->GetDroppedWrites());
+}
+
+void MasterServer::RequestServerList()
+{
+	/* The database is still busy with the previous request, e.g. because it is slow or gone; never wait for it */
+	if (this->reconcile_requested) {
+		this->reconcile_skips++;
+		if (this->reconcile_skips < SERVER_LIST_RECONCILE_SKIPS) {
+			DEBUG(net, 4, "[server list] not reconciling; the active servers have not been read yet");
 		} else {
-			p->Send_uint32(((sockaddr_in*)servers[i].GetAddress())->sin_addr.s_addr);
+			DEBUG(net, 1, "[server list] not reconciled %u times in a row; the active servers have not been read yet", this->reconcile_skips);
 		}
-		p->Send_uint16(servers[i].GetPort());
+		return;
 	}
+	this->reconcile_skips = 0;
 
-	return p;
+	/* The active servers are read after the writes queued so far; the changes after this are newer than what is read */
+	this->sql->RequestActiveServers();
+	this->reconcile_requested = true;
+	this->reconcile_changed.Clear();
 }
 
-/**
- * Returns the packets with the game server list. This packet will
- * be updated/regenerated whenever needed, i.e. when we know a server
- * went online/offline or after a timeout as the updater can change
- * the state of a server too.
- * @param type the type of addresses to return.
- * @return the serverlist packet
- * @post return != NULL
- */
-Packet *MasterServer::GetServerListPacket(ServerListType type)
-{
-	/* Rebuild the packet only once in a while */
-	if (this->update_serverlist_packet[type] || this->next_serverlist_frame[type] < this->frame) {
-		DEBUG(net, 4, "[server list] rebuilding the IPv%d server list", 4 + type * 2);
-		NetworkAddress servers[1024];
-		uint16 count = this->sql->GetActiveServers(servers, lengthof(servers), type == SLT_IPv6);
-
-		/*
-		 * Due to the limited size of the packet, and the fact that we only send
-		 * one packet with advertised servers, we have to limit the amount of
-		 * servers we can put into the packet.
-		 *
-		 * For this we use the maximum size of the packet, substract the bytes
-		 * needed for the PacketSize, PacketType information (as in all packets)
-		 * and the count of servers. This gives the number of bytes we can use
-		 * to place the advertised servers in. Which is then divided by the
-		 * amount of bytes needed to encode the IP address and the port of a
-		 * single server.
-		 *
-		 * For IPv6 addresses we send an in6_addr and for IPv4 address an in_addr.
-		 */
-		static const uint16 max_count[SLT_END] = {
-			(SAFE_MTU - sizeof(PacketSize) - sizeof(PacketType) - sizeof(count)) / (sizeof(in_addr) + sizeof(uint16)),
-			(SAFE_MTU - sizeof(PacketSize) - sizeof(PacketType) - sizeof(count)) / (sizeof(in6_addr) + sizeof(uint16))
-		};
-
-		Packet *p = this->serverlist_packet[type];
-		while (p != NULL) {
-			Packet *cur = p;
-			p = p->next;
-			delete cur;
+void MasterServer::ReconcileServerList()
+{
+	AddressKeyList active[SLT_END];
+	if (!this->sql->TakeActiveServers(active[SLT_IPv4], active[SLT_IPv6])) return;
+
+	this->ReconcileServerList(active);
+	this->reconcile_requested = false;
+}
+
+void MasterServer::ReconcileServerList(AddressKeyList active[SLT_END])
+{
+	for (uint i = 0; i < SLT_END; i++) {
+		ServerListType type = (ServerListType)i;
+
+		if (this->online_servers.Reconcile(type, active[i], this->reconcile_changed)) {
+			DEBUG(net, 4, "[server list] IPv%d server list changed in the database", 4 + type * 2);
+			this->server_list_changed = true;
 		}
-		this->serverlist_packet[type] = NULL;
-
-		NetworkAddress *cur_servers = servers;
-		do {
-			uint cur_count = min(count, max_count[type]);
-			Packet *p = CreateAddressPacket(cur_servers, cur_count, type);
-			count -= cur_count;
-			cur_servers += cur_count;
-
-			p->next = this->serverlist_packet[type];
-			this->serverlist_packet[type] = p;
-		} while (count > 0);
-
-		/* Schedule the next retry */
-		this->next_serverlist_frame[type]    = this->frame + GAME_SERVER_LIST_AGE;
-		this->update_serverlist_packet[type] = false;
 	}
+}
+
+void MasterServer::MakeServerOnline(MSQueriedServer *qs)
+{
+	this->sql->MakeServerOnline(qs);
+
+	AddressKey key;
+	if (!key.FromAddress(qs->GetServerAddress())) return;
+
+	if (this->reconcile_requested) *this->reconcile_changed.Append() = key;
+	if (this->online_servers.Add(key)) this->server_list_changed = true;
+	this->online_servers.SetVerified(key, qs->GetSessionKey(), this->GetFrame());
+}
 
-	return this->serverlist_packet[type];
+bool MasterServer::HandleReadvertisement(NetworkAddress *query_addr, NetworkAddress *reply_addr, uint64 session_key)
+{
+	AddressKey key;
+	if (!key.FromAddress(query_addr)) return false;
+
+	uint frame = this->GetFrame();
+	uint since_frame = frame > READVERTISE_VERIFY_INTERVAL ? frame - READVERTISE_VERIFY_INTERVAL : 0;
+	if (!this->online_servers.IsVerified(key, session_key, since_frame)) return false;
+
+	DEBUG(net, 4, "re-advertisement of %s handled without querying", query_addr->GetAddressAsString());
+
+	*this->readvertised.Append() = key;
+
+	Packet packet(PACKET_UDP_MASTER_ACK_REGISTER);
+	this->master_socket->SendPacket(&packet, reply_addr);
+	return true;
+}
+
+void MasterServer::FlushReadvertisements()
+{
+	if (this->readvertised.Length() == 0) return;
+
+	this->sql->UpdateLastAdvertised(this->readvertised);
+	this->readvertised.Clear();
+}
+
+void MasterServer::MakeServerOffline(QueriedServer *qs)
+{
+	this->sql->MakeServerOffline(qs);
+
+	AddressKey key;
+	if (!key.FromAddress(qs->GetServerAddress())) return;
+
+	if (this->reconcile_requested) *this->reconcile_changed.Append() = key;
+	if (this->online_servers.Remove(key)) this->server_list_changed = true;
+}
+
+uint64 MasterServer::NextSessionKey()
+{
+	this->session_key += 1 + (random() & 0xFF);
+	return this->session_key;
 }
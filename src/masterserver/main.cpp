@@ -9,6 +9,7 @@
 
 #include "shared/stdafx.h"
 #include "shared/mysql.h"
+#include "shared/threaded_sql.h"
 #include "shared/debug.h"
 #include "masterserver.h"
 
@@ -21,11 +22,17 @@ int main(int argc, char *argv[])
 
 	ParseCommandArguments(argc, argv, addresses, NETWORK_MASTER_SERVER_PORT, &fork, "masterserver");
 
-	SQL *sql = new MySQL(MYSQL_MSU_HOST, MYSQL_MSU_USER, MYSQL_MSU_PASS, MYSQL_MSU_DB, MYSQL_MSU_PORT);
+	/* The state changes are written by a separate thread, which needs a connection of its own */
+	MySQLPool *pool = new MySQLPool(MYSQL_MSU_HOST, MYSQL_MSU_USER, MYSQL_MSU_PASS, MYSQL_MSU_DB, MYSQL_MSU_PORT, SQL_WRITE_QUEUE_SIZE > 0 ? 2 : 1);
+	SQL *sql = new MySQL(pool, MYSQL_MSU_BINARY_SCHEMA);
+	if (SQL_WRITE_QUEUE_SIZE > 0) {
+		sql = new ThreadedSQL(sql, new MySQL(pool, MYSQL_MSU_BINARY_SCHEMA), SQL_WRITE_QUEUE_SIZE);
+	}
 	Server *server = new MasterServer(sql, &addresses);
 	server->Run("masterserver.log", "masterserver", fork);
 	delete server;
 	delete sql;
+	delete pool;
 
   return 0;
 }
@@ -11,6 +11,10 @@
 #define MASTERSERVER_H
 
 #include "shared/udp_server.h"
+#include "shared/address_key.h"
+#include "shared/rate_limiter.h"
+#include "shared/siphash.h"
+#include <pthread.h>
 
 /**
  * @file masterserver/masterserver.h Configuration and classes used by the master server
@@ -20,7 +24,18 @@
  * Some configuration constants
  */
 enum {
-	GAME_SERVER_LIST_AGE  = 10, ///< Maximum age of the serverlist packet in frames
+	SERVER_LIST_RECONCILE_INTERVAL = 30, ///< How often (in frames) the in-memory server list is reconciled with the database
+	SERVER_LIST_RECONCILE_SKIPS    =  4, ///< How often in a row the reconciliation may be skipped while the database is still reading the active servers, before that is logged as a warning
+	MASTER_SERVER_WORKERS          =  0, ///< Number of extra threads answering on the master socket; 0 handles everything in the main thread
+	SQL_WRITE_QUEUE_SIZE           = 4096, ///< Maximum number of server state changes queued for the SQL writer thread; 0 writes them directly
+	READVERTISE_VERIFY_INTERVAL    = 3600, ///< How long (in frames) a verified server may re-advertise without being queried again
+	READVERTISE_FLUSH_INTERVAL     =    5, ///< How often (in frames) the re-advertisements are written to the database
+
+	REGISTRATION_COOKIE_SLOTS     =    0, ///< Number of slots (a power of two) for verifying registrations without per-registration state; 0 queries with retries instead. A registration whose slot is still pending for another server is ignored, so the server registers again
+
+	RATE_LIMIT_SOURCES            = 4096, ///< Number of source prefixes the master socket keeps track of for rate limiting
+	RATE_LIMIT_PACKETS_PER_SECOND =   50, ///< Number of packets a source prefix may make us send per second
+	RATE_LIMIT_BURST              =  500, ///< Number of packets a source prefix may make us send in a burst
 
 	SERVER_QUERY_TIMEOUT  =  5, ///< How many frames it takes for a server to time out
 	SERVER_QUERY_ATTEMPTS =  3, ///< How many times do we try to query?
@@ -28,6 +43,13 @@ enum {
 	SAFE_MTU = 1360, ///< Safe threshold for MTUs, some networks don't like big ones.
 };
 
+/** Reasons for dropping packets on the master socket */
+enum DropReason {
+	DR_RATE_LIMITED, ///< The source prefix has sent too many requests
+	DR_SHED,         ///< We were too busy to handle the request
+	DR_END,          ///< End marker
+};
+
 class MSQueriedServer : public QueriedServer {
 protected:
 	friend class MasterNetworkUDPSocketHandler;
@@ -43,7 +65,26 @@ public:
 	 */
 	MSQueriedServer(const NetworkAddress &query_address, const NetworkAddress &reply_address, uint64 session_key, uint frame);
 
-	void DoAttempt(UDPServer *server);
+	/**
+	 * Allocate the memory for a queried server from the pool.
+	 * @param size the size of the queried server
+	 * @return the memory
+	 */
+	void *operator new(size_t size);
+
+	/**
+	 * Return the memory of a queried server to the pool.
+	 * @param ptr the memory of the queried server
+	 */
+	void operator delete(void *ptr);
+
+	/**
+	 * Log the occupancy of the pool the queried servers are allocated from.
+	 */
+	static void LogPoolOccupancy();
+
+	bool DoAttempt(UDPServer *server);
+	uint GetAttemptInterval() const { return SERVER_QUERY_TIMEOUT; }
 
 	/**
 	 * Gets the address this game server has used to query us.
@@ -54,18 +95,382 @@ public:
 	/* virtual */ uint64 GetSessionKey() const { return this->session_key; }
 };
 
+/**
+ * The in-memory list of on-line game servers. It is updated directly when
+ * game servers (un)register and reconciled with the persistent storage
+ * every once in a while, as the updater can change the state of a server
+ * too. It is split per address family so building the server list packet
+ * does not need to filter anything.
+ *
+ * The list also maintains the server list packets that are sent to the
+ * clients. The n-th server is always in the (n / max entries)-th packet,
+ * so adding and removing a server only patches the affected slots of the
+ * cached packets instead of rebuilding all of them.
+ */
+class OnlineServerList {
+private:
+	/** What we know of an on-line server */
+	struct ServerState {
+		uint index;          ///< Position of the server in the servers list
+		uint64 session_key;  ///< The session key the server was verified with; 0 if it has not been verified by us
+		uint verified_frame; ///< The frame the server was last verified by querying it
+	};
+
+	/** Mapping of a server's address to what we know of it */
+	typedef AddressMap<ServerState> ServerIndexMap;
+
+public:
+	/** The server list packets, in order of the servers list */
+	typedef SmallVector<Packet *, 16> PacketList;
+
+private:
+	AddressKeyList servers[SLT_END];        ///< The on-line servers per address family
+	ServerIndexMap index[SLT_END];          ///< Index of the servers into the servers list, and their verification
+	PacketList packets[SLT_END];            ///< The server list packets per address family
+	SmallVector<bool, 16> changed[SLT_END]; ///< Per server list packet whether it changed since the last ClearChanged
+
+	/**
+	 * Removes the server at the given position of the list.
+	 * @param type  the address family of the server
+	 * @param index the position of the server in the list
+	 */
+	void RemoveAt(ServerListType type, uint index);
+
+	/**
+	 * Get the location of a server's entry within the server list packets.
+	 * @param type  the address family of the server
+	 * @param index the position of the server in the list
+	 * @return the first byte of the entry
+	 */
+	byte *GetEntry(ServerListType type, uint index);
+
+	/**
+	 * Append an empty server list packet to the chain of packets.
+	 * @param type the address family of the packet
+	 */
+	void AppendPacket(ServerListType type);
+
+public:
+	/** Create the list, with an empty server list packet per address family */
+	OnlineServerList();
+
+	/** Free the server list packets */
+	~OnlineServerList();
+
+	/**
+	 * Add a server to the list of on-line servers.
+	 * @param key the address of the server
+	 * @return true if the server was not on-line yet
+	 */
+	bool Add(const AddressKey &key);
+
+	/**
+	 * Remove a server from the list of on-line servers.
+	 * @param key the address of the server
+	 * @return true if the server was on-line
+	 */
+	bool Remove(const AddressKey &key);
+
+	/**
+	 * Remember that the given on-line server has just been verified by querying it.
+	 * @param key         the address of the server
+	 * @param session_key the session key the server registered with
+	 * @param frame       the current frame
+	 */
+	void SetVerified(const AddressKey &key, uint64 session_key, uint frame);
+
+	/**
+	 * Whether the given server is on-line and has been verified with the given
+	 * session key recently.
+	 * @param key         the address of the server
+	 * @param session_key the session key the server registers with
+	 * @param since_frame the oldest frame a verification may be from
+	 * @return true if the server does not need to be queried again
+	 */
+	bool IsVerified(const AddressKey &key, uint64 session_key, uint since_frame) const;
+
+	/**
+	 * Make the list of on-line servers of the given address family equal to
+	 * the given list of servers, e.g. the ones from the persistent storage.
+	 * @param type   the address family to reconcile
+	 * @param online the servers that are on-line; this list will be sorted
+	 * @param newer  the servers whose state in this list is newer than in the given list, so they are left alone; this list will be sorted
+	 * @return true if the list has changed
+	 */
+	bool Reconcile(ServerListType type, AddressKeyList &online, AddressKeyList &newer);
+
+	/**
+	 * Get the on-line servers of the given address family.
+	 * @param type the address family
+	 * @return the list of on-line servers
+	 */
+	const AddressKeyList &GetServers(ServerListType type) const { return this->servers[type]; }
+
+	/**
+	 * Get the server list packets of the given address family. They are
+	 * always ready to be sent.
+	 * @param type the address family
+	 * @return the packets; there is at least one
+	 */
+	const PacketList &GetPackets(ServerListType type) const { return this->packets[type]; }
+
+	/**
+	 * Whether a server list packet changed since the last ClearChanged.
+	 * @param type   the address family of the packet
+	 * @param packet the position of the packet in the list
+	 * @return true if the packet has changed, or was added
+	 */
+	bool IsChanged(ServerListType type, uint packet) const { return this->changed[type][packet]; }
+
+	/** Mark all server list packets as unchanged */
+	void ClearChanged();
+
+	/**
+	 * Get the address family of the given address.
+	 * @param key the address to get the family of
+	 * @return the server list type the address belongs to
+	 */
+	static ServerListType GetType(const AddressKey &key) { return key.IsIPv4() ? SLT_IPv4 : SLT_IPv6; }
+};
+
+/**
+ * Immutable copy of the server list packets, for the worker threads. The
+ * main thread publishes a new snapshot whenever the list of on-line servers
+ * has changed; the threads answering server list requests keep a reference
+ * to the snapshot while sending it, so it is only freed once nobody uses
+ * it anymore. Packets that did not change since the previous snapshot are
+ * shared with it instead of copied again.
+ */
+class ServerListSnapshot {
+private:
+	/** Copy of a server list packet, shared by the snapshots it did not change in */
+	struct SharedPacket {
+		Packet *packet;          ///< The copy of the server list packet
+		volatile int references; ///< Number of snapshots using the packet
+	};
+
+	volatile int references;                           ///< Number of users of this snapshot
+	SmallVector<SharedPacket *, 16> shared[SLT_END];   ///< The copied packets per address family
+	SmallVector<const Packet *, 16> packets[SLT_END];  ///< The same packets, in the form they are sent in
+
+	/** Only Release may free the snapshot */
+	~ServerListSnapshot();
+
+public:
+	/**
+	 * Copy the server list packets of the given list.
+	 * The snapshot starts with a single reference.
+	 * @param list     the list of on-line servers to copy the packets of
+	 * @param previous the previously published snapshot, to share the unchanged packets with; may be NULL
+	 */
+	ServerListSnapshot(const OnlineServerList *list, const ServerListSnapshot *previous);
+
+	/** Add a reference to the snapshot */
+	void AddReference() { __sync_add_and_fetch(&this->references, 1); }
+
+	/** Remove a reference from the snapshot, freeing it when it was the last one */
+	void Release() { if (__sync_sub_and_fetch(&this->references, 1) == 0) delete this; }
+
+	/**
+	 * Gets the server list packets of the given address family.
+	 * @param type the address family
+	 * @return the packets, ready to be sent
+	 */
+	const Packet * const *GetPackets(ServerListType type) const { return this->packets[type].Begin(); }
+
+	/**
+	 * Gets the number of server list packets of the given address family.
+	 * @param type the address family
+	 * @return the number of packets
+	 */
+	uint GetPacketCount(ServerListType type) const { return this->packets[type].Length(); }
+};
+
+/**
+ * Fixed size table to verify registrations without allocating anything
+ * per registration, in the spirit of SYN cookies. The game server's reply
+ * to our query does not echo anything we send, so the cookie cannot be
+ * put into the query itself; instead the details of the registration are
+ * kept in a slot chosen by a keyed hash of the game server's address,
+ * together with a MAC over those details. A flood of registrations only
+ * overwrites slots, so memory use stays the same, and a slot can only be
+ * claimed by a reply from the address that it was made for.
+ */
+class RegistrationCookieTable {
+private:
+	/** The details of a single registration */
+	struct Cookie {
+		uint64 tag;         ///< MAC over the game server's address and the other details; 0 when the slot is free
+		uint64 session_key; ///< The session key of the game server
+		uint32 frame;       ///< The frame we queried the game server
+		uint16 reply_port;  ///< The port the registration came from
+	};
+
+	SipHashKey key;  ///< Secret key for the hashes and MACs
+	Cookie *cookies; ///< The slots
+	uint mask;       ///< Number of slots minus one
+
+	/**
+	 * Calculate the MAC over the game server's address and the details of the registration.
+	 * @param server the address of the game server
+	 * @param cookie the details of the registration
+	 * @return the MAC; never 0
+	 */
+	uint64 GetTag(const AddressKey &server, const Cookie *cookie) const;
+
+	/**
+	 * Get the slot the registration of the given game server goes in.
+	 * @param server the address of the game server
+	 * @return the slot
+	 */
+	Cookie *GetSlot(const AddressKey &server) const;
+
+public:
+	/**
+	 * Create a new table with a new secret key.
+	 * @param slots the number of slots; a power of two
+	 */
+	RegistrationCookieTable(uint slots);
+
+	/** Free the slots */
+	~RegistrationCookieTable();
+
+	/**
+	 * Remember a registration in its slot, unless the slot holds a
+	 * registration of another game server that has not expired yet.
+	 * @param server      the address of the game server
+	 * @param reply_port  the port the registration came from
+	 * @param session_key the session key of the game server
+	 * @param frame       the current frame
+	 * @return false if the slot was taken
+	 */
+	bool Issue(const AddressKey &server, uint16 reply_port, uint64 session_key, uint frame);
+
+	/**
+	 * Check whether a reply from the given game server matches a registration.
+	 * The registration is forgotten when it matches.
+	 * @param server      the address the reply came from
+	 * @param frame       the current frame
+	 * @param reply_port  set to the port the registration came from
+	 * @param session_key set to the session key of the game server
+	 * @return true if there was a recent registration of the game server
+	 */
+	bool Verify(const AddressKey &server, uint frame, uint16 *reply_port, uint64 *session_key);
+};
+
+class MasterServer;
+class MasterNetworkUDPSocketHandler;
+
+/** A packet received by a worker thread that has to be handled by the main thread */
+struct ForwardedPacket {
+	Packet *packet;         ///< Copy of the received packet
+	NetworkAddress address; ///< The address the packet came from
+};
+
+/**
+ * Thread with its own master socket, bound to the same addresses and
+ * port as the master socket of the main thread. It answers the server
+ * list requests by itself and forwards everything that changes the
+ * state of the master server to the main thread.
+ */
+class MasterWorker {
+private:
+	MasterServer *ms;                      ///< The masterserver we are working for
+	MasterNetworkUDPSocketHandler *socket; ///< Our copy of the master socket
+	pthread_t thread;                      ///< The thread we are running in
+	bool running;                          ///< Whether the thread has been started
+
+	/**
+	 * Entry point of the thread.
+	 * @param worker the worker to run
+	 * @return nothing
+	 */
+	static void *ThreadProc(void *worker);
+
+	/** Receive and handle packets until the master server stops */
+	void Run();
+
+public:
+	/**
+	 * Create a new worker and bind its socket.
+	 * @param ms        the masterserver to work for
+	 * @param addresses the addresses to bind on
+	 */
+	MasterWorker(MasterServer *ms, NetworkAddressList *addresses);
+
+	/** Wait for the thread to finish and close the socket */
+	~MasterWorker();
+
+	/**
+	 * Start the thread of the worker.
+	 * @return false if the thread could not be started
+	 */
+	bool Start();
+
+	/**
+	 * Gets the master socket of this worker.
+	 * @return the socket handler
+	 */
+	const MasterNetworkUDPSocketHandler *GetSocket() const { return this->socket; }
+};
+
 /**
  * Code specific to the master server
  */
 class MasterServer : public UDPServer {
 private:
-	bool update_serverlist_packet[SLT_END]; ///< Whether to update the cached server list packet
-	Packet *serverlist_packet[SLT_END];     ///< The cached server list packet
-	uint next_serverlist_frame[SLT_END];    ///< Frame where to make a new server list packet
-	uint64 session_key;                     ///< New session key to give out
+	OnlineServerList online_servers;   ///< The game servers that are on-line
+	uint64 session_key;                ///< New session key to give out
+	RegistrationCookieTable *cookies;  ///< The registrations being verified, or NULL when every registration gets its own queried server
+
+	ServerListSnapshot *server_list;    ///< The most recently published server list packets
+	pthread_mutex_t server_list_mutex;  ///< Mutex for swapping and acquiring the published server list
+	bool server_list_changed;           ///< Whether the list of on-line servers changed since the last publication
+
+	SmallVector<MasterWorker *, 8> workers;            ///< The worker threads answering on the master socket
+	SmallVector<ForwardedPacket, 32> forwarded_packets; ///< Packets forwarded by the workers to the main thread
+	pthread_mutex_t forward_mutex;                      ///< Mutex for the forwarded packets
+	int forward_event;                                  ///< Event to wake up the main thread for forwarded packets
+
+	AddressKeyList readvertised;      ///< Re-advertised servers of which the database has not been told yet
+	bool reconcile_requested;         ///< Whether the database is reading the active servers for reconciling
+	AddressKeyList reconcile_changed; ///< Servers that went on- or off-line since the active servers were requested
+	uint reconcile_skips;             ///< Number of times in a row the reconciliation was skipped while the database was still reading
+
+	/** Tell the database about the servers that re-advertised themselves */
+	void FlushReadvertisements();
+
+	/** Ask the database for the active servers, to reconcile the in-memory list of on-line servers with */
+	void RequestServerList();
+
+	/** Reconcile the in-memory list of on-line servers with the active servers, when the database has read them */
+	void ReconcileServerList();
+
+	/**
+	 * Reconcile the in-memory list of on-line servers with the given active servers.
+	 * @param active the active servers per address family, from the persistent storage
+	 */
+	void ReconcileServerList(AddressKeyList active[SLT_END]);
+
+	/** Publish a new snapshot of the server list packets for the workers */
+	void PublishServerList();
+
+	/** Handle the packets the workers have forwarded to us */
+	void HandleForwardedPackets();
+
+	/** Log the number of packets dropped on the master sockets */
+	void LogDroppedPackets();
+
+	/** Log the number of writes queued for the database, and how many were dropped for a full queue */
+	void LogWriteQueue();
 
 protected:
-	NetworkUDPSocketHandler *master_socket; ///< Socket to listen for registration, unregistration and queries for the server list
+	MasterNetworkUDPSocketHandler *master_socket; ///< Socket to listen for registration, unregistration and queries for the server list
+
+	void GetSocketHandlers(SocketHandlerList &handlers);
+	int GetWakeupFD() { return this->forward_event; }
+	void EventsHandled();
+	void RealRun();
 
 public:
 	/**
@@ -80,15 +485,54 @@ public:
 	~MasterServer();
 
 	void ReceivePackets();
+	void CheckServers();
 
 	MSQueriedServer *GetQueriedServer(NetworkAddress *client_addr) { return (MSQueriedServer*)UDPServer::GetQueriedServer(client_addr); }
 
-	void ServerStateChange()
-	{
-		for (uint i = 0; i < SLT_END; i++) {
-			this->update_serverlist_packet[i] = true;
-		}
-	}
+	/**
+	 * Mark the given server as on-line, both in memory and in the persistent storage.
+	 * @param qs the server that has responded to our query
+	 */
+	void MakeServerOnline(MSQueriedServer *qs);
+
+	/**
+	 * Mark the given server as off-line, both in memory and in the persistent storage.
+	 * @param qs the server that has unregistered
+	 */
+	void MakeServerOffline(QueriedServer *qs);
+
+	/**
+	 * Handle the registration of a server that is on-line and recently verified
+	 * without querying it; it is acked right away and the database is told
+	 * about it in a batch later on.
+	 * @param query_addr  the address of the game server
+	 * @param reply_addr  the address the registration came from
+	 * @param session_key the session key of the game server
+	 * @return false if the server has to be queried
+	 */
+	bool HandleReadvertisement(NetworkAddress *query_addr, NetworkAddress *reply_addr, uint64 session_key);
+
+	/**
+	 * Whether registrations are verified with the registration cookie table.
+	 * @return true if no queried servers are made for registrations
+	 */
+	bool UsesRegistrationCookies() const { return this->cookies != NULL; }
+
+	/**
+	 * Remember the registration in the cookie table and query the game server.
+	 * @param query_addr  the address of the game server
+	 * @param reply_addr  the address the registration came from
+	 * @param session_key the session key of the game server
+	 */
+	void IssueRegistrationCookie(NetworkAddress *query_addr, NetworkAddress *reply_addr, uint64 session_key);
+
+	/**
+	 * Check a reply of a game server against the cookie table, and make it
+	 * on-line when the reply matches a registration.
+	 * @param client_addr the address the reply came from
+	 * @return true if the reply matched a registration
+	 */
+	bool VerifyRegistrationCookie(NetworkAddress *client_addr);
 
 	/**
 	 * Send a registration ack to the server.
@@ -96,7 +540,30 @@ public:
 	 */
 	void SendAck(MSQueriedServer *qs);
 
-	Packet *GetServerListPacket(ServerListType type); ///< Gets an (relatively) up-to-date packet with all game servers
+	/**
+	 * Gets the most recent snapshot of the game server list packets. The
+	 * snapshot is republished whenever servers went on-line or off-line.
+	 * This may be called from any thread, but only when there are workers.
+	 * @return the snapshot; call Release on it when done with it
+	 * @post return != NULL
+	 */
+	ServerListSnapshot *AcquireServerList();
+
+	/**
+	 * Gets the live game server list packets. As they change with every
+	 * (un)registration, this may only be called from the main thread.
+	 * @param type the address family of the list
+	 * @return the packets, ready to be sent
+	 */
+	const OnlineServerList::PacketList &GetServerListPackets(ServerListType type) const { return this->online_servers.GetPackets(type); }
+
+	/**
+	 * Hand a packet received by a worker over to the main thread.
+	 * This may be called from any thread.
+	 * @param p           the packet to forward; it is copied
+	 * @param client_addr the address the packet came from
+	 */
+	void ForwardPacket(Packet *p, NetworkAddress *client_addr);
 
 	/**
 	 * Get the next, semi-random, session key
@@ -112,7 +579,7 @@ public:
 };
 
 /** Handler for the query socket of the masterserver */
-class QueryNetworkUDPSocketHandler : public NetworkUDPSocketHandler {
+class QueryNetworkUDPSocketHandler : public ServerNetworkUDPSocketHandler {
 protected:
 	MasterServer *ms; ///< The masterserver we are related to
 	virtual void Receive_SERVER_RESPONSE(Packet *p, NetworkAddress *client_addr); ///< Handle a PACKET_UDP_SERVER_RESPONSE packet
@@ -123,7 +590,7 @@ public:
 	 * @param addresses the host to bind on
 	 */
 	QueryNetworkUDPSocketHandler(MasterServer *ms, NetworkAddressList *addresses) :
-		NetworkUDPSocketHandler(addresses),
+		ServerNetworkUDPSocketHandler(addresses),
 		ms(ms)
 	{}
 
@@ -132,9 +599,41 @@ public:
 };
 
 /** Handler for the master socket of the masterserver */
-class MasterNetworkUDPSocketHandler : public NetworkUDPSocketHandler {
+class MasterNetworkUDPSocketHandler : public ServerNetworkUDPSocketHandler {
+private:
+	RateLimiter limiter;       ///< Limiter of the requests per source prefix
+	uint dropped[DR_END];      ///< Number of dropped packets per reason
+	bool handling_forwarded;   ///< Whether we are handling a packet a worker has forwarded
+
 protected:
 	MasterServer *ms; ///< The masterserver we are related to
+
+	/**
+	 * Check whether we want to handle a request, counting it when we do not.
+	 * @param client_addr the address the request came from
+	 * @param cost        the number of packets we will send for the request
+	 * @param sheddable   whether the request may be dropped when we are too busy
+	 * @return true if the request should be handled
+	 */
+	bool AllowRequest(NetworkAddress *client_addr, uint cost, bool sheddable);
+
+	/**
+	 * Send the given server list packets, when the rate limiter allows it.
+	 * @param packets     the server list packets
+	 * @param count       the number of packets
+	 * @param client_addr the address to send the packets to
+	 * @param client      the printable address of the client, for logging
+	 */
+	void SendServerListPackets(const Packet * const *packets, uint count, NetworkAddress *client_addr, const char *client);
+
+	/**
+	 * Send the game server list of the given address family to a client.
+	 * @param type        the address family of the list
+	 * @param client_addr the address to send the list to
+	 * @param client      the printable address of the client, for logging
+	 */
+	virtual void SendServerList(ServerListType type, NetworkAddress *client_addr, const char *client);
+
 	virtual void Receive_SERVER_REGISTER(Packet *p, NetworkAddress *client_addr);   ///< Handle a PACKET_UDP_SERVER_REGISTER packet
 	virtual void Receive_CLIENT_GET_LIST(Packet *p, NetworkAddress *client_addr);   ///< Handle a PACKET_UDP_CLIENT_GET_LIST packet
 	virtual void Receive_SERVER_UNREGISTER(Packet *p, NetworkAddress *client_addr); ///< Handle a PACKET_UDP_SERVER_UNREGISTER packet
@@ -145,12 +644,70 @@ public:
 	 * @param addresses the addresses to bind on
 	 */
 	MasterNetworkUDPSocketHandler(MasterServer *ms, NetworkAddressList *addresses) :
-		NetworkUDPSocketHandler(addresses),
+		ServerNetworkUDPSocketHandler(addresses),
+		limiter(RATE_LIMIT_SOURCES, RATE_LIMIT_PACKETS_PER_SECOND, RATE_LIMIT_BURST),
+		handling_forwarded(false),
 		ms(ms)
-	{}
+	{
+		memset(this->dropped, 0, sizeof(this->dropped));
+	}
 
 	/** The obvious destructor */
 	virtual ~MasterNetworkUDPSocketHandler() {}
+
+	/**
+	 * Handle a packet that a worker has forwarded to the main thread.
+	 * @param p           the packet to handle
+	 * @param client_addr the address the packet came from
+	 */
+	void HandleForwardedPacket(Packet *p, NetworkAddress *client_addr);
+
+	/**
+	 * Gets the number of packets dropped on this socket.
+	 * @param reason the reason the packets were dropped for
+	 * @return the number of dropped packets
+	 */
+	uint GetDropped(DropReason reason) const { return this->dropped[reason]; }
+};
+
+/**
+ * Handler for the master socket of a worker thread. It answers the
+ * server list requests and forwards (un)registrations to the main thread.
+ */
+class WorkerNetworkUDPSocketHandler : public MasterNetworkUDPSocketHandler {
+protected:
+	/**
+	 * Log a packet that does not belong on the master socket. Unlike
+	 * NetworkUDPSocketHandler::ReceiveInvalidPacket it does not use the
+	 * static buffer of GetAddressAsString, which the main thread uses too.
+	 * @param type        the type of the packet
+	 * @param client_addr the address the packet came from
+	 */
+	void ReceiveUnexpectedPacket(PacketUDPType type, NetworkAddress *client_addr);
+
+	virtual void Receive_CLIENT_FIND_SERVER(Packet *p, NetworkAddress *client_addr);   ///< Log an unexpected PACKET_UDP_CLIENT_FIND_SERVER packet
+	virtual void Receive_SERVER_RESPONSE(Packet *p, NetworkAddress *client_addr);      ///< Log an unexpected PACKET_UDP_SERVER_RESPONSE packet
+	virtual void Receive_CLIENT_DETAIL_INFO(Packet *p, NetworkAddress *client_addr);   ///< Log an unexpected PACKET_UDP_CLIENT_DETAIL_INFO packet
+	virtual void Receive_SERVER_DETAIL_INFO(Packet *p, NetworkAddress *client_addr);   ///< Log an unexpected PACKET_UDP_SERVER_DETAIL_INFO packet
+	virtual void Receive_MASTER_ACK_REGISTER(Packet *p, NetworkAddress *client_addr);  ///< Log an unexpected PACKET_UDP_MASTER_ACK_REGISTER packet
+	virtual void Receive_MASTER_RESPONSE_LIST(Packet *p, NetworkAddress *client_addr); ///< Log an unexpected PACKET_UDP_MASTER_RESPONSE_LIST packet
+	virtual void Receive_CLIENT_GET_NEWGRFS(Packet *p, NetworkAddress *client_addr);   ///< Log an unexpected PACKET_UDP_CLIENT_GET_NEWGRFS packet
+	virtual void Receive_SERVER_NEWGRFS(Packet *p, NetworkAddress *client_addr);       ///< Log an unexpected PACKET_UDP_SERVER_NEWGRFS packet
+	virtual void Receive_MASTER_SESSION_KEY(Packet *p, NetworkAddress *client_addr);   ///< Log an unexpected PACKET_UDP_MASTER_SESSION_KEY packet
+
+	virtual void Receive_SERVER_REGISTER(Packet *p, NetworkAddress *client_addr);   ///< Forward a PACKET_UDP_SERVER_REGISTER packet
+	virtual void Receive_SERVER_UNREGISTER(Packet *p, NetworkAddress *client_addr); ///< Forward a PACKET_UDP_SERVER_UNREGISTER packet
+
+	/* virtual */ void SendServerList(ServerListType type, NetworkAddress *client_addr, const char *client);
+public:
+	/**
+	 * Create a new worker socket handler for a given masterserver
+	 * @param ms the masterserver this socket is related to
+	 * @param addresses the addresses to bind on
+	 */
+	WorkerNetworkUDPSocketHandler(MasterServer *ms, NetworkAddressList *addresses) :
+		MasterNetworkUDPSocketHandler(ms, addresses)
+	{}
 };
 
 #endif /* MASTERSERVER_H */
@@ -0,0 +1,123 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shared/stdafx.h"
+#include "shared/debug.h"
+#include "masterserver.h"
+
+#include "shared/safeguards.h"
+
+/**
+ * @file masterserver/registration.cpp Verification of registrations without per-registration state
+ */
+
+RegistrationCookieTable::RegistrationCookieTable(uint slots) : mask(slots - 1)
+{
+	assert(slots != 0 && (slots & (slots - 1)) == 0);
+
+	this->key.Randomize();
+	this->cookies = CallocT<Cookie>(slots);
+}
+
+RegistrationCookieTable::~RegistrationCookieTable()
+{
+	free(this->cookies);
+}
+
+uint64 RegistrationCookieTable::GetTag(const AddressKey &server, const Cookie *cookie) const
+{
+	byte message[sizeof(server.ip) + sizeof(server.port) + sizeof(cookie->reply_port) + sizeof(cookie->session_key) + sizeof(cookie->frame)];
+	byte *m = message;
+	memcpy(m, server.ip, sizeof(server.ip));                         m += sizeof(server.ip);
+	memcpy(m, &server.port, sizeof(server.port));                    m += sizeof(server.port);
+	memcpy(m, &cookie->reply_port, sizeof(cookie->reply_port));      m += sizeof(cookie->reply_port);
+	memcpy(m, &cookie->session_key, sizeof(cookie->session_key));    m += sizeof(cookie->session_key);
+	memcpy(m, &cookie->frame, sizeof(cookie->frame));
+
+	uint64 tag = SipHash(this->key, message, sizeof(message));
+	return tag == 0 ? 1 : tag;
+}
+
+RegistrationCookieTable::Cookie *RegistrationCookieTable::GetSlot(const AddressKey &server) const
+{
+	byte message[sizeof(server.ip) + sizeof(server.port)];
+	memcpy(message, server.ip, sizeof(server.ip));
+	memcpy(message + sizeof(server.ip), &server.port, sizeof(server.port));
+
+	return &this->cookies[SipHash(this->key, message, sizeof(message)) & this->mask];
+}
+
+bool RegistrationCookieTable::Issue(const AddressKey &server, uint16 reply_port, uint64 session_key, uint frame)
+{
+	Cookie *cookie = this->GetSlot(server);
+
+	/* Do not let (spoofed) registrations push out the pending registration of another game server */
+	if (cookie->tag != 0 && cookie->frame + SERVER_QUERY_TIMEOUT >= frame && cookie->tag != this->GetTag(server, cookie)) return false;
+
+	cookie->session_key = session_key;
+	cookie->frame       = frame;
+	cookie->reply_port  = reply_port;
+	cookie->tag         = this->GetTag(server, cookie);
+	return true;
+}
+
+bool RegistrationCookieTable::Verify(const AddressKey &server, uint frame, uint16 *reply_port, uint64 *session_key)
+{
+	Cookie *cookie = this->GetSlot(server);
+
+	/* Either there is nothing, or it is too old, or it is of another game server */
+	if (cookie->tag == 0) return false;
+	if (cookie->frame + SERVER_QUERY_TIMEOUT < frame) return false;
+	if (cookie->tag != this->GetTag(server, cookie)) return false;
+
+	*reply_port  = cookie->reply_port;
+	*session_key = cookie->session_key;
+
+	/* A cookie can only be used once */
+	cookie->tag = 0;
+	return true;
+}
+
+void MasterServer::IssueRegistrationCookie(NetworkAddress *query_addr, NetworkAddress *reply_addr, uint64 session_key)
+{
+	AddressKey server;
+	if (!server.FromAddress(query_addr)) return;
+
+	if (!this->cookies->Issue(server, reply_addr->GetPort(), session_key, this->GetFrame())) {
+		DEBUG(net, 4, "no free registration cookie for %s; it has to register again", query_addr->GetAddressAsString());
+		return;
+	}
+
+	/* Send game info query */
+	Packet packet(PACKET_UDP_CLIENT_FIND_SERVER);
+	this->GetQuerySocket()->SendPacket(&packet, query_addr);
+}
+
+bool MasterServer::VerifyRegistrationCookie(NetworkAddress *client_addr)
+{
+	if (this->cookies == NULL) return false;
+
+	AddressKey server;
+	if (!server.FromAddress(client_addr)) return false;
+
+	uint16 reply_port;
+	uint64 session_key;
+	if (!this->cookies->Verify(server, this->GetFrame(), &reply_port, &session_key)) return false;
+
+	NetworkAddress reply_addr(*client_addr);
+	reply_addr.SetPort(reply_port);
+
+	DEBUG(net, 3, "received a 'server response' from %s for a registration cookie", client_addr->GetAddressAsString());
+
+	/* Only needed for the duration of this function, so it does not come from the pool */
+	MSQueriedServer qs(*client_addr, reply_addr, session_key, this->GetFrame());
+	this->SendAck(&qs);
+	this->MakeServerOnline(&qs);
+	return true;
+}
@@ -0,0 +1,251 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shared/stdafx.h"
+#include "shared/debug.h"
+#include "core/bitmath_func.hpp"
+#include "masterserver.h"
+#include <algorithm>
+
+#include "shared/safeguards.h"
+
+/**
+ * @file masterserver/server_list.cpp In-memory list of on-line game servers and the server list packets sent to clients
+ */
+
+/** Number of bytes before the first server in a server list packet: size, type, address type and server count */
+static const uint SERVER_LIST_HEADER_SIZE = sizeof(PacketSize) + sizeof(PacketType) + sizeof(uint8) + sizeof(uint16);
+
+/** Offset of the server count in a server list packet */
+static const uint SERVER_LIST_COUNT_OFFSET = SERVER_LIST_HEADER_SIZE - sizeof(uint16);
+
+/**
+ * Number of bytes needed to encode a single server. For IPv6 addresses
+ * we send an in6_addr and for IPv4 address an in_addr, both followed
+ * by the port.
+ */
+static const uint _server_entry_size[SLT_END] = {
+	sizeof(in_addr)  + sizeof(uint16),
+	sizeof(in6_addr) + sizeof(uint16),
+};
+
+/**
+ * Due to the limited size of the packet we have to limit the amount of
+ * servers we can put into a single packet.
+ *
+ * For this we use the maximum size of the packet, substract the bytes
+ * needed for the header of the packet. This gives the number of bytes
+ * we can use to place the advertised servers in. Which is then divided
+ * by the amount of bytes needed to encode the IP address and the port of
+ * a single server.
+ */
+static const uint _server_entries_per_packet[SLT_END] = {
+	(SAFE_MTU - SERVER_LIST_HEADER_SIZE) / (sizeof(in_addr)  + sizeof(uint16)),
+	(SAFE_MTU - SERVER_LIST_HEADER_SIZE) / (sizeof(in6_addr) + sizeof(uint16)),
+};
+
+/**
+ * Encode a server into its slot in a server list packet. This is the same
+ * encoding as Packet::Send_uint32 and Packet::Send_uint16 would give.
+ * @param entry the first byte of the slot
+ * @param key   the address of the server
+ * @param type  the address family of the server
+ */
+static void WriteServerEntry(byte *entry, const AddressKey &key, ServerListType type)
+{
+	if (type == SLT_IPv6) {
+		memcpy(entry, key.ip, sizeof(in6_addr));
+		entry += sizeof(in6_addr);
+	} else {
+		/* The last four bytes of an IPv4-mapped address are the in_addr */
+		uint32 s_addr;
+		memcpy(&s_addr, key.ip + sizeof(in6_addr) - sizeof(in_addr), sizeof(s_addr));
+		*entry++ = GB(s_addr,  0, 8);
+		*entry++ = GB(s_addr,  8, 8);
+		*entry++ = GB(s_addr, 16, 8);
+		*entry++ = GB(s_addr, 24, 8);
+	}
+	*entry++ = GB(key.port, 0, 8);
+	*entry++ = GB(key.port, 8, 8);
+}
+
+/**
+ * Change the number of servers in a server list packet. The size in the
+ * header of the packet is updated too, just like Packet::PrepareToSend
+ * does, so the packet can always be sent as-is.
+ * @param p     the packet to update
+ * @param count the new number of servers in the packet
+ * @param type  the address family of the packet
+ */
+static void SetServerCount(Packet *p, uint count, ServerListType type)
+{
+	p->buffer[SERVER_LIST_COUNT_OFFSET]     = GB(count, 0, 8);
+	p->buffer[SERVER_LIST_COUNT_OFFSET + 1] = GB(count, 8, 8);
+	p->size = SERVER_LIST_HEADER_SIZE + count * _server_entry_size[type];
+	p->buffer[0] = GB(p->size, 0, 8);
+	p->buffer[1] = GB(p->size, 8, 8);
+}
+
+/**
+ * Get the number of servers in a server list packet.
+ * @param p    the packet to get the count of
+ * @param type the address family of the packet
+ * @return the number of servers
+ */
+static uint GetServerCount(const Packet *p, ServerListType type)
+{
+	return (p->size - SERVER_LIST_HEADER_SIZE) / _server_entry_size[type];
+}
+
+OnlineServerList::OnlineServerList()
+{
+	for (uint i = 0; i < SLT_END; i++) {
+		/* Even without servers the client expects an (empty) list */
+		this->AppendPacket((ServerListType)i);
+	}
+}
+
+OnlineServerList::~OnlineServerList()
+{
+	for (uint i = 0; i < SLT_END; i++) {
+		for (Packet **p = this->packets[i].Begin(); p != this->packets[i].End(); p++) {
+			delete *p;
+		}
+	}
+}
+
+void OnlineServerList::AppendPacket(ServerListType type)
+{
+	Packet *p = new Packet(PACKET_UDP_MASTER_RESPONSE_LIST);
+	p->Send_uint8(type + 1);
+	p->Send_uint16(0);
+	assert(p->size == SERVER_LIST_HEADER_SIZE);
+	SetServerCount(p, 0, type);
+
+	*this->packets[type].Append() = p;
+	*this->changed[type].Append() = true;
+}
+
+byte *OnlineServerList::GetEntry(ServerListType type, uint index)
+{
+	Packet *p = this->packets[type][index / _server_entries_per_packet[type]];
+	return p->buffer + SERVER_LIST_HEADER_SIZE + (index % _server_entries_per_packet[type]) * _server_entry_size[type];
+}
+
+void OnlineServerList::RemoveAt(ServerListType type, uint index)
+{
+	AddressKeyList &servers = this->servers[type];
+	PacketList &packets = this->packets[type];
+
+	this->index[type].Erase(servers[index]);
+
+	/* Move the last server into the gap, so the list and packets stay contiguous */
+	uint last = servers.Length() - 1;
+	if (index != last) {
+		this->index[type][servers[last]].index = index;
+		memcpy(this->GetEntry(type, index), this->GetEntry(type, last), _server_entry_size[type]);
+		this->changed[type][index / _server_entries_per_packet[type]] = true;
+	}
+	servers.Erase(servers.Get(index));
+
+	/* The last packet has lost a server; drop it when it became empty */
+	Packet *tail = packets[last / _server_entries_per_packet[type]];
+	uint count = GetServerCount(tail, type) - 1;
+	if (count == 0 && packets.Length() > 1) {
+		packets.Erase(packets.End() - 1);
+		this->changed[type].Erase(this->changed[type].End() - 1);
+		delete tail;
+	} else {
+		SetServerCount(tail, count, type);
+		this->changed[type][last / _server_entries_per_packet[type]] = true;
+	}
+}
+
+bool OnlineServerList::Add(const AddressKey &key)
+{
+	ServerListType type = GetType(key);
+
+	if (this->index[type].Find(key) != NULL) return false;
+
+	uint index = this->servers[type].Length();
+	this->index[type][key].index = index;
+	*this->servers[type].Append() = key;
+
+	/* Append the server to the last packet, or start a new one when it is full */
+	uint packet = index / _server_entries_per_packet[type];
+	if (packet == this->packets[type].Length()) this->AppendPacket(type);
+
+	Packet *p = this->packets[type][packet];
+	WriteServerEntry(this->GetEntry(type, index), key, type);
+	SetServerCount(p, GetServerCount(p, type) + 1, type);
+	this->changed[type][packet] = true;
+	return true;
+}
+
+bool OnlineServerList::Remove(const AddressKey &key)
+{
+	ServerListType type = GetType(key);
+
+	ServerState *state = this->index[type].Find(key);
+	if (state == NULL) return false;
+
+	this->RemoveAt(type, state->index);
+	return true;
+}
+
+void OnlineServerList::SetVerified(const AddressKey &key, uint64 session_key, uint frame)
+{
+	ServerState *state = this->index[GetType(key)].Find(key);
+	if (state == NULL) return;
+
+	state->session_key    = session_key;
+	state->verified_frame = frame;
+}
+
+bool OnlineServerList::IsVerified(const AddressKey &key, uint64 session_key, uint since_frame) const
+{
+	const ServerState *state = this->index[GetType(key)].Find(key);
+	return state != NULL && state->session_key != 0 && state->session_key == session_key && state->verified_frame >= since_frame;
+}
+
+bool OnlineServerList::Reconcile(ServerListType type, AddressKeyList &online, AddressKeyList &newer)
+{
+	/* Sort the lists, so we can quickly look servers up in them */
+	std::sort(online.Begin(), online.End());
+	std::sort(newer.Begin(), newer.End());
+
+	bool changed = false;
+
+	/* Remove the servers that went off-line behind our back, e.g. because
+	 * the updater could not reach them anymore. Walk backwards, so the
+	 * servers moved into the gaps have already been checked. */
+	AddressKeyList &servers = this->servers[type];
+	for (uint i = servers.Length(); i-- > 0;) {
+		if (std::binary_search(online.Begin(), online.End(), servers[i])) continue;
+		if (std::binary_search(newer.Begin(), newer.End(), servers[i])) continue;
+
+		this->RemoveAt(type, i);
+		changed = true;
+	}
+
+	/* And add the ones we did not know of yet */
+	for (const AddressKey *key = online.Begin(); key != online.End(); key++) {
+		if (GetType(*key) != type || std::binary_search(newer.Begin(), newer.End(), *key)) continue;
+		if (this->Add(*key)) changed = true;
+	}
+
+	return changed;
+}
+
+void OnlineServerList::ClearChanged()
+{
+	for (uint i = 0; i < SLT_END; i++) {
+		for (bool *c = this->changed[i].Begin(); c != this->changed[i].End(); c++) *c = false;
+	}
+}
@@ -24,6 +24,9 @@ void QueryNetworkUDPSocketHandler::Receive_SERVER_RESPONSE(Packet *p, NetworkAdd
 
 	/* We were NOT waiting for this server.. drop it */
 	if (qs == NULL) {
+		/* Unless it is the reply to a registration we did not keep a queried server for */
+		if (this->ms->VerifyRegistrationCookie(client_addr)) return;
+
 		DEBUG(net, 0, "received an unexpected 'server response' from %s", client_addr->GetAddressAsString());
 		return;
 	}
@@ -35,12 +38,33 @@ void QueryNetworkUDPSocketHandler::Receive_SERVER_RESPONSE(Packet *p, NetworkAdd
 	this->ms->SendAck(qs);
 
 	/* Add the server to the list with online servers */
-	this->ms->GetSQLBackend()->MakeServerOnline(qs);
+	this->ms->MakeServerOnline(qs);
 	delete this->ms->RemoveQueriedServer(qs);
 }
 
+bool MasterNetworkUDPSocketHandler::AllowRequest(NetworkAddress *client_addr, uint cost, bool sheddable)
+{
+	/* The worker that forwarded the packet already did the checks */
+	if (this->handling_forwarded) return true;
+
+	if (sheddable && this->IsBacklogged()) {
+		this->dropped[DR_SHED]++;
+		return false;
+	}
+
+	if (!this->limiter.Allow(client_addr, cost)) {
+		this->dropped[DR_RATE_LIMITED]++;
+		return false;
+	}
+
+	return true;
+}
+
 void MasterNetworkUDPSocketHandler::Receive_SERVER_REGISTER(Packet *p, NetworkAddress *client_addr)
 {
+	/* Every registration makes us query the (claimed) game server */
+	if (!this->AllowRequest(client_addr, 1, false)) return;
+
 	char welcome_message[NETWORK_NAME_LENGTH];
 
 	/* Check if we understand this client */
@@ -91,6 +115,15 @@ void MasterNetworkUDPSocketHandler::Receive_SERVER_REGISTER(Packet *p, NetworkAd
 	/* Shouldn't happen ofcourse, but still ... */
 	if (this->HasClientQuit()) return;
 
+	/* Servers we know to be alive re-advertise regularly; no need to query those again */
+	if (this->ms->HandleReadvertisement(&query_addr, &reply_addr, session_key)) return;
+
+	if (this->ms->UsesRegistrationCookies()) {
+		/* Nothing is allocated; the reply is checked against the cookie */
+		this->ms->IssueRegistrationCookie(&query_addr, &reply_addr, session_key);
+		return;
+	}
+
 	MSQueriedServer *qs = new MSQueriedServer(query_addr, reply_addr, session_key, this->ms->GetFrame());
 
 	/* Now request some data from the server to see if it is really alive */
@@ -102,6 +135,8 @@ void MasterNetworkUDPSocketHandler::Receive_SERVER_REGISTER(Packet *p, NetworkAd
 
 void MasterNetworkUDPSocketHandler::Receive_SERVER_UNREGISTER(Packet *p, NetworkAddress *client_addr)
 {
+	if (!this->AllowRequest(client_addr, 1, false)) return;
+
 	/* See what kind of server we have (protocol wise) */
 	uint8 master_server_version = p->Recv_uint8();
 	if (master_server_version < 1 || master_server_version > 2) {
@@ -122,33 +157,97 @@ void MasterNetworkUDPSocketHandler::Receive_SERVER_UNREGISTER(Packet *p, Network
 	QueriedServer *qs = new QueriedServer(*client_addr, this->ms->GetFrame());
 
 	/* Remove the server from the list of online servers */
-	this->ms->GetSQLBackend()->MakeServerOffline(qs);
+	this->ms->MakeServerOffline(qs);
 	delete this->ms->RemoveQueriedServer(qs);
 	delete qs;
 }
 
 void MasterNetworkUDPSocketHandler::Receive_CLIENT_GET_LIST(Packet *p, NetworkAddress *client_addr)
 {
+	/* This is called by the workers too, so do not use the static buffer of GetAddressAsString */
+	char client[NETWORK_HOSTNAME_LENGTH + 16];
+	client_addr->GetAddressAsString(client, lastof(client));
+
 	uint8 master_server_version = p->Recv_uint8();
 	if (master_server_version < 1 || master_server_version > 2) {
 		/* We do not know this version, bail out */
-		DEBUG(net, 0, "received a request for the game server list from %s with unknown master server version",
-				client_addr->GetAddressAsString());
+		DEBUG(net, 0, "received a request for the game server list from %s with unknown master server version", client);
 
 		return;
 	}
 
-	DEBUG(net, 3, "received a request for the game server list from %s", client_addr->GetAddressAsString());
+	DEBUG(net, 3, "received a request for the game server list from %s", client);
 	ServerListType type = SLT_IPv4;
 	if (master_server_version == 2) {
 		type = (ServerListType)p->Recv_uint8();
 		if (type >= SLT_AUTODETECT) type = client_addr->IsFamily(AF_INET) ? SLT_IPv4 : SLT_IPv6;
 	}
 
-	for (Packet *p = this->ms->GetServerListPacket(type); p != NULL; p = p->next) {
-		Packet *next = p->next;
-		p->next = NULL;
-		this->SendPacket(p, client_addr);
-		p->next = next;
+	this->SendServerList(type, client_addr, client);
+}
+
+void MasterNetworkUDPSocketHandler::SendServerListPackets(const Packet * const *packets, uint count, NetworkAddress *client_addr, const char *client)
+{
+	/* The server list is the bulk of what we send, so charge for every packet of it */
+	if (this->AllowRequest(client_addr, count, true)) {
+		this->SendPacketList(packets, count, client_addr);
+	} else {
+		DEBUG(net, 5, "dropped a request for the game server list from %s", client);
 	}
 }
+
+void MasterNetworkUDPSocketHandler::SendServerList(ServerListType type, NetworkAddress *client_addr, const char *client)
+{
+	/* We run in the main thread, so the live packets cannot change under us */
+	const OnlineServerList::PacketList &packets = this->ms->GetServerListPackets(type);
+	this->SendServerListPackets(packets.Begin(), packets.Length(), client_addr, client);
+}
+
+void MasterNetworkUDPSocketHandler::HandleForwardedPacket(Packet *p, NetworkAddress *client_addr)
+{
+	p->PrepareToRead();
+
+	this->handling_forwarded = true;
+	this->HandleUDPPacket(p, client_addr);
+	this->handling_forwarded = false;
+}
+
+void WorkerNetworkUDPSocketHandler::ReceiveUnexpectedPacket(PacketUDPType type, NetworkAddress *client_addr)
+{
+	char client[NETWORK_HOSTNAME_LENGTH + 16];
+	client_addr->GetAddressAsString(client, lastof(client));
+	DEBUG(net, 0, "[udp] received packet type %d on wrong port from %s", type, client);
+}
+
+/** Define the handler of a packet type the worker does not expect, which only logs the packet */
+#define DEFINE_UNEXPECTED_RECEIVE(type) \
+void WorkerNetworkUDPSocketHandler::Receive_##type(Packet *p, NetworkAddress *client_addr) { this->ReceiveUnexpectedPacket(PACKET_UDP_##type, client_addr); }
+
+DEFINE_UNEXPECTED_RECEIVE(CLIENT_FIND_SERVER)
+DEFINE_UNEXPECTED_RECEIVE(SERVER_RESPONSE)
+DEFINE_UNEXPECTED_RECEIVE(CLIENT_DETAIL_INFO)
+DEFINE_UNEXPECTED_RECEIVE(SERVER_DETAIL_INFO)
+DEFINE_UNEXPECTED_RECEIVE(MASTER_ACK_REGISTER)
+DEFINE_UNEXPECTED_RECEIVE(MASTER_RESPONSE_LIST)
+DEFINE_UNEXPECTED_RECEIVE(CLIENT_GET_NEWGRFS)
+DEFINE_UNEXPECTED_RECEIVE(SERVER_NEWGRFS)
+DEFINE_UNEXPECTED_RECEIVE(MASTER_SESSION_KEY)
+
+void WorkerNetworkUDPSocketHandler::Receive_SERVER_REGISTER(Packet *p, NetworkAddress *client_addr)
+{
+	/* Registering changes the state of the master server; that is the job of the main thread */
+	if (this->AllowRequest(client_addr, 1, false)) this->ms->ForwardPacket(p, client_addr);
+}
+
+void WorkerNetworkUDPSocketHandler::Receive_SERVER_UNREGISTER(Packet *p, NetworkAddress *client_addr)
+{
+	if (this->AllowRequest(client_addr, 1, false)) this->ms->ForwardPacket(p, client_addr);
+}
+
+void WorkerNetworkUDPSocketHandler::SendServerList(ServerListType type, NetworkAddress *client_addr, const char *client)
+{
+	/* The main thread changes the live packets, so send the published copy */
+	ServerListSnapshot *server_list = this->ms->AcquireServerList();
+	this->SendServerListPackets(server_list->GetPackets(type), server_list->GetPacketCount(type), client_addr, client);
+	server_list->Release();
+}
@@ -0,0 +1,101 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shared/stdafx.h"
+#include "shared/debug.h"
+#include "masterserver.h"
+#include <poll.h>
+
+#include "shared/safeguards.h"
+
+/**
+ * @file masterserver/worker.cpp Threads answering server list requests next to the main thread
+ */
+
+ServerListSnapshot::ServerListSnapshot(const OnlineServerList *list, const ServerListSnapshot *previous) : references(1)
+{
+	for (uint i = 0; i < SLT_END; i++) {
+		const OnlineServerList::PacketList &packets = list->GetPackets((ServerListType)i);
+
+		for (uint j = 0; j < packets.Length(); j++) {
+			SharedPacket *shared;
+			if (previous != NULL && j < previous->shared[i].Length() && !list->IsChanged((ServerListType)i, j)) {
+				/* Still the same as in the previous snapshot */
+				shared = previous->shared[i][j];
+				__sync_add_and_fetch(&shared->references, 1);
+			} else {
+				const Packet *p = packets[j];
+				shared = new SharedPacket();
+				shared->packet = new Packet(PACKET_UDP_MASTER_RESPONSE_LIST);
+				memcpy(shared->packet->buffer, p->buffer, p->size);
+				shared->packet->size = p->size;
+				shared->references = 1;
+			}
+
+			*this->shared[i].Append() = shared;
+			*this->packets[i].Append() = shared->packet;
+		}
+	}
+}
+
+ServerListSnapshot::~ServerListSnapshot()
+{
+	for (uint i = 0; i < SLT_END; i++) {
+		for (SharedPacket **shared = this->shared[i].Begin(); shared != this->shared[i].End(); shared++) {
+			if (__sync_sub_and_fetch(&(*shared)->references, 1) != 0) continue;
+
+			delete (*shared)->packet;
+			delete *shared;
+		}
+	}
+}
+
+MasterWorker::MasterWorker(MasterServer *ms, NetworkAddressList *addresses) : ms(ms), running(false)
+{
+	this->socket = new WorkerNetworkUDPSocketHandler(ms, addresses);
+	if (!this->socket->Listen(true)) error("Could not bind worker socket");
+}
+
+MasterWorker::~MasterWorker()
+{
+	if (this->running) pthread_join(this->thread, NULL);
+	delete this->socket;
+}
+
+bool MasterWorker::Start()
+{
+	this->running = pthread_create(&this->thread, NULL, &MasterWorker::ThreadProc, this) == 0;
+	return this->running;
+}
+
+/* static */ void *MasterWorker::ThreadProc(void *worker)
+{
+	((MasterWorker *)worker)->Run();
+	return NULL;
+}
+
+void MasterWorker::Run()
+{
+	SmallVector<struct pollfd, 4> fds;
+
+	const SocketList &sockets = this->socket->GetSockets();
+	for (SocketList::const_iterator s = sockets.Begin(); s != sockets.End(); s++) {
+		struct pollfd *fd = fds.Append();
+		fd->fd      = s->second;
+		fd->events  = POLLIN;
+		fd->revents = 0;
+	}
+
+	while (!this->ms->IsStopping()) {
+		/* Wake up every second to see whether we have to stop */
+		if (poll(fds.Begin(), fds.Length(), 1000) <= 0) continue;
+
+		this->socket->ReceivePackets();
+	}
+}
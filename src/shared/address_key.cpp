@@ -0,0 +1,98 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server/updater and content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stdafx.h"
+#include "address_key.h"
+#include "siphash.h"
+
+#include "shared/safeguards.h"
+
+/**
+ * @file address_key.cpp Conversion between network addresses and their compact keys
+ */
+
+/** Prefix of an IPv4-mapped IPv6 address, i.e. ::ffff:0:0/96 */
+static const uint8 _ipv4_mapped_prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+
+/** Secret key of AddressKey::Hash */
+static SipHashKey _address_hash_key;
+
+bool AddressKey::FromAddress(NetworkAddress *address)
+{
+	const sockaddr_storage *addr = address->GetAddress();
+
+	switch (addr->ss_family) {
+		case AF_INET:
+			memcpy(this->ip, _ipv4_mapped_prefix, sizeof(_ipv4_mapped_prefix));
+			memcpy(this->ip + sizeof(_ipv4_mapped_prefix), &((const sockaddr_in*)addr)->sin_addr, sizeof(in_addr));
+			break;
+
+		case AF_INET6:
+			memcpy(this->ip, &((const sockaddr_in6*)addr)->sin6_addr, sizeof(in6_addr));
+			break;
+
+		default:
+			return false;
+	}
+
+	this->port = address->GetPort();
+	return true;
+}
+
+bool AddressKey::FromString(const char *ip, uint16 port)
+{
+	in_addr addr;
+	if (inet_pton(AF_INET, ip, &addr) == 1) {
+		memcpy(this->ip, _ipv4_mapped_prefix, sizeof(_ipv4_mapped_prefix));
+		memcpy(this->ip + sizeof(_ipv4_mapped_prefix), &addr, sizeof(addr));
+	} else if (inet_pton(AF_INET6, ip, this->ip) != 1) {
+		return false;
+	}
+
+	this->port = port;
+	return true;
+}
+
+NetworkAddress AddressKey::ToAddress() const
+{
+	sockaddr_storage addr;
+	memset(&addr, 0, sizeof(addr));
+
+	if (this->IsIPv4()) {
+		sockaddr_in *sin = (sockaddr_in*)&addr;
+		sin->sin_family = AF_INET;
+		sin->sin_port   = htons(this->port);
+		memcpy(&sin->sin_addr, this->ip + sizeof(_ipv4_mapped_prefix), sizeof(in_addr));
+		return NetworkAddress(addr, sizeof(sockaddr_in));
+	}
+
+	sockaddr_in6 *sin6 = (sockaddr_in6*)&addr;
+	sin6->sin6_family = AF_INET6;
+	sin6->sin6_port   = htons(this->port);
+	memcpy(&sin6->sin6_addr, this->ip, sizeof(in6_addr));
+	return NetworkAddress(addr, sizeof(sockaddr_in6));
+}
+
+bool AddressKey::IsIPv4() const
+{
+	return memcmp(this->ip, _ipv4_mapped_prefix, sizeof(_ipv4_mapped_prefix)) == 0;
+}
+
+uint32 AddressKey::Hash() const
+{
+	byte data[sizeof(this->ip) + sizeof(this->port)];
+	memcpy(data, this->ip, sizeof(this->ip));
+	memcpy(data + sizeof(this->ip), &this->port, sizeof(this->port));
+	return (uint32)SipHash(_address_hash_key, data, sizeof(data));
+}
+
+/* static */ void AddressKey::InitHash()
+{
+	_address_hash_key.Randomize();
+}
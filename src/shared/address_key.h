@@ -0,0 +1,99 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server/updater and content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ADDRESS_KEY_H
+#define ADDRESS_KEY_H
+
+#include "shared/network/core/address.h"
+#include "core/smallvec_type.hpp"
+
+/**
+ * @file address_key.h Compact representation of an IP address and port
+ */
+
+/**
+ * A compact, fixed size key for an IP address and port. Unlike the
+ * NetworkAddress it does not carry any resolver state, so it can be
+ * copied and compared without touching getaddrinfo and friends.
+ * IPv4 addresses are stored as IPv4-mapped IPv6 addresses (::ffff:a.b.c.d)
+ * so both address families share the same layout.
+ */
+struct AddressKey {
+	uint8 ip[16]; ///< The IPv6 address or the IPv4-mapped IPv6 address, in network byte order
+	uint16 port;  ///< The port, in host byte order
+
+	/**
+	 * Fill this key with the address and port of the given network address.
+	 * @param address the (already resolved) address to get the key of
+	 * @return false if the address is not an IPv4 or IPv6 address
+	 */
+	bool FromAddress(NetworkAddress *address);
+
+	/**
+	 * Fill this key with a numeric IP address and the given port, without
+	 * going through the resolver.
+	 * @param ip   the IPv4 or IPv6 address in its textual form
+	 * @param port the port
+	 * @return false if the string is not a numeric IPv4 or IPv6 address
+	 */
+	bool FromString(const char *ip, uint16 port);
+
+	/**
+	 * Convert the key back into a network address.
+	 * @return the network address of this key
+	 */
+	NetworkAddress ToAddress() const;
+
+	/**
+	 * Whether this key describes an IPv4 address.
+	 * @return true if and only if the key is an IPv4-mapped address
+	 */
+	bool IsIPv4() const;
+
+	/**
+	 * Get the hash of this key for use in hash tables. The hash is keyed
+	 * with a secret per process, so others cannot choose addresses that
+	 * all collide.
+	 * @return the hash
+	 */
+	uint32 Hash() const;
+
+	/**
+	 * Choose the secret key of Hash. Must be called once at startup,
+	 * before any thread is started.
+	 */
+	static void InitHash();
+
+	/**
+	 * Compare two keys on IP address and port.
+	 * @param other the key to compare to
+	 * @return true if the keys are the same
+	 */
+	bool operator ==(const AddressKey &other) const
+	{
+		return this->port == other.port && memcmp(this->ip, other.ip, sizeof(this->ip)) == 0;
+	}
+
+	/**
+	 * Order two keys on IP address and port.
+	 * @param other the key to compare to
+	 * @return true if this key sorts before the other
+	 */
+	bool operator <(const AddressKey &other) const
+	{
+		int ret = memcmp(this->ip, other.ip, sizeof(this->ip));
+		if (ret == 0) return this->port < other.port;
+		return ret < 0;
+	}
+};
+
+/** Contiguous list of address keys */
+typedef SmallVector<AddressKey, 64> AddressKeyList;
+
+#endif /* ADDRESS_KEY_H */
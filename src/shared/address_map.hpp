@@ -0,0 +1,162 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server/updater and content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ADDRESS_MAP_HPP
+#define ADDRESS_MAP_HPP
+
+#include "core/alloc_func.hpp"
+#include "address_key.h"
+
+/**
+ * @file address_map.hpp Flat hash map keyed on address keys
+ */
+
+/**
+ * Hash map from an address key to a value, using open addressing with
+ * linear probing in a single flat array. Removal shifts the following
+ * entries back, so lookups never have to skip over tombstones.
+ * @tparam T the type of the values; it is copied with memcpy, so it must
+ *           be plain old data like a pointer or an integer.
+ */
+template <typename T>
+class AddressMap {
+private:
+	/** Initial number of slots; a power of two */
+	static const uint INITIAL_CAPACITY = 64;
+
+	/** A slot in the flat array */
+	struct Slot {
+		AddressKey key; ///< The key of the entry
+		uint32 hash;    ///< The hash of the key
+		bool used;      ///< Whether there is an entry in this slot
+		T value;        ///< The value of the entry
+	};
+
+	Slot *slots;   ///< The slots; always a power of two of them
+	uint mask;     ///< Number of slots minus one
+	uint count;    ///< Number of used slots
+
+	/**
+	 * Find the slot of the key, or the free slot the key would go in.
+	 * @param key  the key to look for
+	 * @param hash the hash of the key
+	 * @return the slot
+	 */
+	Slot *Lookup(const AddressKey &key, uint32 hash) const
+	{
+		for (uint i = hash & this->mask;; i = (i + 1) & this->mask) {
+			Slot *slot = &this->slots[i];
+			if (!slot->used || (slot->hash == hash && slot->key == key)) return slot;
+		}
+	}
+
+	/** Double the number of slots and re-insert all entries */
+	void Grow()
+	{
+		Slot *old_slots = this->slots;
+		uint old_capacity = this->mask + 1;
+
+		this->mask = old_capacity * 2 - 1;
+		this->slots = CallocT<Slot>(this->mask + 1);
+
+		for (uint i = 0; i < old_capacity; i++) {
+			if (old_slots[i].used) *this->Lookup(old_slots[i].key, old_slots[i].hash) = old_slots[i];
+		}
+		free(old_slots);
+	}
+
+public:
+	/** Create an empty map */
+	AddressMap() : mask(INITIAL_CAPACITY - 1), count(0)
+	{
+		this->slots = CallocT<Slot>(INITIAL_CAPACITY);
+	}
+
+	/** Free the slots */
+	~AddressMap()
+	{
+		free(this->slots);
+	}
+
+	/** Remove all entries, and give back the memory of the slots */
+	void Clear()
+	{
+		free(this->slots);
+		this->mask  = INITIAL_CAPACITY - 1;
+		this->count = 0;
+		this->slots = CallocT<Slot>(INITIAL_CAPACITY);
+	}
+
+	/**
+	 * Get the number of entries in the map.
+	 * @return the number of entries
+	 */
+	uint Length() const { return this->count; }
+
+	/**
+	 * Find the value of the given key.
+	 * @param key the key to look for
+	 * @return the value, or NULL when the key is not in the map
+	 */
+	T *Find(const AddressKey &key) const
+	{
+		Slot *slot = this->Lookup(key, key.Hash());
+		return slot->used ? &slot->value : NULL;
+	}
+
+	/**
+	 * Get the value of the given key, adding the key when it is not in the map yet.
+	 * @param key the key to look for
+	 * @return the value; zero filled for new keys
+	 */
+	T &operator [](const AddressKey &key)
+	{
+		/* Keep the load factor below one half, so the probe sequences stay short */
+		if ((this->count + 1) * 2 > this->mask + 1) this->Grow();
+
+		uint32 hash = key.Hash();
+		Slot *slot = this->Lookup(key, hash);
+		if (!slot->used) {
+			memset(slot, 0, sizeof(*slot));
+			slot->key  = key;
+			slot->hash = hash;
+			slot->used = true;
+			this->count++;
+		}
+		return slot->value;
+	}
+
+	/**
+	 * Remove the given key from the map.
+	 * @param key the key to remove
+	 * @return false if the key was not in the map
+	 */
+	bool Erase(const AddressKey &key)
+	{
+		Slot *slot = this->Lookup(key, key.Hash());
+		if (!slot->used) return false;
+
+		/* Shift the entries of the same cluster that cannot be found
+		 * anymore back into the gap, until we hit an empty slot. */
+		uint gap = slot - this->slots;
+		for (uint i = (gap + 1) & this->mask; this->slots[i].used; i = (i + 1) & this->mask) {
+			uint home = this->slots[i].hash & this->mask;
+			/* Entry may move when its home slot is not (cyclically) between the gap and itself */
+			if (((i - home) & this->mask) >= ((i - gap) & this->mask)) {
+				this->slots[gap] = this->slots[i];
+				gap = i;
+			}
+		}
+		this->slots[gap].used = false;
+		this->count--;
+		return true;
+	}
+};
+
+#endif /* ADDRESS_MAP_HPP */
@@ -16,7 +16,10 @@
 #include "string_func.h"
 #include "date_func.h"
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
+#include <mysql/mysqld_error.h>
 #include <string.h>
+#include <time.h>
 
 #include "shared/safeguards.h"
 
@@ -24,73 +27,442 @@
  * @file mysql.cpp Implementation of the MySQL backend
  */
 
-/** The database we are connected to */
-static MYSQL *_mysql = NULL;
+/** The columns of content selected by the MS_CONTENT_BY_* statements */
+#define CONTENT_COLUMNS "SELECT id, name, filename, filesize, type_id, version, url, description, uniqueid, uniquemd5 FROM bananas_file WHERE active = 1 AND "
 
-enum {
-	MAX_SQL_LEN = 1024 ///< Maximum length of a SQL query we can perform
+/** The columns of content selected by the MS_CATALOG_* statements; the ones of CONTENT_COLUMNS and what is needed for listing */
+#define CATALOG_COLUMNS "SELECT id, name, filename, filesize, type_id, version, url, description, uniqueid, uniquemd5, active, published, minimalVersion, maximalVersion FROM bananas_file WHERE "
+
+/** Repeat a part of a query, with a separator in between */
+#define REPEAT_4(x, sep)   x sep x sep x sep x
+#define REPEAT_16(x, sep)  REPEAT_4(REPEAT_4(x, sep), sep)
+#define REPEAT_64(x, sep)  REPEAT_4(REPEAT_16(x, sep), sep)
+#define REPEAT_128(x, sep) REPEAT_64(x, sep) sep REPEAT_64(x, sep)
+
+/** The queries of the statements, in the order of MySQLStatementID */
+static const char * const _statement_queries[] = {
+	/* Do NOT reset the last_queried when making a server go online,
+	 * as the server regularly sends an advertisement to the server.
+	 * Resetting the last_queried here makes the updater update them
+	 * which is pointless. New servers, and old servers that have really
+	 * come online (last_queried = 0000...) are first in the queue. */
+	"CALL MakeOnline(?, ?, ?, ?)",
+	/* Set the 'last_queried' date to a low value, so the next time
+	 * the server is marked online, it will be handled with priority
+	 * by the updater. */
+	"CALL MakeOffline(?, ?)",
+	"SELECT UpdateGameInfo(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+	"DELETE FROM servers_newgrfs WHERE server_id = ?",
+	/* Unused rows are filled with copies of the last NewGRF, which are ignored as duplicates */
+	"INSERT IGNORE INTO servers_newgrfs (server_id, grfid, md5sum) VALUES " REPEAT_64("(?, ?, ?)", ", "),
+	"SELECT newgrfs_fingerprint FROM servers WHERE id = ?",
+	"UPDATE servers SET newgrfs_fingerprint = ? WHERE id = ?",
+	"UPDATE servers_ips SET last_advertised = NOW() WHERE ip = ? AND port = ?",
+	"UPDATE servers_ips SET last_advertised = NOW() WHERE " REPEAT_16("(ip = ? AND port = ?)", " OR "),
+	"SELECT ip, port FROM servers_ips WHERE online = '1' AND ipv6 = ? GROUP BY server_id",
+	/* Claiming and marking as queried in one statement makes sure concurrent updaters never query the same server */
+	"UPDATE servers_ips SET last_queried = NOW(), claim = ? WHERE online = '1' AND last_queried < DATE_SUB(NOW(), INTERVAL ? SECOND) ORDER BY last_queried LIMIT ?",
+	"SELECT ip, port FROM servers_ips WHERE claim = ? LIMIT ?",
+	"UPDATE servers_ips SET online = '0' WHERE online = '1' AND last_advertised < DATE_SUB(NOW(), INTERVAL ? SECOND)",
+	"UPDATE servers_ips SET last_queried = '0000-00-00 00:00:00'",
+	"INSERT IGNORE INTO newgrfs SET name = 'Not yet known', grfid = ?, md5sum = ?, unknown = '1'",
+	"UPDATE newgrfs SET name = ?, unknown = '0' WHERE grfid = ? AND md5sum = ? AND unknown = '1'",
+	/* Unused keys are filled with copies of the last key, which do not change the results */
+	CONTENT_COLUMNS "id IN (" REPEAT_128("?", ", ") ")",
+	CONTENT_COLUMNS "(" REPEAT_128("(uniqueid = ? AND type_id = ?)", " OR ") ")",
+	CONTENT_COLUMNS "(" REPEAT_128("(uniqueid = ? AND uniquemd5 = ? AND type_id = ?)", " OR ") ")",
+	"SELECT file.file_id, tag.name FROM bananas_tag AS tag JOIN bananas_file_tags AS file ON tag.id = file.tag_id WHERE file.file_id IN (" REPEAT_128("?", ", ") ")",
+	"SELECT from_file_id, to_file_id FROM bananas_file_deps WHERE from_file_id IN (" REPEAT_128("?", ", ") ")",
+	"SELECT id FROM bananas_file WHERE active = 1 AND published = 1 AND type_id = ? AND minimalVersion <= ? AND " \
+			"(maximalVersion = -1 OR maximalVersion >= ?) ORDER BY uniqueid DESC LIMIT ?",
+	"SELECT UNIX_TIMESTAMP(MAX(modified)), UNIX_TIMESTAMP(NOW()) FROM bananas_file",
+	CATALOG_COLUMNS "active = 1",
+	/* Inactive content is selected as well, so it can be removed from the catalog */
+	CATALOG_COLUMNS "modified >= FROM_UNIXTIME(?)",
+	/* Unused places are filled with copies of the last content; the CASE never gets to those */
+	"UPDATE bananas_file SET downloads = downloads + CASE id " REPEAT_64("WHEN ? THEN ?", " ") " END WHERE id IN (" REPEAT_64("?", ", ") ")",
+	/* Unused places are 0, which is never the id of content; the leading 0 only names the column */
+	"INSERT INTO bananas_download (file_id, date) SELECT file_id, NOW() FROM " \
+			"(SELECT 0 AS file_id UNION ALL SELECT " REPEAT_64("?", " UNION ALL SELECT ") ") AS downloads WHERE file_id <> 0",
 };
+assert_compile(lengthof(_statement_queries) == MS_END);
+assert_compile(MYSQL_ADVERTISED_BATCH_SIZE == 16);
+assert_compile(MYSQL_SERVER_GRFS_BATCH_SIZE == 64);
+assert_compile(MYSQL_CONTENT_BATCH_SIZE == 128);
+assert_compile(MYSQL_DOWNLOADS_BATCH_SIZE == 64);
+
+/** Number of pools; the library is ended with the last one */
+static uint _mysql_pools = 0;
+
+/**
+ * Bind an integer parameter or result.
+ * @param bind        the parameter or result to bind
+ * @param value       the integer
+ * @param type        the MySQL type of the integer, e.g. MYSQL_TYPE_LONG for 32 bits integers
+ * @param is_unsigned whether the integer is unsigned
+ */
+static void BindInteger(MYSQL_BIND *bind, void *value, enum_field_types type, bool is_unsigned)
+{
+	memset(bind, 0, sizeof(*bind));
+	bind->buffer_type = type;
+	bind->buffer      = value;
+	bind->is_unsigned = is_unsigned;
+}
+
+/** Bind a signed 32 bits integer parameter or result. */
+static inline void BindInt(MYSQL_BIND *bind, int32 *value) { BindInteger(bind, value, MYSQL_TYPE_LONG, false); }
+/** Bind an unsigned 32 bits integer parameter or result. */
+static inline void BindUint(MYSQL_BIND *bind, uint32 *value) { BindInteger(bind, value, MYSQL_TYPE_LONG, true); }
+/** Bind a signed 64 bits integer parameter or result. */
+static inline void BindInt64(MYSQL_BIND *bind, int64 *value) { BindInteger(bind, value, MYSQL_TYPE_LONGLONG, false); }
+
+/**
+ * Bind a string parameter.
+ * @param bind  the parameter to bind
+ * @param value the string; it is not copied
+ */
+static void BindString(MYSQL_BIND *bind, const char *value)
+{
+	memset(bind, 0, sizeof(*bind));
+	bind->buffer_type   = MYSQL_TYPE_STRING;
+	bind->buffer        = const_cast<char *>(value);
+	bind->buffer_length = strlen(value);
+}
+
+/**
+ * Bind a buffer to receive a string or binary column into.
+ * @param bind   the result to bind
+ * @param type   MYSQL_TYPE_STRING or MYSQL_TYPE_BLOB
+ * @param buffer the buffer; may be NULL to ignore the column
+ * @param size   the size of the buffer
+ * @param length where to store the length of the fetched value; may be NULL
+ */
+static void BindBuffer(MYSQL_BIND *bind, enum_field_types type, char *buffer, unsigned long size, unsigned long *length)
+{
+	memset(bind, 0, sizeof(*bind));
+	bind->buffer_type   = type;
+	bind->buffer        = buffer;
+	bind->buffer_length = size;
+	bind->length        = length;
+}
+
+/**
+ * Bind a buffer to receive a string column into; after fetching,
+ * call TerminateString to end the string.
+ * @param bind   the result to bind
+ * @param buffer the buffer, or NULL to ignore the column
+ * @param size   the size of the buffer, including the space for the terminator
+ * @param length where to store the length of the fetched value
+ */
+static inline void BindStringResult(MYSQL_BIND *bind, char *buffer, size_t size, unsigned long *length)
+{
+	BindBuffer(bind, MYSQL_TYPE_STRING, buffer, buffer == NULL ? 0 : size - 1, length);
+}
+
+/**
+ * Terminate a string fetched into a buffer bound with BindStringResult.
+ * @param buffer the buffer
+ * @param size   the size of the buffer
+ * @param length the length of the fetched value; it is truncated when it does not fit
+ */
+static void TerminateString(char *buffer, size_t size, unsigned long length)
+{
+	buffer[min(length, size - 1)] = '\0';
+}
 
 /**
- * Perform a query on the MySQL database
- * @param sql the query to perform
- * @return the result of the query
+ * Get the current time of the monotonic clock.
+ * @return the time in seconds
  */
-MYSQL_RES *MySQLQuery(const char *sql)
+static time_t GetMonotonicSeconds()
 {
-	DEBUG(sql, 6, "Executing: %s", sql);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
 
-	int result = mysql_query(_mysql, sql);
-	if (result) {
-		DEBUG(sql, 0, "SQL Error: %s executing %s", mysql_error(_mysql), sql);
-		return NULL;
+/**
+ * Whether an error means that the connection to the database was lost.
+ * @param error the error number
+ * @return true if the connection has to be re-established
+ */
+static bool IsConnectionLost(uint error)
+{
+	return error == CR_SERVER_GONE_ERROR || error == CR_SERVER_LOST;
+}
+
+/**
+ * Whether an error means that the statement has to be prepared again, e.g.
+ * because the connection was lost and has been (or will be) re-established.
+ * @param error the error number
+ * @return true if preparing and executing the statement again could help
+ */
+static bool NeedsPrepareAgain(uint error)
+{
+	switch (error) {
+		case CR_SERVER_GONE_ERROR:
+		case CR_SERVER_LOST:
+		case ER_UNKNOWN_STMT_HANDLER:
+		case ER_NEED_REPREPARE:
+			return true;
+
+		default:
+			return false;
 	}
+}
+
+void MySQLStatement::Init(MySQLConnection *connection, const char *query)
+{
+	this->Close();
+	this->connection = connection;
+	this->query = query;
+}
 
-	MYSQL_RES *mysql_res = mysql_store_result(_mysql);
+void MySQLStatement::Close()
+{
+	if (this->stmt == NULL) return;
 
-	return mysql_res;
+	mysql_stmt_close(this->stmt);
+	this->stmt = NULL;
 }
 
+bool MySQLStatement::Prepare()
+{
+	if (this->stmt != NULL) return true;
+
+	if (!this->connection->Connect()) return false;
+
+	DEBUG(sql, 6, "Preparing: %s", this->query);
+
+	this->stmt = mysql_stmt_init(this->connection->GetHandle());
+	if (this->stmt == NULL) return false;
 
-MySQL::MySQL(const char *host, const char *user, const char *passwd, const char *db, unsigned int port)
+	return mysql_stmt_prepare(this->stmt, this->query, strlen(this->query)) == 0;
+}
+
+bool MySQLStatement::Execute(MYSQL_BIND *params, MYSQL_BIND *results)
 {
-	_mysql = mysql_init(NULL);
-	if (_mysql == NULL) error("Unable to create mysql object");
+	DEBUG(sql, 6, "Executing: %s", this->query);
+
+	for (bool retried = false;; retried = true) {
+		if (this->Prepare() &&
+				(params == NULL || !mysql_stmt_bind_param(this->stmt, params)) &&
+				mysql_stmt_execute(this->stmt) == 0) {
+			break;
+		}
+
+		/* Not being connected has already been logged by the connection */
+		MYSQL *mysql = this->connection->GetHandle();
+		if (mysql == NULL) return false;
 
-	if (!mysql_real_connect(_mysql, host, user, passwd, db, port, NULL, 0)) {
-		error("Cannot connect to MySQL: %s", mysql_error(_mysql));
+		uint error = this->stmt == NULL ? mysql_errno(mysql) : mysql_stmt_errno(this->stmt);
+		DEBUG(sql, 0, "SQL Error: %s executing %s", this->stmt == NULL ? mysql_error(mysql) : mysql_stmt_error(this->stmt), this->query);
+		this->Close();
+
+		if (retried || !NeedsPrepareAgain(error)) return false;
+
+		/* All statements are gone with the connection, so connect and prepare them again */
+		if (IsConnectionLost(error) && !this->connection->Reconnect()) return false;
 	}
 
-	bool truep = true;
-	if (mysql_options(_mysql, MYSQL_OPT_RECONNECT, (const char *)&truep) != 0) {
-		error("Cannot enable MySQL reconnection: %s", mysql_error(_mysql));
+	if (results == NULL) {
+		this->Finish();
+		return true;
 	}
 
-	if (mysql_set_character_set(_mysql, "utf8")) {
-		error("Cannot change character set to utf8: %s", mysql_error(_mysql));
+	if (mysql_stmt_bind_result(this->stmt, results) || mysql_stmt_store_result(this->stmt) != 0) {
+		DEBUG(sql, 0, "SQL Error: %s getting results of %s", mysql_stmt_error(this->stmt), this->query);
+		this->Finish();
+		return false;
 	}
+	return true;
+}
 
-	DEBUG(sql, 1, "Connected to MySQL");
+void MySQLStatement::BindResult(MYSQL_BIND *results)
+{
+	mysql_stmt_bind_result(this->stmt, results);
 }
 
-MySQL::~MySQL()
+bool MySQLStatement::Fetch()
 {
-	mysql_close(_mysql);
-	mysql_library_end();
+	int result = mysql_stmt_fetch(this->stmt);
+	return result == 0 || result == MYSQL_DATA_TRUNCATED;
+}
 
-	_mysql = NULL;
+uint MySQLStatement::GetRowCount()
+{
+	return mysql_stmt_num_rows(this->stmt);
 }
 
-void MySQL::Quote(char *dest, size_t dest_len, const char *to_quote)
+void MySQLStatement::Finish()
 {
-	/* Make sure the destination string is large enough to perform quoting
-	 * and not the source string, as that goes not work. */
-	if (dest == NULL || to_quote == NULL || dest == to_quote || dest_len < (2 * strlen(to_quote) + 1)) {
-		if (dest != NULL) dest[0] = '\0';
-		return;
+	if (this->stmt == NULL) return;
+
+	mysql_stmt_free_result(this->stmt);
+
+	/* Calling a stored procedure gives an extra result with its status */
+	while (mysql_stmt_next_result(this->stmt) == 0) mysql_stmt_free_result(this->stmt);
+}
+
+
+MySQLConnection::MySQLConnection() :
+	pool(NULL),
+	mysql(NULL),
+	last_used(0),
+	retry_at(0),
+	backoff(MYSQL_RECONNECT_BACKOFF_MIN),
+	next_free(NULL)
+{
+	/* The statements are prepared when they are used for the first time */
+	for (uint i = 0; i < MS_END; i++) {
+		this->statements[i].Init(this, _statement_queries[i]);
 	}
+}
 
-	mysql_real_escape_string(_mysql, dest, to_quote, strlen(to_quote));
+MySQLConnection::~MySQLConnection()
+{
+	this->Disconnect();
+}
+
+bool MySQLConnection::Connect()
+{
+	if (this->mysql != NULL) return true;
+
+	time_t now = GetMonotonicSeconds();
+	if (now < this->retry_at) return false;
+
+	this->mysql = mysql_init(NULL);
+	if (this->mysql == NULL) {
+		DEBUG(sql, 0, "Unable to create mysql object");
+	} else if (!mysql_real_connect(this->mysql, this->pool->host, this->pool->user, this->pool->passwd, this->pool->db, this->pool->port, NULL, CLIENT_MULTI_RESULTS)) {
+		/* Calling stored procedures from prepared statements gives multiple results, hence CLIENT_MULTI_RESULTS */
+		DEBUG(sql, 0, "Cannot connect to MySQL: %s", mysql_error(this->mysql));
+	} else if (mysql_set_character_set(this->mysql, "utf8")) {
+		DEBUG(sql, 0, "Cannot change character set to utf8: %s", mysql_error(this->mysql));
+	} else {
+		DEBUG(sql, 3, "Connected to MySQL");
+		this->backoff = MYSQL_RECONNECT_BACKOFF_MIN;
+		this->last_used = now;
+		return true;
+	}
+
+	/* Do not try again for a while; longer after each failed attempt */
+	this->Disconnect();
+	this->retry_at = now + this->backoff;
+	DEBUG(sql, 1, "Retrying to connect to MySQL in %u seconds", this->backoff);
+	this->backoff = min(this->backoff * 2, (uint)MYSQL_RECONNECT_BACKOFF_MAX);
+	return false;
+}
+
+void MySQLConnection::Disconnect()
+{
+	/* The statements have to be closed before their connection */
+	for (uint i = 0; i < MS_END; i++) {
+		this->statements[i].Close();
+	}
+
+	if (this->mysql == NULL) return;
+
+	mysql_close(this->mysql);
+	this->mysql = NULL;
+}
+
+bool MySQLConnection::Reconnect()
+{
+	DEBUG(sql, 1, "Lost the connection to MySQL, reconnecting");
+	this->Disconnect();
+	return this->Connect();
+}
+
+void MySQLConnection::CheckHealth(time_t now)
+{
+	if (this->mysql == NULL || now - this->last_used < MYSQL_PING_INTERVAL) return;
+
+	if (mysql_ping(this->mysql) != 0) {
+		DEBUG(sql, 1, "MySQL connection is not alive anymore: %s", mysql_error(this->mysql));
+		this->Disconnect();
+	}
+}
+
+
+MySQLPool::MySQLPool(const char *host, const char *user, const char *passwd, const char *db, unsigned int port, uint size) :
+	host(host),
+	user(user),
+	passwd(passwd),
+	db(db),
+	port(port),
+	free(NULL)
+{
+	assert(size > 0);
+
+	if (_mysql_pools++ == 0 && mysql_library_init(0, NULL, NULL) != 0) error("Unable to initialise the MySQL library");
+
+	this->connections = new MySQLConnection[size];
+	for (uint i = size; i-- > 0;) {
+		this->connections[i].pool = this;
+		this->connections[i].next_free = this->free;
+		this->free = &this->connections[i];
+	}
+
+	pthread_mutex_init(&this->lock, NULL);
+	pthread_cond_init(&this->released, NULL);
+
+	/* Without a database at startup there is most likely something wrong with the configuration */
+	if (!this->connections[0].Connect()) error("Cannot connect to MySQL");
+}
+
+MySQLPool::~MySQLPool()
+{
+	delete[] this->connections;
+
+	pthread_cond_destroy(&this->released);
+	pthread_mutex_destroy(&this->lock);
+
+	if (--_mysql_pools == 0) mysql_library_end();
+}
+
+MySQLConnection *MySQLPool::Acquire()
+{
+	pthread_mutex_lock(&this->lock);
+	while (this->free == NULL) pthread_cond_wait(&this->released, &this->lock);
+
+	MySQLConnection *connection = this->free;
+	this->free = connection->next_free;
+	pthread_mutex_unlock(&this->lock);
+
+	connection->CheckHealth(GetMonotonicSeconds());
+	return connection;
+}
+
+void MySQLPool::Release(MySQLConnection *connection)
+{
+	connection->last_used = GetMonotonicSeconds();
+
+	pthread_mutex_lock(&this->lock);
+	connection->next_free = this->free;
+	this->free = connection;
+	pthread_cond_signal(&this->released);
+	pthread_mutex_unlock(&this->lock);
+}
+
+
+MySQL::MySQL(MySQLPool *pool, bool binary_schema) :
+	pool(pool),
+	binary_schema(binary_schema),
+	claims(0)
+{
+	this->claim_key.Randomize();
+	DEBUG(sql, 1, "Using MySQL with the %s schema", binary_schema ? "binary" : "text");
+}
+
+void MySQL::ThreadInit()
+{
+	mysql_thread_init();
+}
+
+void MySQL::ThreadEnd()
+{
+	mysql_thread_end();
 }
 
 void MySQL::MD5sumToString(const uint8 md5sum[16], char *dest)
@@ -104,39 +476,147 @@ void MySQL::MD5sumToString(const uint8 md5sum[16], char *dest)
 	dest[32] = '\0';
 }
 
-void MySQL::MakeServerOnline(const char *ip, uint16 port, bool ipv6, uint64 session_key)
+void MySQL::BindMD5sum(const uint8 md5sum[16], MD5sumBuffer *buffer, MYSQL_BIND *bind)
 {
-	char sql[MAX_SQL_LEN];
+	if (this->binary_schema) {
+		memcpy(buffer->data, md5sum, 16);
+		buffer->length = 16;
+	} else {
+		this->MD5sumToString(md5sum, buffer->data);
+		buffer->length = 32;
+	}
 
-	/* Do NOT reset the last_queried when making a server go online,
-	 * as the server regularly sends an advertisement to the server.
-	 * Resetting the last_queried here makes the updater update them
-	 * which is pointless. New servers, and old servers that have really
-	 * come online (last_queried = 0000...) are first in the queue. */
-	seprintf(sql, lastof(sql), "CALL MakeOnline('%d', '%s', '%d', '%lld')", ipv6, ip, port, session_key);
-	MYSQL_RES *res = MySQLQuery(sql);
-	if (res != NULL) mysql_free_result(res);
+	BindBuffer(bind, this->binary_schema ? MYSQL_TYPE_BLOB : MYSQL_TYPE_STRING, buffer->data, buffer->length, NULL);
 }
 
-void MySQL::MakeServerOffline(const char *ip, uint16 port)
+void MySQL::BindMD5sumResult(MD5sumBuffer *buffer, MYSQL_BIND *bind)
 {
-	char sql[MAX_SQL_LEN];
+	BindBuffer(bind, this->binary_schema ? MYSQL_TYPE_BLOB : MYSQL_TYPE_STRING, buffer->data, sizeof(buffer->data), &buffer->length);
+}
 
-	/* Set the 'last_queried' date to a low value, so the next time
-	 * the server is marked online, it will be handled with priority
-	 * by the updater. */
-	seprintf(sql, lastof(sql), "CALL MakeOffline('%s', '%d')", ip, port);
-	MYSQL_RES *res = MySQLQuery(sql);
-	if (res != NULL) mysql_free_result(res);
+void MySQL::MD5sumFromSQL(uint8 md5sum[16], const MD5sumBuffer *buffer)
+{
+	if (this->binary_schema) {
+		if (buffer->length == 16) {
+			memcpy(md5sum, buffer->data, 16);
+		} else {
+			memset(md5sum, 0, 16);
+		}
+		return;
+	}
+
+	for (uint j = 0; j < 32 && j < buffer->length; j++) {
+		int k;
+		char c = buffer->data[j];
+		if (c <= '9') {
+			k = c - '0';
+		} else if (c <= 'F') {
+			k = c - 'A' + 10;
+		} else {
+			k = c - 'a' + 10;
+		}
+
+		if (j % 2 == 0) {
+			md5sum[j / 2] = k << 4;
+		} else {
+			md5sum[j / 2] |= k;
+		}
+	}
+}
+
+void MySQL::BindAddress(const AddressKey &server, AddressBuffer *buffer, MYSQL_BIND *bind)
+{
+	/* IPv4 addresses are stored in their 4 bytes, like INET6_ATON does */
+	const uint8 *ip = server.IsIPv4() ? server.ip + sizeof(server.ip) - sizeof(in_addr) : server.ip;
+	uint length     = server.IsIPv4() ? sizeof(in_addr) : sizeof(in6_addr);
+
+	if (this->binary_schema) {
+		memcpy(buffer->data, ip, length);
+		buffer->length = length;
+	} else {
+		if (inet_ntop(server.IsIPv4() ? AF_INET : AF_INET6, ip, buffer->data, sizeof(buffer->data)) == NULL) buffer->data[0] = '\0';
+		buffer->length = strlen(buffer->data);
+	}
+
+	BindBuffer(bind, this->binary_schema ? MYSQL_TYPE_BLOB : MYSQL_TYPE_STRING, buffer->data, buffer->length, NULL);
+}
+
+void MySQL::BindAddressResult(AddressBuffer *buffer, MYSQL_BIND *bind)
+{
+	if (this->binary_schema) {
+		BindBuffer(bind, MYSQL_TYPE_BLOB, buffer->data, sizeof(buffer->data), &buffer->length);
+	} else {
+		BindStringResult(bind, buffer->data, sizeof(buffer->data), &buffer->length);
+	}
+}
+
+bool MySQL::AddressFromSQL(AddressKey *server, AddressBuffer *buffer, uint16 port)
+{
+	if (!this->binary_schema) {
+		TerminateString(buffer->data, sizeof(buffer->data), buffer->length);
+		return server->FromString(buffer->data, port);
+	}
+
+	switch (buffer->length) {
+		case sizeof(in_addr):
+			memset(server->ip, 0, sizeof(server->ip) - sizeof(in_addr) - 2);
+			server->ip[10] = 0xFF;
+			server->ip[11] = 0xFF;
+			memcpy(server->ip + sizeof(server->ip) - sizeof(in_addr), buffer->data, sizeof(in_addr));
+			break;
+
+		case sizeof(in6_addr):
+			memcpy(server->ip, buffer->data, sizeof(in6_addr));
+			break;
+
+		default:
+			return false;
+	}
+
+	server->port = port;
+	return true;
+}
+
+void MySQL::MakeServerOnline(const AddressKey &server, uint64 session_key)
+{
+	MySQLLease connection(this->pool);
+
+	int32 ipv6 = !server.IsIPv4();
+	int32 port = server.port;
+	int64 key  = session_key;
+	AddressBuffer ip;
+
+	MYSQL_BIND params[4];
+	BindInt(&params[0], &ipv6);
+	this->BindAddress(server, &ip, &params[1]);
+	BindInt(&params[2], &port);
+	BindInt64(&params[3], &key);
+	connection->GetStatement(MS_MAKE_ONLINE).Execute(params);
+}
+
+void MySQL::MakeServerOffline(const AddressKey &server)
+{
+	MySQLLease connection(this->pool);
+
+	int32 port = server.port;
+	AddressBuffer ip;
+
+	MYSQL_BIND params[2];
+	this->BindAddress(server, &ip, &params[0]);
+	BindInt(&params[1], &port);
+	connection->GetStatement(MS_MAKE_OFFLINE).Execute(params);
+
+	/* Whatever NewGRFs it comes back with, they have to be checked again */
+	this->grfs_fingerprints.Erase(server);
 }
 
-void MySQL::UpdateNetworkGameInfo(const char *ip, uint16 port, const NetworkGameInfo *info)
+void MySQL::UpdateNetworkGameInfo(const AddressKey &server, const NetworkGameInfo *info)
 {
-	char sql[MAX_SQL_LEN];
+	MySQLLease connection(this->pool);
 
 	/*
-	 * Convert some of the variables in the NetworkGameInfo struct to strings
-	 * that the database understands and are SQL-injection safe.
+	 * Convert some of the variables in the NetworkGameInfo struct to
+	 * something the database understands.
 	 */
 
 	/*
@@ -149,319 +629,696 @@ void MySQL::UpdateNetworkGameInfo(const char *ip, uint16 port, const NetworkGame
 	DateToString(info->start_date, start_date, lastof(start_date));
 
 	/* Count number of GRFS */
-	uint num_grfs = 0;
+	int32 num_grfs = 0;
 	for (GRFConfig *c = info->grfconfig; c != NULL; c = c->next) num_grfs++;
 
-	/* Do some SQL-injection protection; make strings large enough for Quote */
-	char safe_server_name[sizeof(info->server_name) * 2];
-	char safe_server_revision[sizeof(info->server_revision) * 2];
-	char safe_map_name[sizeof(info->map_name) * 2];
-	this->Quote(safe_server_name,     sizeof(safe_server_name),     info->server_name);
-	this->Quote(safe_server_revision, sizeof(safe_server_revision), info->server_revision);
-	this->Quote(safe_map_name,        sizeof(safe_map_name),        info->map_name);
+	int32 port           = server.port;
+	int32 info_version   = info->game_info_version;
+	int32 server_lang    = info->server_lang;
+	int32 use_password   = info->use_password;
+	int32 clients_max    = info->clients_max;
+	int32 clients_on     = info->clients_on;
+	int32 spectators_max = info->spectators_max;
+	int32 spectators_on  = info->spectators_on;
+	int32 companies_max  = info->companies_max;
+	int32 companies_on   = info->companies_on;
+	int32 map_width      = info->map_width;
+	int32 map_height     = info->map_height;
+	int32 map_set        = info->map_set;
+	int32 dedicated      = info->dedicated;
+	AddressBuffer ip;
+
+	/* Strings are sent as is in parameters, so there is no need for quoting */
+	MYSQL_BIND params[21];
+	this->BindAddress(server, &ip, &params[0]);
+	BindInt(&params[1], &port);
+	BindInt(&params[2], &info_version);
+	BindString(&params[3], info->server_name);
+	BindString(&params[4], info->server_revision);
+	BindInt(&params[5], &server_lang);
+	BindInt(&params[6], &use_password);
+	BindInt(&params[7], &clients_max);
+	BindInt(&params[8], &clients_on);
+	BindInt(&params[9], &spectators_max);
+	BindInt(&params[10], &spectators_on);
+	BindInt(&params[11], &companies_max);
+	BindInt(&params[12], &companies_on);
+	BindString(&params[13], game_date);
+	BindString(&params[14], start_date);
+	BindString(&params[15], info->map_name);
+	BindInt(&params[16], &map_width);
+	BindInt(&params[17], &map_height);
+	BindInt(&params[18], &map_set);
+	BindInt(&params[19], &dedicated);
+	BindInt(&params[20], &num_grfs);
 
 	/* Do the actual update of the information */
-	seprintf(sql, lastof(sql), "SELECT UpdateGameInfo ('%s', '%d'," \
-						"'%d', '%s', '%s', '%d', '%d', '%d', '%d', '%d', '%d', '%d', " \
-						"'%d', '%s', '%s', '%s', '%d', '%d', '%d', '%d', '%d')", ip, port,
-						info->game_info_version, safe_server_name, safe_server_revision,
-						info->server_lang, info->use_password, info->clients_max,
-						info->clients_on, info->spectators_max, info->spectators_on,
-						info->companies_max, info->companies_on, game_date,
-						start_date, safe_map_name, info->map_width, info->map_height,
-						info->map_set, info->dedicated, num_grfs);
-
-	MYSQL_RES *res = MySQLQuery(sql);
-	if (res == NULL) return;
-
-	if (mysql_num_rows(res) == 0) {
-		mysql_free_result(res);
+	int32 server_id = 0;
+	MYSQL_BIND result;
+	BindInt(&result, &server_id);
+
+	MySQLStatement &update = connection->GetStatement(MS_UPDATE_GAME_INFO);
+	if (!update.Execute(params, &result)) return;
+	bool found = update.Fetch();
+	update.Finish();
+
+	/* The server_id is 'just' an index in the DB; 0 if the server is unknown */
+	if (!found || server_id == 0) {
+		this->grfs_fingerprints.Erase(server);
 		return;
 	}
 
-	/*
-	 * The server_id is 'just' an index in the DB and the size of the index
-	 * should never exceed 15 characters.
-	 */
-	char server_id[16];
-	seprintf(server_id, lastof(server_id), "%s", mysql_fetch_row(res)[0]);
-	mysql_free_result(res);
-	if (strcmp(server_id, "0") == 0) return;
+	this->UpdateServerGRFs(connection.GetConnection(), server, server_id, info->grfconfig);
+}
 
-	/*
-	 * TODO: is it possible to rewrite the next few lines, so we only need to
-	 * refresh NewGRFs if the game server was restarted instead for every time
-	 * we query the game server?
-	 */
+/**
+ * Calculate a fingerprint of a list of NewGRFs; it only changes when the
+ * NewGRFs or their order change. Unlike other hashes, it is calculated
+ * with a fixed key, so it can be compared with the one in the database.
+ * @param grfs the NewGRFs
+ * @return the fingerprint; never 0, so it differs from the database default
+ */
+static uint64 GetGRFsFingerprint(const GRFConfig *grfs)
+{
+	SipHashKey key = { 0, 0 };
+	for (const GRFConfig *c = grfs; c != NULL; c = c->next) {
+		key.k0 = SipHash(key, &c->ident, sizeof(c->ident));
+		key.k1++;
+	}
+	return key.k0 == 0 ? 1 : key.k0;
+}
 
-	/* Remove all GRFs, so we can add them later on */
-	seprintf(sql, lastof(sql), "DELETE FROM servers_newgrfs WHERE server_id='%s'", server_id);
-	res = MySQLQuery(sql);
-	if (res != NULL) mysql_free_result(res);
+void MySQL::UpdateServerGRFs(MySQLConnection *connection, const AddressKey &server, int32 server_id, const GRFConfig *grfs)
+{
+	uint64 fingerprint = GetGRFsFingerprint(grfs);
 
-	/* Now add the new GRFs */
-	for (GRFConfig *c = info->grfconfig; c != NULL; c = c->next) {
-		char md5sum[sizeof(c->ident.md5sum) * 2 + 1];
-		this->MD5sumToString(c->ident.md5sum, md5sum);
+	MYSQL_BIND params[MYSQL_SERVER_GRFS_BATCH_SIZE * 3];
+	BindInt(&params[0], &server_id);
 
-		seprintf(sql, lastof(sql), "INSERT INTO servers_newgrfs SET server_id='%s', "
-				"grfid='%u', md5sum='%s'", server_id, BSWAP32(c->ident.grfid), md5sum);
-		res = MySQLQuery(sql);
+	GRFsFingerprint *known = this->grfs_fingerprints.Find(server);
+	if (known == NULL || known->server_id != server_id) {
+		/* We have not written them ourselves, so ask the database what is in there */
+		uint64 stored = 0;
+		MYSQL_BIND result;
+		BindInteger(&result, &stored, MYSQL_TYPE_LONGLONG, true);
+
+		MySQLStatement &get = connection->GetStatement(MS_GET_GRFS_FINGERPRINT);
+		if (!get.Execute(params, &result)) return;
+		get.Fetch();
+		get.Finish();
+
+		/* Servers can also disappear without being made off-line by us, so bound what we remember */
+		if (this->grfs_fingerprints.Length() >= MYSQL_GRFS_FINGERPRINTS_MAX) this->grfs_fingerprints.Clear();
+
+		known = &this->grfs_fingerprints[server];
+		known->server_id = server_id;
+		known->fingerprint = stored;
+	}
+
+	if (known->fingerprint == fingerprint) return;
+
+	/* Remove all GRFs, so we can add them later on */
+	if (!connection->GetStatement(MS_DELETE_SERVER_GRFS).Execute(params)) return;
+
+	/* Now add the new GRFs, in as few statements as possible */
+	const GRFConfig *c = grfs;
+	while (c != NULL) {
+		uint32 grfids[MYSQL_SERVER_GRFS_BATCH_SIZE];
+		MD5sumBuffer md5sums[MYSQL_SERVER_GRFS_BATCH_SIZE];
+
+		for (uint i = 0; i < MYSQL_SERVER_GRFS_BATCH_SIZE; i++) {
+			MYSQL_BIND *row = &params[i * 3];
+			if (c == NULL) {
+				/* Repeat the last NewGRF; the duplicates are ignored */
+				memcpy(row, row - 3, sizeof(*row) * 3);
+				continue;
+			}
+
+			grfids[i] = BSWAP32(c->ident.grfid);
+			BindInt(&row[0], &server_id);
+			BindUint(&row[1], &grfids[i]);
+			this->BindMD5sum(c->ident.md5sum, &md5sums[i], &row[2]);
+			c = c->next;
+		}
 
-		if (res != NULL) mysql_free_result(res);
+		if (!connection->GetStatement(MS_ADD_SERVER_GRFS).Execute(params)) return;
 	}
+
+	BindInteger(&params[0], &fingerprint, MYSQL_TYPE_LONGLONG, true);
+	BindInt(&params[1], &server_id);
+	if (connection->GetStatement(MS_SET_GRFS_FINGERPRINT).Execute(params)) known->fingerprint = fingerprint;
 }
 
-uint MySQL::GetActiveServers(NetworkAddress result[], int length, bool ipv6)
+void MySQL::UpdateLastAdvertised(const AddressKeyList &servers)
 {
-	char sql[MAX_SQL_LEN];
+	MySQLLease connection(this->pool);
 
-	/* Select the online servers from database */
-	seprintf(sql, lastof(sql), "SELECT ip, port FROM servers_ips WHERE online='1' AND ipv6='%d' GROUP BY server_id LIMIT 0,%d", ipv6, length);
-	MYSQL_RES *res = MySQLQuery(sql);
-	if (res == NULL) return 0;
+	AddressBuffer ips[MYSQL_ADVERTISED_BATCH_SIZE];
+	int32 ports[MYSQL_ADVERTISED_BATCH_SIZE];
+	MYSQL_BIND params[MYSQL_ADVERTISED_BATCH_SIZE * 2];
 
-	/* The amount of advertised servers in the database */
-	uint count = mysql_num_rows(res);
+	/* Update the servers in batches, and the remainder one by one */
+	const AddressKey *key = servers.Begin();
+	while (key != servers.End()) {
+		uint count = (uint)(servers.End() - key) >= MYSQL_ADVERTISED_BATCH_SIZE ? MYSQL_ADVERTISED_BATCH_SIZE : 1;
 
-	for (uint i = 0; i < count; i++) {
-		MYSQL_ROW row = mysql_fetch_row(res);
-		result[i] = NetworkAddress(row[0], atoi(row[1]));
-	}
+		for (uint i = 0; i < count; i++, key++) {
+			ports[i] = key->port;
+			this->BindAddress(*key, &ips[i], &params[i * 2]);
+			BindInt(&params[i * 2 + 1], &ports[i]);
+		}
 
-	mysql_free_result(res);
-	return count;
+		connection->GetStatement(count == 1 ? MS_ADVERTISED : MS_ADVERTISED_BATCH).Execute(params);
+	}
 }
 
-uint MySQL::GetRequeryServers(NetworkAddress result[], int length, uint interval)
+void MySQL::GetActiveServers(AddressKeyList &result, bool ipv6)
 {
-	char sql[MAX_SQL_LEN];
+	MySQLLease connection(this->pool);
+
+	int32 param = ipv6;
+	MYSQL_BIND params[1];
+	BindInt(&params[0], &param);
+
+	AddressBuffer ip;
+	int32 port;
+	MYSQL_BIND results[2];
+	this->BindAddressResult(&ip, &results[0]);
+	BindInt(&results[1], &port);
 
 	/* Select the online servers from database */
-	seprintf(sql, lastof(sql), "SELECT ip, port FROM servers_ips "   \
-						"WHERE online='1' AND last_queried < DATE_SUB(NOW(), " \
-						"INTERVAL %d SECOND) ORDER BY last_queried LIMIT 0,%d",
-						interval, length);
-	MYSQL_RES *res = MySQLQuery(sql);
-	if (res == NULL) return 0;
+	MySQLStatement &active = connection->GetStatement(MS_ACTIVE_SERVERS);
+	if (!active.Execute(params, results)) return;
 
 	/* The amount of advertised servers in the database */
-	uint count = mysql_num_rows(res);
+	uint count = active.GetRowCount();
+	AddressKey *keys = result.Append(count);
 
-	for (uint i = 0; i < count; i++) {
-		MYSQL_ROW row = mysql_fetch_row(res);
-		result[i] = NetworkAddress(row[0], atoi(row[1]));
+	uint valid = 0;
+	while (valid < count && active.Fetch()) {
+		if (this->AddressFromSQL(&keys[valid], &ip, port)) valid++;
+	}
+
+	/* Drop the space reserved for the rows we could not parse */
+	for (; valid < count; valid++) result.Erase(result.End() - 1);
 
-		seprintf(sql, lastof(sql),
-				"UPDATE servers_ips SET last_queried=NOW() WHERE ip='%s' AND port='%s'", row[0], row[1]);
-		MYSQL_RES *res2 = MySQLQuery(sql);
-		mysql_free_result(res2);
+	active.Finish();
+}
+
+uint MySQL::GetRequeryServers(NetworkAddress result[], int length, uint interval)
+{
+	MySQLLease connection(this->pool);
+
+	/* A token nobody else uses, so we get exactly the servers we claimed; 0 means never claimed */
+	this->claims++;
+	uint64 token = SipHash(this->claim_key, &this->claims, sizeof(this->claims));
+	if (token == 0) token = 1;
+
+	int32 param_interval = interval;
+	int32 param_length   = length;
+	MYSQL_BIND params[3];
+	BindInteger(&params[0], &token, MYSQL_TYPE_LONGLONG, true);
+	BindInt(&params[1], &param_interval);
+	BindInt(&params[2], &param_length);
+
+	if (!connection->GetStatement(MS_CLAIM_REQUERY).Execute(params)) return 0;
+
+	AddressBuffer ip;
+	int32 port;
+	MYSQL_BIND results[2];
+	this->BindAddressResult(&ip, &results[0]);
+	BindInt(&results[1], &port);
+
+	/* Select the servers we claimed from the database */
+	BindInt(&params[1], &param_length);
+	MySQLStatement &claimed = connection->GetStatement(MS_CLAIMED_SERVERS);
+	if (!claimed.Execute(params, results)) return 0;
+
+	AddressKey server;
+	int count = 0;
+	while (count < length && claimed.Fetch()) {
+		if (this->AddressFromSQL(&server, &ip, port)) result[count++] = server.ToAddress();
 	}
+	claimed.Finish();
 
-	mysql_free_result(res);
 	return count;
 }
 
 void MySQL::RemoveUnadvertised(uint interval)
 {
-	char sql[MAX_SQL_LEN];
+	MySQLLease connection(this->pool);
 
-	/* Select the online servers from database */
-	seprintf(sql, lastof(sql), "UPDATE servers_ips SET online='0' WHERE "   \
-						"online='1' AND last_advertised < DATE_SUB(NOW(), INTERVAL %d SECOND)",
-						interval);
+	int32 param = interval;
+	MYSQL_BIND params[1];
+	BindInt(&params[0], &param);
 
 	/* We don't really care about the result, just execute it! */
-	MYSQL_RES *res = MySQLQuery(sql);
-	if (res != NULL) mysql_free_result(res);
+	connection->GetStatement(MS_REMOVE_UNADVERTISED).Execute(params);
 }
 
 void MySQL::ResetRequeryIntervals()
 {
-	MYSQL_RES *res = MySQLQuery("UPDATE servers_ips SET last_queried='0000-00-00 00:00:00'");
-	mysql_free_result(res);
+	MySQLLease connection(this->pool);
+
+	connection->GetStatement(MS_RESET_REQUERY).Execute(NULL);
 }
 
 void MySQL::AddGRF(const GRFIdentifier *grf)
 {
-	char sql[MAX_SQL_LEN];
-	char md5sum[sizeof(grf->md5sum) * 2 + 1];
+	MySQLLease connection(this->pool);
 
-	this->MD5sumToString(grf->md5sum, md5sum);
+	uint32 grfid = BSWAP32(grf->grfid);
+	MD5sumBuffer md5sum;
 
-	seprintf(sql, lastof(sql), "INSERT IGNORE INTO newgrfs SET name='Not yet known',"
-			"grfid='%u', md5sum='%s', unknown='1'", BSWAP32(grf->grfid), md5sum);
-	MYSQL_RES *res = MySQLQuery(sql);
-
-	if (res != NULL) mysql_free_result(res);
+	MYSQL_BIND params[2];
+	BindUint(&params[0], &grfid);
+	this->BindMD5sum(grf->md5sum, &md5sum, &params[1]);
+	connection->GetStatement(MS_ADD_GRF).Execute(params);
 }
 
 void MySQL::SetGRFName(const GRFIdentifier *grf, const char *name)
 {
-	char sql[MAX_SQL_LEN];
-	char md5sum[sizeof(grf->md5sum) * 2 + 1];
-	char safe_name[NETWORK_GRF_NAME_LENGTH * 2];
+	MySQLLease connection(this->pool);
 
-	this->MD5sumToString(grf->md5sum, md5sum);
-	this->Quote(safe_name, sizeof(safe_name), name);
+	uint32 grfid = BSWAP32(grf->grfid);
+	MD5sumBuffer md5sum;
 
-	seprintf(sql, lastof(sql), "UPDATE newgrfs SET name='%s', unknown='0' WHERE grfid='%u' AND md5sum='%s' AND unknown='1'",
-			safe_name, BSWAP32(grf->grfid), md5sum);
-	MYSQL_RES *res = MySQLQuery(sql);
+	MYSQL_BIND params[3];
+	BindString(&params[0], name);
+	BindUint(&params[1], &grfid);
+	this->BindMD5sum(grf->md5sum, &md5sum, &params[2]);
+	connection->GetStatement(MS_SET_GRF_NAME).Execute(params);
+}
 
-	if (res != NULL) mysql_free_result(res);
+/** A row of content as fetched by the MS_CONTENT_BY_* and MS_CATALOG_* statements */
+struct ContentRow {
+	uint32 id;                 ///< Unique ID of the content
+	char name[32];             ///< Name of the content
+	char filename[48];         ///< Filename of the content
+	uint32 filesize;           ///< Size of the file
+	int32 type;                ///< Type of the content
+	char version[16];          ///< Version of the content
+	char url[96];              ///< URL related to the content
+	char description[512];     ///< Description of the content
+	uint32 unique_id;          ///< Unique ID of the content within its type
+	uint8 md5sum[16];          ///< The MD5 checksum
+	unsigned long lengths[5];  ///< The lengths of the fetched strings
+};
+
+/** A tag of content as fetched by the MS_CONTENT_TAGS statement */
+struct ContentTag {
+	uint32 id;     ///< The content the tag belongs to
+	char name[32]; ///< The tag
+};
+
+/** A dependency of content as fetched by the MS_CONTENT_DEPENDENCIES statement */
+struct ContentDependency {
+	uint32 id;         ///< The content that depends on other content
+	uint32 dependency; ///< The content it depends on
+};
+
+/**
+ * Whether a fetched row of content is what is asked for with a content info.
+ * @param info the content info with the key
+ * @param row  the fetched row
+ * @param key  the key the content is searched with
+ * @return true if the row matches the key of the info
+ */
+static bool IsRequestedContent(const ContentInfo &info, const ContentRow &row, SQL::ContentKey key)
+{
+	switch (key) {
+		case SQL::CK_ID:
+			return info.id == (ContentID)row.id;
+
+		case SQL::CK_UNIQUEID_MD5:
+			if (memcmp(info.md5sum, row.md5sum, sizeof(info.md5sum)) != 0) return false;
+			/* FALL THROUGH */
+
+		case SQL::CK_UNIQUEID:
+			return info.unique_id == row.unique_id && info.type == (ContentType)row.type;
+
+		default:
+			return false;
+	}
 }
 
-bool MySQL::FillContentDetails(ContentInfo info[], int length, ContentKey key, bool extra_data)
+/**
+ * Copy a fetched row of content into a content info.
+ * @param info       the content info to fill
+ * @param row        the fetched row
+ * @param extra_data whether to copy the complex data, such as MD5 sum
+ */
+static void CopyContentRow(ContentInfo *info, const ContentRow &row, bool extra_data)
 {
-	for (int i = 0; i < length; i++) {
-		char sql[MAX_SQL_LEN];
-		char *p = sql;
-
-		p += seprintf(sql, lastof(sql), "SELECT id, name, filename, filesize, " \
-				"type_id, version, url, description, uniqueid, uniquemd5 " \
-				"FROM bananas_file WHERE active = 1 AND ");
-
-		switch (key) {
-			case CK_ID:
-				seprintf(p, lastof(sql), "id = %i", info[i].id);
-				break;
-
-			case CK_UNIQUEID:
-				seprintf(p, lastof(sql), "uniqueid = %u AND type_id = %i",
-								info[i].unique_id, info[i].type);
-				break;
-
-			case CK_UNIQUEID_MD5:
-				char md5sum[sizeof(info[i].md5sum) * 2 + 1];
-				this->MD5sumToString(info[i].md5sum, md5sum);
-				seprintf(p, lastof(sql), "uniqueid = %u AND uniquemd5 = '%s' AND type_id = %i",
-								info[i].unique_id, md5sum, info[i].type);
-				break;
-
-			default:
-				return false;
-		}
-		MYSQL_RES *res = MySQLQuery(sql);
-		if (res == NULL) return false;
+	info->id = (ContentID)row.id;
+	info->type = (ContentType)row.type;
+	info->filesize = row.filesize;
+	strecpy(info->filename, row.filename, lastof(info->filename));
+
+	if (!extra_data) return;
+
+	strecpy(info->name, row.name, lastof(info->name));
+	strecpy(info->version, row.version, lastof(info->version));
+	strecpy(info->url, row.url, lastof(info->url));
+	strecpy(info->description, row.description, lastof(info->description));
+	info->unique_id = row.unique_id;
+	memcpy(info->md5sum, row.md5sum, sizeof(info->md5sum));
+}
 
-		if (mysql_num_rows(res) == 0) {
-			mysql_free_result(res);
-			continue;
-		}
+void MySQL::BindContentRow(ContentRow *row, MD5sumBuffer *md5sum, MYSQL_BIND *results)
+{
+	BindUint(&results[0], &row->id);
+	BindStringResult(&results[1], row->name, sizeof(row->name), &row->lengths[0]);
+	BindStringResult(&results[2], row->filename, sizeof(row->filename), &row->lengths[1]);
+	BindUint(&results[3], &row->filesize);
+	BindInt(&results[4], &row->type);
+	BindStringResult(&results[5], row->version, sizeof(row->version), &row->lengths[2]);
+	BindStringResult(&results[6], row->url, sizeof(row->url), &row->lengths[3]);
+	BindStringResult(&results[7], row->description, sizeof(row->description), &row->lengths[4]);
+	BindUint(&results[8], &row->unique_id);
+	this->BindMD5sumResult(md5sum, &results[9]);
+}
 
-		MYSQL_ROW row = mysql_fetch_row(res);
-		info[i].id = (ContentID)atoi(row[0]);
-		strecpy(info[i].filename, row[2], lastof(info[i].filename));
-		info[i].filesize = atoi(row[3]);
-		info[i].type = (ContentType)atoi(row[4]);
-
-		if (extra_data) {
-			strecpy(info[i].name, row[1], lastof(info[i].name));
-			strecpy(info[i].version, row[5], lastof(info[i].version));
-			strecpy(info[i].url, row[6], lastof(info[i].url));
-			strecpy(info[i].description, row[7], lastof(info[i].description));
-		}
+void MySQL::ContentRowFromSQL(ContentRow *row, const MD5sumBuffer *md5sum)
+{
+	TerminateString(row->name, sizeof(row->name), row->lengths[0]);
+	TerminateString(row->filename, sizeof(row->filename), row->lengths[1]);
+	TerminateString(row->version, sizeof(row->version), row->lengths[2]);
+	TerminateString(row->url, sizeof(row->url), row->lengths[3]);
+	TerminateString(row->description, sizeof(row->description), row->lengths[4]);
+	this->MD5sumFromSQL(row->md5sum, md5sum);
+}
 
-		if (extra_data && key != CK_UNIQUEID_MD5) {
-			info[i].unique_id = strtoll(row[8], NULL, 10);
-			for (uint j = 0; j < 32; j++) {
-				int k;
-				char c = row[9][j];
-				if (c <= '9') {
-					k = c - '0';
-				} else if (c <= 'F') {
-					k = c - 'A' + 10;
-				} else {
-					k = c - 'a' + 10;
-				}
-
-				if (j % 2 == 0) {
-					info[i].md5sum[j / 2] = k << 4;
-				} else {
-					info[i].md5sum[j / 2] |= k;
-				}
-			}
+bool MySQL::FillContentExtras(MySQLConnection *connection, ContentInfo *infos[], uint length)
+{
+	assert(length > 0 && length <= MYSQL_CONTENT_BATCH_SIZE);
+
+	/* Bind the IDs of all infos; the unused ones are copies of the last ID */
+	uint32 ids[MYSQL_CONTENT_BATCH_SIZE];
+	MYSQL_BIND params[MYSQL_CONTENT_BATCH_SIZE];
+	for (uint i = 0; i < MYSQL_CONTENT_BATCH_SIZE; i++) {
+		ids[i] = infos[min(i, length - 1)]->id;
+		BindUint(&params[i], &ids[i]);
+	}
+
+	ContentTag tag;
+	unsigned long tag_length;
+	MYSQL_BIND results[2];
+	BindUint(&results[0], &tag.id);
+	BindStringResult(&results[1], tag.name, sizeof(tag.name), &tag_length);
+
+	MySQLStatement &tags = connection->GetStatement(MS_CONTENT_TAGS);
+	if (!tags.Execute(params, results)) return false;
+
+	SmallVector<ContentTag, 64> all_tags;
+	while (tags.Fetch()) {
+		TerminateString(tag.name, sizeof(tag.name), tag_length);
+		*all_tags.Append() = tag;
+	}
+	tags.Finish();
+
+	ContentDependency dependency;
+	BindUint(&results[0], &dependency.id);
+	BindUint(&results[1], &dependency.dependency);
+
+	MySQLStatement &dependencies = connection->GetStatement(MS_CONTENT_DEPENDENCIES);
+	if (!dependencies.Execute(params, results)) return false;
+
+	SmallVector<ContentDependency, 64> all_dependencies;
+	while (dependencies.Fetch()) *all_dependencies.Append() = dependency;
+	dependencies.Finish();
+
+	/* Distribute the tags and dependencies over the content they belong to */
+	for (uint i = 0; i < length; i++) {
+		ContentInfo *ci = infos[i];
+
+		uint count = 0;
+		for (const ContentTag *t = all_tags.Begin(); t != all_tags.End(); t++) {
+			if (t->id == (uint32)ci->id) count++;
 		}
-		mysql_free_result(res);
-
-		if (!extra_data) continue;
-
-		/* Now get the tags */
-		seprintf(sql, lastof(sql), "SELECT tag.name FROM bananas_tag AS tag JOIN " \
-				"bananas_file_tags AS file ON tag.id = file.tag_id WHERE " \
-				"file.file_id = %u", info[i].id);
-		res = MySQLQuery(sql);
-		if (res == NULL) return false;
-
-		uint rows = min(mysql_num_rows(res), 255);
-		if (rows != 0) {
-			info[i].tag_count = rows;
-			info[i].tags = MallocT<char[32]>(rows);
-			for (uint j = 0; j < rows; j++) {
-				MYSQL_ROW row = mysql_fetch_row(res);
-				strecpy(info[i].tags[j], row[0], lastof(info[i].tags[j]));
+		count = minu(count, 255);
+		if (count != 0) {
+			ci->tag_count = count;
+			ci->tags = MallocT<char[32]>(count);
+			uint j = 0;
+			for (const ContentTag *t = all_tags.Begin(); j < count; t++) {
+				if (t->id == (uint32)ci->id) strecpy(ci->tags[j++], t->name, lastof(ci->tags[0]));
 			}
 		}
-		mysql_free_result(res);
-
-		/* And now get the dependencies */
-		seprintf(sql, lastof(sql), "SELECT to_file_id FROM bananas_file_deps " \
-				"WHERE from_file_id = %u", info[i].id);
-		res = MySQLQuery(sql);
-		if (res == NULL) return false;
-
-		rows = min(mysql_num_rows(res), 255);
-		if (rows != 0) {
-			info[i].dependency_count = rows;
-			info[i].dependencies = MallocT<ContentID>(rows);
-			for (uint j = 0; j < rows; j++) {
-				MYSQL_ROW row = mysql_fetch_row(res);
-				info[i].dependencies[j] = (ContentID)atoi(row[0]);
+
+		count = 0;
+		for (const ContentDependency *d = all_dependencies.Begin(); d != all_dependencies.End(); d++) {
+			if (d->id == (uint32)ci->id) count++;
+		}
+		count = minu(count, 255);
+		if (count != 0) {
+			ci->dependency_count = count;
+			ci->dependencies = MallocT<ContentID>(count);
+			uint j = 0;
+			for (const ContentDependency *d = all_dependencies.Begin(); j < count; d++) {
+				if (d->id == (uint32)ci->id) ci->dependencies[j++] = (ContentID)d->dependency;
 			}
 		}
-		mysql_free_result(res);
 	}
 
 	return true;
 }
 
-uint MySQL::FindContentDetails(ContentInfo info[], int length, ContentType type, uint32 version)
+bool MySQL::FillContentBatch(MySQLConnection *connection, ContentInfo info[], uint length, ContentKey key, bool extra_data)
 {
-	char sql[MAX_SQL_LEN];
+	assert(length > 0 && length <= MYSQL_CONTENT_BATCH_SIZE);
+
+	MySQLStatementID statement;
+	switch (key) {
+		case CK_ID:           statement = MS_CONTENT_BY_ID;           break;
+		case CK_UNIQUEID:     statement = MS_CONTENT_BY_UNIQUEID;     break;
+		case CK_UNIQUEID_MD5: statement = MS_CONTENT_BY_UNIQUEID_MD5; break;
+		default: return false;
+	}
 
-	seprintf(sql, lastof(sql), "SELECT id FROM bananas_file " \
-			"WHERE active = 1 AND published = 1 AND type_id = %i AND " \
-			"minimalVersion <= %i AND " \
-			"(maximalVersion = -1 OR maximalVersion >= %i)" \
-			"ORDER BY uniqueid DESC LIMIT 0,%d",
-			(int)type, version, version, length);
+	/* Bind the keys of all infos; the unused ones are copies of the last key */
+	uint32 ids[MYSQL_CONTENT_BATCH_SIZE];
+	int32 types[MYSQL_CONTENT_BATCH_SIZE];
+	MD5sumBuffer md5sums[MYSQL_CONTENT_BATCH_SIZE];
+	MYSQL_BIND params[MYSQL_CONTENT_BATCH_SIZE * 3];
+	MYSQL_BIND *param = params;
+	for (uint i = 0; i < MYSQL_CONTENT_BATCH_SIZE; i++) {
+		const ContentInfo &ci = info[min(i, length - 1)];
+		ids[i] = key == CK_ID ? (uint32)ci.id : ci.unique_id;
+		types[i] = ci.type;
+
+		BindUint(param++, &ids[i]);
+		if (key == CK_UNIQUEID_MD5) this->BindMD5sum(ci.md5sum, &md5sums[i], param++);
+		if (key != CK_ID) BindInt(param++, &types[i]);
+	}
 
-	MYSQL_RES *res = MySQLQuery(sql);
-	if (res == NULL) return 0;
+	ContentRow row;
+	MD5sumBuffer md5sum;
+	MYSQL_BIND results[10];
+	this->BindContentRow(&row, &md5sum, results);
 
-	/* The amount of advertised servers in the database */
-	uint count = mysql_num_rows(res);
+	MySQLStatement &content = connection->GetStatement(statement);
+	if (!content.Execute(params, results)) return false;
+
+	/* Join the rows with the infos that asked for them; every info gets the first row that matches */
+	ContentInfo *found[MYSQL_CONTENT_BATCH_SIZE];
+	uint count = 0;
+	bool filled[MYSQL_CONTENT_BATCH_SIZE];
+	memset(filled, 0, sizeof(filled));
+	while (content.Fetch()) {
+		this->ContentRowFromSQL(&row, &md5sum);
 
-	for (uint i = 0; i < count; i++) {
-		MYSQL_ROW row = mysql_fetch_row(res);
-		info[i].id = (ContentID)atoi(row[0]);
+		for (uint i = 0; i < length; i++) {
+			if (filled[i] || !IsRequestedContent(info[i], row, key)) continue;
+
+			filled[i] = true;
+			found[count++] = &info[i];
+			CopyContentRow(&info[i], row, extra_data);
+		}
 	}
+	content.Finish();
 
-	mysql_free_result(res);
+	/* Now get the tags and dependencies of all found content at once */
+	if (!extra_data || count == 0) return true;
+	return this->FillContentExtras(connection, found, count);
+}
+
+bool MySQL::FillContentDetails(ContentInfo info[], int length, ContentKey key, bool extra_data)
+{
+	MySQLLease connection(this->pool);
+
+	/* Look the content up in batches, instead of one by one */
+	for (int i = 0; i < length; i += MYSQL_CONTENT_BATCH_SIZE) {
+		uint count = min(length - i, (int)MYSQL_CONTENT_BATCH_SIZE);
+		if (!this->FillContentBatch(connection.GetConnection(), info + i, count, key, extra_data)) return false;
+	}
+
+	return true;
+}
+
+uint MySQL::FindContentDetails(ContentInfo info[], int length, ContentType type, uint32 version)
+{
+	int32 param_type    = type;
+	int32 param_version = version;
+	int32 param_length  = length;
+	MYSQL_BIND params[4];
+	BindInt(&params[0], &param_type);
+	BindInt(&params[1], &param_version);
+	BindInt(&params[2], &param_version);
+	BindInt(&params[3], &param_length);
+
+	uint32 id;
+	MYSQL_BIND results[1];
+	BindUint(&results[0], &id);
+
+	uint count = 0;
+	{
+		/* Release the connection, as filling the details leases one as well */
+		MySQLLease connection(this->pool);
+
+		MySQLStatement &find = connection->GetStatement(MS_FIND_CONTENT);
+		if (!find.Execute(params, results)) return 0;
+
+		while ((int)count < length && find.Fetch()) {
+			info[count++].id = (ContentID)id;
+		}
+		find.Finish();
+	}
 
 	return this->FillContentDetails(info, count, CK_ID, true) ? count : 0;
 }
 
-void MySQL::IncrementDownloadCount(ContentID id)
+bool MySQL::GetContentCatalogModified(uint64 *modified, uint64 *now)
+{
+	MySQLLease connection(this->pool);
+
+	/* There is no modification time when there is no content at all */
+	my_bool is_null;
+	MYSQL_BIND results[2];
+	BindInteger(&results[0], modified, MYSQL_TYPE_LONGLONG, true);
+	results[0].is_null = &is_null;
+	BindInteger(&results[1], now, MYSQL_TYPE_LONGLONG, true);
+
+	MySQLStatement &catalog = connection->GetStatement(MS_CATALOG_MODIFIED);
+	if (!catalog.Execute(NULL, results)) return false;
+
+	bool found = catalog.Fetch();
+	catalog.Finish();
+
+	if (found && is_null) *modified = 0;
+	return found;
+}
+
+bool MySQL::ReadContentCatalog(ContentCatalogBuilder *builder, uint64 since)
 {
-	char sql[MAX_SQL_LEN];
+	MySQLLease connection(this->pool);
+
+	MYSQL_BIND params[1];
+	BindInteger(&params[0], &since, MYSQL_TYPE_LONGLONG, true);
+
+	ContentRow row;
+	MD5sumBuffer md5sum;
+	int32 active, published, max_version;
+	uint32 min_version;
+	MYSQL_BIND results[14];
+	this->BindContentRow(&row, &md5sum, results);
+	BindInt(&results[10], &active);
+	BindInt(&results[11], &published);
+	BindUint(&results[12], &min_version);
+	BindInt(&results[13], &max_version);
+
+	MySQLStatement &catalog = connection->GetStatement(since == 0 ? MS_CATALOG_ALL : MS_CATALOG_CHANGES);
+	if (!catalog.Execute(since == 0 ? NULL : params, results)) return false;
+
+	/* The tags and dependencies are read once all content is read, in batches */
+	SmallVector<ContentInfo *, 256> added;
+	while (catalog.Fetch()) {
+		if (active == 0) {
+			builder->RemoveContent((ContentID)row.id);
+			continue;
+		}
+
+		this->ContentRowFromSQL(&row, &md5sum);
+		ContentInfo *ci = builder->AddContent((ContentID)row.id, published != 0, min_version, max_version);
+		CopyContentRow(ci, row, true);
+		*added.Append() = ci;
+	}
+	catalog.Finish();
+
+	for (uint i = 0; i < added.Length(); i += MYSQL_CONTENT_BATCH_SIZE) {
+		uint count = minu(added.Length() - i, MYSQL_CONTENT_BATCH_SIZE);
+		if (!this->FillContentExtras(connection.GetConnection(), added.Begin() + i, count)) return false;
+	}
 
-	seprintf(sql, lastof(sql), "UPDATE bananas_file SET downloads = downloads + 1 WHERE id = %u", id);
-	MYSQL_RES *res = MySQLQuery(sql);
-	if (res != NULL) mysql_free_result(res);
+	return true;
+}
+
+/**
+ * Compare content IDs for sorting them.
+ * @param a the first ID
+ * @param b the second ID
+ * @return the order of the IDs
+ */
+static int CDECL CompareContentIDs(const void *a, const void *b)
+{
+	uint32 ia = *(const uint32 *)a;
+	uint32 ib = *(const uint32 *)b;
+	return ia < ib ? -1 : (ia > ib ? 1 : 0);
+}
+
+bool MySQL::AddDownloads(const ContentIDList &downloads)
+{
+	uint length = downloads.Length();
+	if (length == 0) return true;
+
+	MySQLLease connection(this->pool);
+
+	uint32 *ids = MallocT<uint32>(length);
+	for (uint i = 0; i < length; i++) ids[i] = downloads[i];
+
+	MYSQL_BIND params[MYSQL_DOWNLOADS_BATCH_SIZE * 3];
+
+	/* Log the downloads in batches; the last one is padded with ids that are skipped */
+	uint32 none = 0;
+	for (uint i = 0; i < length; i += MYSQL_DOWNLOADS_BATCH_SIZE) {
+		for (uint j = 0; j < MYSQL_DOWNLOADS_BATCH_SIZE; j++) {
+			BindUint(&params[j], i + j < length ? &ids[i + j] : &none);
+		}
+
+		if (!connection->GetStatement(MS_ADD_DOWNLOADS).Execute(params)) {
+			free(ids);
+			return false;
+		}
+	}
+
+	/* Count the downloads of the same content together */
+	qsort(ids, length, sizeof(*ids), CompareContentIDs);
+
+	uint32 *counts = MallocT<uint32>(length);
+	uint unique = 0;
+	for (uint i = 0; i < length; i++) {
+		if (unique != 0 && ids[unique - 1] == ids[i]) {
+			counts[unique - 1]++;
+		} else {
+			ids[unique] = ids[i];
+			counts[unique] = 1;
+			unique++;
+		}
+	}
+
+	bool success = true;
+	for (uint i = 0; success && i < unique; i += MYSQL_DOWNLOADS_BATCH_SIZE) {
+		for (uint j = 0; j < MYSQL_DOWNLOADS_BATCH_SIZE; j++) {
+			uint k = min(i + j, unique - 1);
+			BindUint(&params[j * 2], &ids[k]);
+			BindUint(&params[j * 2 + 1], &counts[k]);
+			BindUint(&params[MYSQL_DOWNLOADS_BATCH_SIZE * 2 + j], &ids[k]);
+		}
+
+		success = connection->GetStatement(MS_INCREMENT_DOWNLOADS).Execute(params);
+	}
 
-	seprintf(sql, lastof(sql), "INSERT DELAYED INTO bananas_download SET file_id = %u, date = NOW()", id);
-	res = MySQLQuery(sql);
-	if (res != NULL) mysql_free_result(res);
+	free(counts);
+	free(ids);
+	return success;
 }
@@ -12,13 +12,319 @@
 
 #include "shared/sql.h"
 #include "shared/mysql_data.h"
+#include "shared/siphash.h"
+#include "shared/address_map.hpp"
+#include <mysql/mysql.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifndef MYSQL_MSU_BINARY_SCHEMA
+/** Whether the master server/updater database stores addresses and MD5 checksums in binary; see docs/mysql-binary-schema.sql */
+#define MYSQL_MSU_BINARY_SCHEMA false
+#endif
+
+#ifndef MYSQL_CONTENT_BINARY_SCHEMA
+/** Whether the content database stores MD5 checksums in binary; see docs/mysql-binary-schema.sql */
+#define MYSQL_CONTENT_BINARY_SCHEMA false
+#endif
 
 /**
  * @file mysql.h Class definition for MySQL SQL backend
  */
 
+/** The statements of the MySQL backend */
+enum MySQLStatementID {
+	MS_MAKE_ONLINE,             ///< Make a game server on-line
+	MS_MAKE_OFFLINE,            ///< Make a game server off-line
+	MS_UPDATE_GAME_INFO,        ///< Update the game info of a game server
+	MS_DELETE_SERVER_GRFS,      ///< Remove the NewGRFs of a game server
+	MS_ADD_SERVER_GRFS,         ///< Add MYSQL_SERVER_GRFS_BATCH_SIZE NewGRFs to a game server
+	MS_GET_GRFS_FINGERPRINT,    ///< Get the fingerprint of the NewGRFs of a game server
+	MS_SET_GRFS_FINGERPRINT,    ///< Set the fingerprint of the NewGRFs of a game server
+	MS_ADVERTISED,              ///< Mark a single game server as advertised
+	MS_ADVERTISED_BATCH,        ///< Mark MYSQL_ADVERTISED_BATCH_SIZE game servers as advertised
+	MS_ACTIVE_SERVERS,          ///< Get the on-line game servers
+	MS_CLAIM_REQUERY,           ///< Claim the game servers that have to be queried again, and mark them as queried
+	MS_CLAIMED_SERVERS,         ///< Get the game servers claimed by MS_CLAIM_REQUERY
+	MS_REMOVE_UNADVERTISED,     ///< Mark the game servers that stopped advertising as off-line
+	MS_RESET_REQUERY,           ///< Reset the time all game servers were queried
+	MS_ADD_GRF,                 ///< Add an unknown NewGRF
+	MS_SET_GRF_NAME,            ///< Set the name of a NewGRF
+	MS_CONTENT_BY_ID,           ///< Get MYSQL_CONTENT_BATCH_SIZE content by their IDs
+	MS_CONTENT_BY_UNIQUEID,     ///< Get MYSQL_CONTENT_BATCH_SIZE content by their unique IDs
+	MS_CONTENT_BY_UNIQUEID_MD5, ///< Get MYSQL_CONTENT_BATCH_SIZE content by their unique IDs and MD5 checksums
+	MS_CONTENT_TAGS,            ///< Get the tags of MYSQL_CONTENT_BATCH_SIZE content
+	MS_CONTENT_DEPENDENCIES,    ///< Get the dependencies of MYSQL_CONTENT_BATCH_SIZE content
+	MS_FIND_CONTENT,            ///< Get the content of a type for a version of OpenTTD
+	MS_CATALOG_MODIFIED,        ///< Get when the content catalog was last modified
+	MS_CATALOG_ALL,             ///< Get all content for the content catalog
+	MS_CATALOG_CHANGES,         ///< Get the content that was modified since a given time for the content catalog
+	MS_INCREMENT_DOWNLOADS,     ///< Increment the download counts of MYSQL_DOWNLOADS_BATCH_SIZE content
+	MS_ADD_DOWNLOADS,           ///< Log up to MYSQL_DOWNLOADS_BATCH_SIZE downloads of content
+	MS_END,                     ///< End marker
+};
+
+/** Number of game servers marked as advertised with a single MS_ADVERTISED_BATCH statement */
+static const uint MYSQL_ADVERTISED_BATCH_SIZE = 16;
+
+/** Number of NewGRFs added to a game server with a single MS_ADD_SERVER_GRFS statement */
+static const uint MYSQL_SERVER_GRFS_BATCH_SIZE = 64;
+
+/** Number of NewGRF fingerprints of game servers remembered; when reached, they are all forgotten */
+static const uint MYSQL_GRFS_FINGERPRINTS_MAX = 65536;
+
+/** Number of content looked up with a single MS_CONTENT_* statement */
+static const uint MYSQL_CONTENT_BATCH_SIZE = 128;
+
+/** Number of download counts incremented, or downloads logged, with a single statement */
+static const uint MYSQL_DOWNLOADS_BATCH_SIZE = 64;
+
+/** Timings of the connections to the database */
+enum MySQLTimings {
+	MYSQL_RECONNECT_BACKOFF_MIN =  1, ///< Time (in seconds) to wait before reconnecting after the first failed attempt
+	MYSQL_RECONNECT_BACKOFF_MAX = 64, ///< Maximum time (in seconds) to wait before reconnecting; the wait doubles after each failed attempt
+	MYSQL_PING_INTERVAL         = 60, ///< Time (in seconds) a connection may be idle before it is checked when leased again
+};
+
+class MySQLConnection;
+
+/**
+ * A statement that is prepared on its connection the first time it is
+ * executed, and prepared again when the connection had to be re-established.
+ */
+class MySQLStatement {
+private:
+	MySQLConnection *connection; ///< The connection to prepare the statement on
+	const char *query;           ///< The query of the statement
+	MYSQL_STMT *stmt;            ///< The prepared statement, or NULL when it is not prepared (anymore)
+
+	/**
+	 * Prepare the statement, if it is not prepared yet. Connects
+	 * the connection when it is not connected.
+	 * @return false if preparing failed
+	 */
+	bool Prepare();
+
+public:
+	/** Create a statement that is not associated with a connection yet */
+	MySQLStatement() : connection(NULL), query(NULL), stmt(NULL) {}
+
+	/** Close the prepared statement */
+	~MySQLStatement() { this->Close(); }
+
+	/**
+	 * Associate the statement with a connection.
+	 * @param connection the connection to prepare the statement on
+	 * @param query      the query of the statement
+	 */
+	void Init(MySQLConnection *connection, const char *query);
+
+	/** Close the prepared statement; it is prepared again on the next execution */
+	void Close();
+
+	/**
+	 * Execute the statement. When there are results they are stored, and
+	 * Finish has to be called after fetching them. When the connection
+	 * was lost, it is re-established and the statement executed once more.
+	 * @param params  the parameters of the statement, or NULL if there are none
+	 * @param results where to put the columns of fetched rows, or NULL if there are no results
+	 * @return false if executing failed
+	 */
+	bool Execute(MYSQL_BIND *params, MYSQL_BIND *results = NULL);
+
+	/**
+	 * Change where to put the columns of the next fetched row.
+	 * @param results where to put the columns
+	 */
+	void BindResult(MYSQL_BIND *results);
+
+	/**
+	 * Fetch the next row of the results into the bound results.
+	 * @return false if there are no more rows
+	 */
+	bool Fetch();
+
+	/**
+	 * Get the number of rows of the results.
+	 * @return the number of rows
+	 */
+	uint GetRowCount();
+
+	/** Free the results, so the statement can be executed again */
+	void Finish();
+};
+
+class MySQLPool;
+struct ContentRow;
+
+/**
+ * A connection to the database with its own prepared statements. When
+ * the connection is lost it is re-established, waiting longer after each
+ * failed attempt so an unavailable database is not hammered.
+ */
+class MySQLConnection {
+private:
+	friend class MySQLPool;
+
+	MySQLPool *pool;                   ///< The pool the connection belongs to
+	MYSQL *mysql;                      ///< The connection, or NULL when it is not connected
+	MySQLStatement statements[MS_END]; ///< The statements on this connection
+	time_t last_used;                  ///< When the connection was last released to the pool
+	time_t retry_at;                   ///< When to try connecting again after a failed attempt
+	uint backoff;                      ///< Time (in seconds) to wait after the next failed attempt
+	MySQLConnection *next_free;        ///< The next connection that is not leased
+
+	/**
+	 * Check whether the connection is still alive when it has been idle for
+	 * a while; when it is not, it is reconnected on its next use.
+	 * @param now the current time
+	 */
+	void CheckHealth(time_t now);
+
+public:
+	/** Create a connection that is not connected yet */
+	MySQLConnection();
+
+	/** Close the connection */
+	~MySQLConnection();
+
+	/**
+	 * Connect to the database, unless we are connected already or are
+	 * still waiting after a failed attempt.
+	 * @return false if we are not connected
+	 */
+	bool Connect();
+
+	/** Close the connection and all its prepared statements */
+	void Disconnect();
+
+	/**
+	 * Close the connection and connect again, unless we are still waiting
+	 * after a failed attempt.
+	 * @return false if we are not connected
+	 */
+	bool Reconnect();
+
+	/**
+	 * Get the connection of the MySQL library.
+	 * @return the connection, or NULL when it is not connected
+	 */
+	MYSQL *GetHandle() { return this->mysql; }
+
+	/**
+	 * Get a statement on this connection.
+	 * @param id the statement to get
+	 * @return the statement
+	 */
+	MySQLStatement &GetStatement(MySQLStatementID id) { return this->statements[id]; }
+};
+
+/**
+ * A fixed number of connections to the same database that can be leased
+ * by several backends and threads. A connection is leased by a single
+ * thread at a time; when all connections are leased, the thread waits
+ * for one to be released.
+ */
+class MySQLPool {
+private:
+	friend class MySQLConnection;
+
+	const char *host;             ///< The host the database runs on
+	const char *user;             ///< The user to log in with
+	const char *passwd;           ///< The password to log in with
+	const char *db;               ///< The database to use
+	unsigned int port;            ///< The port the database listens on
+
+	MySQLConnection *connections; ///< All connections
+	MySQLConnection *free;        ///< The connections that are not leased
+	pthread_mutex_t lock;         ///< Lock for the connections that are not leased
+	pthread_cond_t released;      ///< Condition to wait on for a connection to be released
+
+public:
+	/**
+	 * Create the pool; only the first connection is made immediately, the others are made when they are first used.
+	 * @param host   the host the database runs on
+	 * @param user   the user to log in with
+	 * @param passwd the password to log in with
+	 * @param db     the database to use
+	 * @param port   the port the database listens on
+	 * @param size   the number of connections
+	 * @note the strings are not copied, so they must stay valid as long as the pool exists
+	 */
+	MySQLPool(const char *host, const char *user, const char *passwd, const char *db, unsigned int port, uint size);
+
+	/** Close all connections; none may be leased anymore */
+	~MySQLPool();
+
+	/**
+	 * Lease a connection; waits until a connection is released when they are all leased.
+	 * @return the connection
+	 */
+	MySQLConnection *Acquire();
+
+	/**
+	 * Release a leased connection.
+	 * @param connection the connection to release
+	 */
+	void Release(MySQLConnection *connection);
+};
+
+/** A connection leased from a pool for as long as the lease exists */
+class MySQLLease {
+private:
+	MySQLPool *pool;             ///< The pool the connection is leased from
+	MySQLConnection *connection; ///< The leased connection
+
+public:
+	/**
+	 * Lease a connection from the pool.
+	 * @param pool the pool to lease from
+	 */
+	MySQLLease(MySQLPool *pool) : pool(pool), connection(pool->Acquire()) {}
+
+	/** Release the connection to the pool */
+	~MySQLLease() { this->pool->Release(this->connection); }
+
+	/**
+	 * Get the leased connection.
+	 * @return the connection
+	 */
+	MySQLConnection *operator ->() { return this->connection; }
+
+	/**
+	 * Get the leased connection.
+	 * @return the connection
+	 */
+	MySQLConnection *GetConnection() { return this->connection; }
+};
+
 /** MySQL backend */
 class MySQL : public SQL {
+private:
+	/** An IP address as parameter or result of a statement */
+	struct AddressBuffer {
+		char data[INET6_ADDRSTRLEN]; ///< The address, as text or in binary
+		unsigned long length;        ///< The length of the address
+	};
+
+	/** An MD5 checksum as parameter or result of a statement */
+	struct MD5sumBuffer {
+		char data[33];        ///< The checksum, as hexadecimal text or in binary
+		unsigned long length; ///< The length of the checksum
+	};
+
+	/** The NewGRFs of a game server as they are in the database */
+	struct GRFsFingerprint {
+		int32 server_id;    ///< The game server the NewGRFs were written for
+		uint64 fingerprint; ///< The fingerprint of the NewGRFs
+	};
+
+	MySQLPool *pool;      ///< The connections to the database
+	bool binary_schema;   ///< Whether addresses and MD5 checksums are stored in binary instead of as text
+	SipHashKey claim_key; ///< Key to derive the tokens to claim game servers to query with
+	uint64 claims;        ///< Number of times game servers were claimed to query
+	AddressMap<GRFsFingerprint> grfs_fingerprints; ///< The fingerprints of the NewGRFs of the game servers we updated
+
 protected:
 	/**
 	 * Rewrites and MD5 checksum into a hexadecimal string
@@ -27,17 +333,112 @@ protected:
 	 */
 	void MD5sumToString(const uint8 md5sum[16], char *dest);
 
-	void MakeServerOnline(const char *ip, uint16 port, bool ipv6, uint64 session_key);
-	void MakeServerOffline(const char *ip, uint16 port);
-	void UpdateNetworkGameInfo(const char *ip, uint16 port, const NetworkGameInfo *info);
+	/**
+	 * Bind an MD5 checksum as parameter; as hexadecimal string or in binary, depending on the schema.
+	 * @param md5sum the MD5 checksum
+	 * @param buffer the buffer for the value of the parameter
+	 * @param bind   the parameter to bind
+	 */
+	void BindMD5sum(const uint8 md5sum[16], MD5sumBuffer *buffer, MYSQL_BIND *bind);
+
+	/**
+	 * Bind a buffer to receive an MD5 checksum column into.
+	 * @param buffer the buffer for the value of the column
+	 * @param bind   the result to bind
+	 */
+	void BindMD5sumResult(MD5sumBuffer *buffer, MYSQL_BIND *bind);
+
+	/**
+	 * Read an MD5 checksum from a fetched column.
+	 * @param md5sum the MD5 checksum to fill
+	 * @param buffer the fetched value of the column
+	 */
+	void MD5sumFromSQL(uint8 md5sum[16], const MD5sumBuffer *buffer);
+
+	/**
+	 * Bind the IP address of a server as parameter; as string or in binary, depending on the schema.
+	 * @param server the address of the server
+	 * @param buffer the buffer for the value of the parameter
+	 * @param bind   the parameter to bind
+	 */
+	void BindAddress(const AddressKey &server, AddressBuffer *buffer, MYSQL_BIND *bind);
+
+	/**
+	 * Bind a buffer to receive an IP address column into.
+	 * @param buffer the buffer for the value of the column
+	 * @param bind   the result to bind
+	 */
+	void BindAddressResult(AddressBuffer *buffer, MYSQL_BIND *bind);
+
+	/**
+	 * Read the address of a server from a fetched column.
+	 * @param server the address to fill
+	 * @param buffer the fetched value of the IP address column
+	 * @param port   the fetched value of the port column
+	 * @return false if the value is not a valid IP address
+	 */
+	bool AddressFromSQL(AddressKey *server, AddressBuffer *buffer, uint16 port);
+
+	/**
+	 * Update the NewGRFs of a game server in the database, unless they did not change.
+	 * @param connection the connection to update them with
+	 * @param server     the address of the game server
+	 * @param server_id  the game server in the database
+	 * @param grfs       the NewGRFs of the game server
+	 */
+	void UpdateServerGRFs(MySQLConnection *connection, const AddressKey &server, int32 server_id, const GRFConfig *grfs);
+
+	/**
+	 * Bind the buffers to receive the columns of a row of content into.
+	 * @param row     the row to fill
+	 * @param md5sum  the buffer for the MD5 checksum column
+	 * @param results the 10 results to bind
+	 */
+	void BindContentRow(ContentRow *row, MD5sumBuffer *md5sum, MYSQL_BIND *results);
+
+	/**
+	 * Finish a fetched row of content, i.e. terminate its strings and read its MD5 checksum.
+	 * @param row    the fetched row
+	 * @param md5sum the fetched MD5 checksum column
+	 */
+	void ContentRowFromSQL(ContentRow *row, const MD5sumBuffer *md5sum);
+
+	/**
+	 * Fill the tags and dependencies of at most MYSQL_CONTENT_BATCH_SIZE infos.
+	 * @param connection the connection to query with
+	 * @param infos      the infos to fill, with their IDs set
+	 * @param length     the number of infos
+	 * @return true if the queries were succesfull, false otherwise.
+	 */
+	bool FillContentExtras(MySQLConnection *connection, ContentInfo *infos[], uint length);
+
+	/**
+	 * Fill the content information of at most MYSQL_CONTENT_BATCH_SIZE infos.
+	 * @param connection the connection to query with
+	 * @param info       table to store the results in (and read the keys from)
+	 * @param length     the length of the table
+	 * @param key        key to search the database with
+	 * @param extra_data whether to acquire the complex data, such as MD5 sum or dependencies
+	 * @return true if the queries were succesfull, false otherwise.
+	 */
+	bool FillContentBatch(MySQLConnection *connection, ContentInfo info[], uint length, ContentKey key, bool extra_data);
+
+	void MakeServerOnline(const AddressKey &server, uint64 session_key);
+	void MakeServerOffline(const AddressKey &server);
+	void UpdateNetworkGameInfo(const AddressKey &server, const NetworkGameInfo *info);
 public:
-	/** Creates the connection to the SQL database */
-	MySQL(const char *host, const char *user, const char *passwd, const char *db, unsigned int port);
+	/**
+	 * Creates the backend on a pool of connections to the SQL database
+	 * @param pool          the connections to lease from; it is not freed by the backend
+	 * @param binary_schema whether addresses and MD5 checksums are stored in binary
+	 */
+	MySQL(MySQLPool *pool, bool binary_schema = false);
 
-	/** Frees all connections to the SQL database */
-	~MySQL();
+	void ThreadInit();
+	void ThreadEnd();
 
-	uint GetActiveServers(NetworkAddress result[], int length, bool ipv6);
+	void UpdateLastAdvertised(const AddressKeyList &servers);
+	void GetActiveServers(AddressKeyList &result, bool ipv6);
 	uint GetRequeryServers(NetworkAddress result[], int length, uint interval);
 	void ResetRequeryIntervals();
 	void RemoveUnadvertised(uint interval);
@@ -47,15 +448,9 @@ public:
 
 	bool FillContentDetails(ContentInfo info[], int length, ContentKey key, bool extra_data);
 	uint FindContentDetails(ContentInfo info[], int length, ContentType type, uint32 version);
-	void IncrementDownloadCount(ContentID id);
-
-	/**
-	 * Adds quotes and such about the to be quoted string to prevent SQL injections
-	 * @param dest     the string to write to
-	 * @param dest_len the length of the destination string
-	 * @param to_quote the string to quote
-	 */
-	void Quote(char *dest, size_t dest_len, const char *to_quote);
+	bool GetContentCatalogModified(uint64 *modified, uint64 *now);
+	bool ReadContentCatalog(ContentCatalogBuilder *builder, uint64 since);
+	bool AddDownloads(const ContentIDList &downloads);
 };
 
 #endif /* MYSQL_H */
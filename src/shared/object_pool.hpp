@@ -0,0 +1,114 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server/updater and content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OBJECT_POOL_HPP
+#define OBJECT_POOL_HPP
+
+#include "core/alloc_func.hpp"
+#include "core/smallvec_type.hpp"
+
+/**
+ * @file object_pool.hpp Slab allocator for objects that are created and destroyed often
+ */
+
+/**
+ * Pool of equally sized objects. Memory is taken from the heap in slabs
+ * of many objects at once and freed objects are kept on a free list for
+ * reuse, so creating and destroying the objects does not fragment the
+ * heap. Slabs are only returned to the heap when the pool is destroyed.
+ * @tparam T          the type of objects to allocate memory for
+ * @tparam Tslab_size the number of objects per slab
+ */
+template <typename T, uint Tslab_size = 256>
+class ObjectPool {
+private:
+	/** Storage of a single object, or the link to the next free one */
+	union Item {
+		Item *next_free;       ///< The next free item, when this item is free
+		byte data[sizeof(T)];  ///< The memory for the object
+		uint64 align_integer;  ///< Make sure the data is aligned for integers...
+		double align_float;    ///< ... and for floating point numbers
+	};
+
+	SmallVector<Item *, 16> slabs; ///< The slabs of items allocated from the heap
+	Item *free_list;               ///< The first free item
+	uint in_use;                   ///< Number of items handed out
+
+public:
+	/** Create an empty pool */
+	ObjectPool() : free_list(NULL), in_use(0) {}
+
+	/** Return all slabs to the heap */
+	~ObjectPool()
+	{
+		for (Item **slab = this->slabs.Begin(); slab != this->slabs.End(); slab++) {
+			free(*slab);
+		}
+	}
+
+	/**
+	 * Get memory for a single object.
+	 * @param size the size of the object; must be the size of T
+	 * @return the memory for the object
+	 */
+	void *Allocate(size_t size)
+	{
+		assert(size == sizeof(T));
+
+		if (this->free_list == NULL) {
+			Item *slab = MallocT<Item>(Tslab_size);
+			if (slab == NULL) error("Out of memory while allocating a slab of %u objects", Tslab_size);
+			*this->slabs.Append() = slab;
+
+			for (uint i = 0; i < Tslab_size; i++) {
+				slab[i].next_free = (i + 1 == Tslab_size) ? NULL : &slab[i + 1];
+			}
+			this->free_list = slab;
+		}
+
+		Item *item = this->free_list;
+		this->free_list = item->next_free;
+		this->in_use++;
+		return item;
+	}
+
+	/**
+	 * Return the memory of an object to the pool.
+	 * @param ptr the memory of the object; may be NULL
+	 */
+	void Free(void *ptr)
+	{
+		if (ptr == NULL) return;
+
+		Item *item = (Item *)ptr;
+		item->next_free = this->free_list;
+		this->free_list = item;
+		this->in_use--;
+	}
+
+	/**
+	 * Get the number of objects that are currently allocated from the pool.
+	 * @return the number of objects in use
+	 */
+	uint GetItemsInUse() const { return this->in_use; }
+
+	/**
+	 * Get the number of objects the pool has memory for.
+	 * @return the number of objects in use plus the number of free ones
+	 */
+	uint GetItemsAllocated() const { return this->slabs.Length() * Tslab_size; }
+
+	/**
+	 * Get the amount of heap memory used by the pool.
+	 * @return the number of bytes
+	 */
+	size_t GetBytesAllocated() const { return this->GetItemsAllocated() * sizeof(Item); }
+};
+
+#endif /* OBJECT_POOL_HPP */
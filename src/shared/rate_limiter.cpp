@@ -0,0 +1,115 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server/updater and content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stdafx.h"
+#include "rate_limiter.h"
+#include "core/math_func.hpp"
+#include <time.h>
+
+#include "shared/safeguards.h"
+
+/**
+ * @file rate_limiter.cpp Limiting the amount of work done for a single source
+ */
+
+/** Number of bytes of an IPv4-mapped IPv6 address that make up the /24 prefix of the IPv4 address */
+static const uint IPV4_PREFIX_BYTES = 12 + 3;
+
+/** Number of bytes of an IPv6 address that make up the /48 prefix */
+static const uint IPV6_PREFIX_BYTES = 6;
+
+/**
+ * Get the current time of the monotonic clock.
+ * @return the time in milliseconds
+ */
+static uint64 GetMonotonicMilliseconds()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+RateLimiter::RateLimiter(uint capacity, uint rate, uint burst) :
+	capacity(capacity),
+	count(0),
+	head(INVALID_BUCKET),
+	tail(INVALID_BUCKET),
+	rate(rate),
+	burst(burst)
+{
+	this->buckets = MallocT<Bucket>(capacity);
+}
+
+RateLimiter::~RateLimiter()
+{
+	free(this->buckets);
+}
+
+void RateLimiter::Unlink(uint i)
+{
+	Bucket *b = &this->buckets[i];
+	if (b->prev != INVALID_BUCKET) this->buckets[b->prev].next = b->next; else this->head = b->next;
+	if (b->next != INVALID_BUCKET) this->buckets[b->next].prev = b->prev; else this->tail = b->prev;
+}
+
+void RateLimiter::LinkFront(uint i)
+{
+	Bucket *b = &this->buckets[i];
+	b->prev = INVALID_BUCKET;
+	b->next = this->head;
+	if (this->head != INVALID_BUCKET) this->buckets[this->head].prev = i; else this->tail = i;
+	this->head = i;
+}
+
+bool RateLimiter::Allow(NetworkAddress *source, uint cost)
+{
+	AddressKey prefix;
+	if (!prefix.FromAddress(source)) return false;
+
+	/* Clear everything but the prefix, so the whole network shares a bucket */
+	uint prefix_bytes = prefix.IsIPv4() ? IPV4_PREFIX_BYTES : IPV6_PREFIX_BYTES;
+	memset(prefix.ip + prefix_bytes, 0, sizeof(prefix.ip) - prefix_bytes);
+	prefix.port = 0;
+
+	uint64 now = GetMonotonicMilliseconds();
+
+	uint i;
+	uint *known = this->index.Find(prefix);
+	if (known != NULL) {
+		i = *known;
+		this->Unlink(i);
+	} else {
+		if (this->count < this->capacity) {
+			i = this->count++;
+		} else {
+			/* Forget the source prefix we have not seen for the longest time */
+			i = this->tail;
+			this->Unlink(i);
+			this->index.Erase(this->buckets[i].prefix);
+		}
+		this->index[prefix] = i;
+
+		Bucket *b = &this->buckets[i];
+		b->prefix = prefix;
+		b->last   = now;
+		b->tokens = this->burst * 1000;
+	}
+	this->LinkFront(i);
+
+	/* Refill the bucket for the time that has passed; rate tokens per second is rate thousandths per millisecond */
+	Bucket *b = &this->buckets[i];
+	uint64 tokens = b->tokens + (now - b->last) * this->rate;
+	b->tokens = (uint)min<uint64>(tokens, this->burst * 1000);
+	b->last   = now;
+
+	if (b->tokens < cost * 1000) return false;
+
+	b->tokens -= cost * 1000;
+	return true;
+}
@@ -0,0 +1,81 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server/updater and content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include "address_map.hpp"
+
+/**
+ * @file rate_limiter.h Limiting the amount of work done for a single source
+ */
+
+/**
+ * Token bucket rate limiter per source prefix, i.e. per /24 for IPv4
+ * and per /48 for IPv6, so a single network cannot use up all our
+ * resources by just changing the last bits of its address. Only a
+ * bounded number of prefixes is tracked; the least recently seen
+ * prefix is forgotten when room is needed for a new one.
+ */
+class RateLimiter {
+private:
+	/** State of a single source prefix */
+	struct Bucket {
+		AddressKey prefix; ///< The source prefix this bucket is for
+		uint64 last;       ///< The time, in milliseconds, of the last refill
+		uint tokens;       ///< The number of tokens left, in thousandths of a token
+		uint prev;         ///< The more recently used bucket, or INVALID_BUCKET
+		uint next;         ///< The less recently used bucket, or INVALID_BUCKET
+	};
+
+	static const uint INVALID_BUCKET = UINT_MAX; ///< Marker for the end of the recently used list
+
+	AddressMap<uint> index; ///< The position of a source prefix in the buckets
+	Bucket *buckets;        ///< All buckets
+	uint capacity;          ///< The maximum number of buckets
+	uint count;             ///< The number of used buckets
+	uint head;              ///< The most recently used bucket
+	uint tail;              ///< The least recently used bucket
+	uint rate;              ///< The number of tokens a source prefix gets per second
+	uint burst;             ///< The maximum number of tokens a source prefix can save up
+
+	/**
+	 * Remove a bucket from the recently used list.
+	 * @param i the bucket to remove
+	 */
+	void Unlink(uint i);
+
+	/**
+	 * Put a bucket at the front of the recently used list.
+	 * @param i the bucket to put in front
+	 */
+	void LinkFront(uint i);
+
+public:
+	/**
+	 * Create a new rate limiter.
+	 * @param capacity the number of source prefixes to keep track of
+	 * @param rate     the number of tokens a source prefix gets per second
+	 * @param burst    the maximum number of tokens a source prefix can save up
+	 */
+	RateLimiter(uint capacity, uint rate, uint burst);
+
+	/** Free the buckets */
+	~RateLimiter();
+
+	/**
+	 * Take tokens for doing something on behalf of the given source.
+	 * @param source the address the request came from
+	 * @param cost   the number of tokens the request costs
+	 * @return false if the source has not got enough tokens left, i.e. the request should be dropped
+	 */
+	bool Allow(NetworkAddress *source, uint cost);
+};
+
+#endif /* RATE_LIMITER_H */
@@ -119,6 +119,9 @@ Server::Server(SQL *sql)
 		error("Could not initialize the network");
 	}
 
+	/* Before any of the threads can hash an address */
+	AddressKey::InitHash();
+
 	assert(_server == NULL);
 	_server = this;
 }
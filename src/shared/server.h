@@ -25,7 +25,7 @@ typedef SmallVector<NetworkAddress, 4> NetworkAddressList;
 class Server {
 protected:
 	SQL *sql;                              ///< SQL backend to read/write persistent data to
-	bool stop_server;                      ///< Whether to stop or not
+	volatile bool stop_server;             ///< Whether to stop or not
 
 	/** Internal implementation of Run */
 	virtual void RealRun() = 0;
@@ -52,6 +52,12 @@ public:
 	 */
 	void Stop() { this->stop_server = true; }
 
+	/**
+	 * Whether the server has been signalled to stop.
+	 * @return true if the server is stopping
+	 */
+	bool IsStopping() const { return this->stop_server; }
+
 	/**
 	 * Returns the SQL backend we are currently using
 	 * @return the SQL backend
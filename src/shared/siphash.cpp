@@ -0,0 +1,83 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server/updater and content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stdafx.h"
+#include "siphash.h"
+#include "debug.h"
+#include <time.h>
+
+#include "shared/safeguards.h"
+
+/**
+ * @file siphash.cpp Keyed hashing of short messages
+ */
+
+/** Rotate a 64 bits integer to the left */
+#define ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+/** A single round of SipHash */
+#define SIPROUND(v0, v1, v2, v3) { \
+	v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+	v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+}
+
+void SipHashKey::Randomize()
+{
+	FILE *f = fopen("/dev/urandom", "rb");
+	if (f != NULL) {
+		bool success = fread(this, sizeof(*this), 1, f) == 1;
+		fclose(f);
+		if (success) return;
+	}
+
+	/* Not as good, but better than nothing */
+	DEBUG(misc, 0, "could not read /dev/urandom; using a predictable hash key");
+	this->k0 = ((uint64)time(NULL) << 32) ^ (uint64)(size_t)this;
+	this->k1 = ((uint64)random() << 32) ^ (uint64)random();
+}
+
+uint64 SipHash(const SipHashKey &key, const void *data, size_t len)
+{
+	uint64 v0 = key.k0 ^ 0x736f6d6570736575ULL;
+	uint64 v1 = key.k1 ^ 0x646f72616e646f6dULL;
+	uint64 v2 = key.k0 ^ 0x6c7967656e657261ULL;
+	uint64 v3 = key.k1 ^ 0x7465646279746573ULL;
+
+	const byte *in = (const byte *)data;
+	const byte *end = in + len - (len % sizeof(uint64));
+
+	for (; in != end; in += sizeof(uint64)) {
+		uint64 m = 0;
+		for (uint i = 0; i < sizeof(uint64); i++) m |= (uint64)in[i] << (8 * i);
+
+		v3 ^= m;
+		SIPROUND(v0, v1, v2, v3);
+		SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	/* The last, partial, word gets the length in its most significant byte */
+	uint64 b = (uint64)len << 56;
+	for (uint i = 0; i < len % sizeof(uint64); i++) b |= (uint64)in[i] << (8 * i);
+
+	v3 ^= b;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -0,0 +1,38 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server/updater and content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIPHASH_H
+#define SIPHASH_H
+
+/**
+ * @file siphash.h Keyed hashing of short messages
+ */
+
+/** Secret key for SipHash */
+struct SipHashKey {
+	uint64 k0; ///< First half of the key
+	uint64 k1; ///< Second half of the key
+
+	/**
+	 * Fill the key with random data from the operating system.
+	 */
+	void Randomize();
+};
+
+/**
+ * Calculate the SipHash-2-4 of a message, i.e. a MAC of the message that
+ * cannot be forged or predicted without knowing the key.
+ * @param key  the secret key
+ * @param data the message
+ * @param len  the length of the message in bytes
+ * @return the MAC
+ */
+uint64 SipHash(const SipHashKey &key, const void *data, size_t len);
+
+#endif /* SIPHASH_H */
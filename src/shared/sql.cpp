@@ -19,19 +19,15 @@
 
 void SQL::MakeServerOnline(QueriedServer *server)
 {
-	NetworkAddress *address = server->GetServerAddress();
-	this->MakeServerOnline(address->GetHostname(), address->GetPort(),
-			address->GetAddress()->ss_family == AF_INET6, server->GetSessionKey());
+	this->MakeServerOnline(server->GetServerKey(), server->GetSessionKey());
 }
 
 void SQL::MakeServerOffline(QueriedServer *server)
 {
-	NetworkAddress *address = server->GetServerAddress();
-	this->MakeServerOffline(address->GetHostname(), address->GetPort());
+	this->MakeServerOffline(server->GetServerKey());
 }
 
 void SQL::UpdateNetworkGameInfo(QueriedServer *server, NetworkGameInfo *info)
 {
-	NetworkAddress *address = server->GetServerAddress();
-	this->UpdateNetworkGameInfo(address->GetHostname(), address->GetPort(), info);
+	this->UpdateNetworkGameInfo(server->GetServerKey(), info);
 }
@@ -11,6 +11,7 @@
 #define SQL_H
 
 #include "shared/network/core/address.h"
+#include "shared/address_key.h"
 #include "shared/network/core/game.h"
 #include "shared/network/core/tcp_content.h"
 
@@ -21,21 +22,92 @@
 /* Forward declare the QueriedServer, as we use it here and server.h uses SQL */
 class QueriedServer;
 
+/** List of downloaded content; content that is downloaded several times is listed several times */
+typedef SmallVector<ContentID, 64> ContentIDList;
+
+/**
+ * Receiver of the content read from the database, for keeping a copy of
+ * the content catalog in memory.
+ */
+class ContentCatalogBuilder {
+public:
+	/** The obvious destructor */
+	virtual ~ContentCatalogBuilder() {}
+
+	/**
+	 * Add active content to the catalog, or replace the content with the same ID.
+	 * @param id          the ID of the content
+	 * @param published   whether the content is listed for its type
+	 * @param min_version the minimum version of OpenTTD the content is listed for
+	 * @param max_version the maximum version of OpenTTD the content is listed for, or -1 if there is none
+	 * @return the content info for the caller to fill
+	 */
+	virtual ContentInfo *AddContent(ContentID id, bool published, uint32 min_version, int32 max_version) = 0;
+
+	/**
+	 * Remove content that is not active anymore from the catalog.
+	 * @param id the ID of the content
+	 */
+	virtual void RemoveContent(ContentID id) = 0;
+};
+
 /**
  * Abstract 'interface' for all SQL clients
  */
 class SQL {
+	/* Performs the protected writes on behalf of the main thread */
+	friend class ThreadedSQL;
+
 protected:
-	/** Same as public MakeServerOnline but ip, port instead of QueriedServer */
-	virtual void MakeServerOnline(const char *ip, uint16 port, bool ipv6, uint64 session_key) = 0;
-	/** Same as public MakeServerOffline but ip, port instead of QueriedServer */
-	virtual void MakeServerOffline(const char *ip, uint16 port) = 0;
-	/** Same as public UpdateNetworkGameInfo but ip, port instead of QueriedServer */
-	virtual void UpdateNetworkGameInfo(const char *ip, uint16 port, const NetworkGameInfo *info) = 0;
+	/** Same as public MakeServerOnline but address, session key instead of QueriedServer */
+	virtual void MakeServerOnline(const AddressKey &server, uint64 session_key) = 0;
+	/** Same as public MakeServerOffline but address instead of QueriedServer */
+	virtual void MakeServerOffline(const AddressKey &server) = 0;
+	/** Same as public UpdateNetworkGameInfo but address instead of QueriedServer */
+	virtual void UpdateNetworkGameInfo(const AddressKey &server, const NetworkGameInfo *info) = 0;
 public:
 	/** The obvious destructor */
 	virtual ~SQL() {}
 
+	/** Prepare the calling thread, other than the one that made us, for using this connection */
+	virtual void ThreadInit() {}
+
+	/** Clean up after the calling thread, which called ThreadInit, is done with this connection */
+	virtual void ThreadEnd() {}
+
+	/**
+	 * Get the number of writes that have been requested, but not performed yet.
+	 * @return the number of pending writes
+	 */
+	virtual uint GetWriteBacklog() const { return 0; }
+
+	/**
+	 * Get the number of writes that were dropped because too many writes were pending.
+	 * @return the number of dropped writes
+	 */
+	virtual uint GetDroppedWrites() const { return 0; }
+
+	/**
+	 * Start reading the active servers of both address families, after the
+	 * writes requested so far have been performed. Only one request can be
+	 * outstanding; TakeActiveServers gets its result.
+	 */
+	virtual void RequestActiveServers() {}
+
+	/**
+	 * Take the active servers read since RequestActiveServers. Backends
+	 * without a thread of their own read them right now.
+	 * @param ipv4 list to append the active IPv4 servers to
+	 * @param ipv6 list to append the active IPv6 servers to
+	 * @return false if they have not been read yet
+	 */
+	virtual bool TakeActiveServers(AddressKeyList &ipv4, AddressKeyList &ipv6)
+	{
+		this->GetActiveServers(ipv4, false);
+		this->GetActiveServers(ipv6, true);
+		return true;
+	}
+
 	/**
 	 * Updates the necessary data structures to tell a server has come online
 	 * @param qs the queried server to make online
@@ -72,13 +144,18 @@ public:
 	virtual void SetGRFName(const GRFIdentifier *grf, const char *name) = 0;
 
 	/**
-	 * Fills result with up-to length active servers.
-	 * @param result table to place the active servers into
-	 * @param length the length of the result table
+	 * Marks the given servers as advertised just now, without any of the
+	 * other work of making them on-line.
+	 * @param servers the servers that have re-advertised themselves
+	 */
+	virtual void UpdateLastAdvertised(const AddressKeyList &servers) = 0;
+
+	/**
+	 * Fills result with all active servers.
+	 * @param result list to append the active servers to
 	 * @param ipv6 whether to get IPv6 or IPv4 addresses
-	 * @return the number of active servers added to the list
 	 */
-	virtual uint GetActiveServers(NetworkAddress result[], int length, bool ipv6) = 0;
+	virtual void GetActiveServers(AddressKeyList &result, bool ipv6) = 0;
 
 	/**
 	 * Fills result with up-to length to be requeried servers servers.
@@ -131,10 +208,27 @@ public:
 	virtual uint FindContentDetails(ContentInfo info[], int length, ContentType type, uint32 version) = 0;
 
 	/**
-	 * Increment the download count of the given content.
-	 * @param id the ID of the content.
+	 * Get when the content catalog was last modified.
+	 * @param modified where to store when the catalog was modified, in seconds since the epoch
+	 * @param now      where to store the current time of the database, in seconds since the epoch
+	 * @return true if the query was succesfull, false otherwise.
+	 */
+	virtual bool GetContentCatalogModified(uint64 *modified, uint64 *now) = 0;
+
+	/**
+	 * Read the content that was modified since the given time.
+	 * @param builder the catalog to add the content to, and remove inactive content from
+	 * @param since   the time of the database since when the content was modified, or 0 for all content
+	 * @return true if the query was succesfull, false otherwise.
+	 */
+	virtual bool ReadContentCatalog(ContentCatalogBuilder *builder, uint64 since) = 0;
+
+	/**
+	 * Increment the download counts of content, and log the downloads.
+	 * @param downloads the downloaded content, once for every download.
+	 * @return false if a query failed, i.e. the downloads have to be added again.
 	 */
-	virtual void IncrementDownloadCount(ContentID id) = 0;
+	virtual bool AddDownloads(const ContentIDList &downloads) = 0;
 };
 
 #endif /* SQL_H */
@@ -0,0 +1,221 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server/updater and content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stdafx.h"
+#include "debug.h"
+#include "threaded_sql.h"
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "shared/safeguards.h"
+
+/**
+ * @file threaded_sql.cpp Performing the server state changes in a separate thread
+ */
+
+ThreadedSQL::ThreadedSQL(SQL *reader, SQL *writer, uint max_backlog) :
+	reader(reader),
+	writer(writer),
+	max_backlog(max_backlog),
+	queue(NULL),
+	backlog(0),
+	dropped(0),
+	has_active(false),
+	running(false),
+	stopping(false)
+{
+	this->event = eventfd(0, EFD_NONBLOCK);
+	if (this->event < 0) error("Could not create event for the SQL writer");
+}
+
+ThreadedSQL::~ThreadedSQL()
+{
+	if (this->running) {
+		this->stopping = true;
+
+		uint64 one = 1;
+		if (write(this->event, &one, sizeof(one)) < 0) DEBUG(sql, 0, "Could not wake up the SQL writer");
+		pthread_join(this->thread, NULL);
+	}
+	close(this->event);
+
+	delete this->writer;
+	delete this->reader;
+}
+
+void ThreadedSQL::Enqueue(Write *write)
+{
+	/* Threads do not survive forking, so start it only when it is needed */
+	if (!this->running) {
+		this->running = pthread_create(&this->thread, NULL, &ThreadedSQL::ThreadProc, this) == 0;
+		if (!this->running) error("Could not start SQL writer thread");
+	}
+
+	/* Never wait for the writer; when it cannot keep up, e.g. because the database is gone, the next reconcile repairs the state */
+	if (this->backlog >= this->max_backlog && write->type != WT_ACTIVE) {
+		this->dropped++;
+		DEBUG(sql, 3, "Write queue full; dropping the write");
+		delete write;
+		return;
+	}
+
+	__sync_add_and_fetch(&this->backlog, 1);
+
+	Write *head;
+	do {
+		head = this->queue;
+		write->next = head;
+	} while (!__sync_bool_compare_and_swap(&this->queue, head, write));
+
+	uint64 one = 1;
+	if (::write(this->event, &one, sizeof(one)) < 0) DEBUG(sql, 0, "Could not wake up the SQL writer");
+}
+
+void ThreadedSQL::MakeServerOnline(const AddressKey &server, uint64 session_key)
+{
+	Write *write = new Write();
+	write->type        = WT_ONLINE;
+	write->server      = server;
+	write->session_key = session_key;
+	this->Enqueue(write);
+}
+
+void ThreadedSQL::MakeServerOffline(const AddressKey &server)
+{
+	Write *write = new Write();
+	write->type   = WT_OFFLINE;
+	write->server = server;
+	this->Enqueue(write);
+}
+
+void ThreadedSQL::UpdateLastAdvertised(const AddressKeyList &servers)
+{
+	for (const AddressKey *key = servers.Begin(); key != servers.End(); key++) {
+		Write *write = new Write();
+		write->type   = WT_ADVERTISED;
+		write->server = *key;
+		this->Enqueue(write);
+	}
+}
+
+void ThreadedSQL::RequestActiveServers()
+{
+	Write *write = new Write();
+	write->type = WT_ACTIVE;
+	this->Enqueue(write);
+}
+
+bool ThreadedSQL::TakeActiveServers(AddressKeyList &ipv4, AddressKeyList &ipv6)
+{
+	if (!this->has_active) return false;
+	__sync_synchronize();
+
+	AddressKeyList *result[2] = { &ipv4, &ipv6 };
+	for (uint i = 0; i < 2; i++) {
+		for (const AddressKey *key = this->active[i].Begin(); key != this->active[i].End(); key++) {
+			*result[i]->Append() = *key;
+		}
+		this->active[i].Clear();
+	}
+
+	/* Only now the writer may read them again */
+	__sync_synchronize();
+	this->has_active = false;
+	return true;
+}
+
+void ThreadedSQL::UpdateNetworkGameInfo(const AddressKey &server, const NetworkGameInfo *info)
+{
+	this->reader->UpdateNetworkGameInfo(server, info);
+}
+
+void ThreadedSQL::Perform(Write *write)
+{
+	AddressKeyList advertised;
+
+	while (write != NULL) {
+		switch (write->type) {
+			case WT_ONLINE:
+				this->writer->MakeServerOnline(write->server, write->session_key);
+				break;
+
+			case WT_OFFLINE:
+				this->writer->MakeServerOffline(write->server);
+				break;
+
+			case WT_ADVERTISED:
+				*advertised.Append() = write->server;
+				break;
+
+			case WT_ACTIVE:
+				this->writer->GetActiveServers(this->active[0], false);
+				this->writer->GetActiveServers(this->active[1], true);
+
+				/* Hand them to the main thread only once they are complete */
+				__sync_synchronize();
+				this->has_active = true;
+				break;
+		}
+
+		Write *next = write->next;
+		delete write;
+		write = next;
+
+		/* Update the re-advertised servers in one go, unless another write has to come in between */
+		if (advertised.Length() != 0 && (write == NULL || write->type != WT_ADVERTISED)) {
+			this->writer->UpdateLastAdvertised(advertised);
+			__sync_sub_and_fetch(&this->backlog, advertised.Length());
+			advertised.Clear();
+		} else if (advertised.Length() == 0) {
+			__sync_sub_and_fetch(&this->backlog, 1);
+		}
+	}
+}
+
+/* static */ void *ThreadedSQL::ThreadProc(void *threaded_sql)
+{
+	((ThreadedSQL *)threaded_sql)->Run();
+	return NULL;
+}
+
+void ThreadedSQL::Run()
+{
+	this->writer->ThreadInit();
+
+	struct pollfd fd;
+	fd.fd     = this->event;
+	fd.events = POLLIN;
+
+	for (;;) {
+		bool stopping = this->stopping;
+
+		/* Take everything that has been queued, and put it in the order it was queued */
+		Write *write = __sync_lock_test_and_set(&this->queue, (Write *)NULL);
+		Write *ordered = NULL;
+		while (write != NULL) {
+			Write *next = write->next;
+			write->next = ordered;
+			ordered = write;
+			write = next;
+		}
+		this->Perform(ordered);
+
+		/* Everything queued before we were told to stop has been performed */
+		if (stopping) break;
+
+		/* Wake up every second, just in case */
+		fd.revents = 0;
+		if (poll(&fd, 1, 1000) <= 0) continue;
+
+		uint64 events;
+		if (read(this->event, &events, sizeof(events)) < 0) DEBUG(sql, 0, "Could not read the SQL writer event");
+	}
+
+	this->writer->ThreadEnd();
+}
@@ -0,0 +1,129 @@
+/* $Id$ */
+
+/*
+ * This file is part of OpenTTD's master server/updater and content service.
+ * OpenTTD is free software; you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, version 2.
+ * OpenTTD is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details. You should have received a copy of the GNU General Public License along with OpenTTD. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef THREADED_SQL_H
+#define THREADED_SQL_H
+
+#include "sql.h"
+#include <pthread.h>
+
+/**
+ * @file threaded_sql.h SQL backend that performs the server state changes in a separate thread
+ */
+
+/**
+ * SQL 'backend' that hands the on-line/off-line state changes of game
+ * servers to a thread with its own connection, so a slow query does not
+ * stall the thread handling the packets. Everything else is passed
+ * directly to the connection of the calling thread.
+ *
+ * The writes are put on a lock-free queue: producers push onto a linked
+ * stack, and the writer takes the whole stack at once and reverses it to
+ * perform the writes in the order they were requested.
+ *
+ * The active servers are read by the writer too, in between the writes,
+ * so they include everything that was requested before them.
+ */
+class ThreadedSQL : public SQL {
+private:
+	/** The kinds of writes that are performed by the writer thread */
+	enum WriteType {
+		WT_ONLINE,     ///< MakeServerOnline
+		WT_OFFLINE,    ///< MakeServerOffline
+		WT_ADVERTISED, ///< UpdateLastAdvertised of a single server
+		WT_ACTIVE,     ///< RequestActiveServers; a read, but it has to see the writes queued before it
+	};
+
+	/** A write that has to be performed */
+	struct Write {
+		Write *next;        ///< The write that was queued before this one, or after this one once taken by the writer
+		WriteType type;     ///< The kind of write
+		AddressKey server;  ///< The address of the server
+		uint64 session_key; ///< The session key of the server, for WT_ONLINE
+	};
+
+	SQL *reader;              ///< The connection for the calling thread
+	SQL *writer;              ///< The connection for the writer thread
+	uint max_backlog;         ///< The maximum number of queued writes; more writes are dropped
+
+	Write *volatile queue;    ///< The most recently queued write
+	volatile uint backlog;    ///< Number of queued writes that have not been performed yet
+	uint dropped;             ///< Number of writes dropped because the queue was full
+	int event;                ///< Event to wake up the writer for new writes
+
+	AddressKeyList active[2]; ///< The active IPv4 and IPv6 servers read by the writer
+	volatile bool has_active; ///< Whether the writer has read the active servers; until then only the writer touches them
+
+	pthread_t thread;         ///< The thread the writer is running in
+	bool running;             ///< Whether the thread has been started
+	volatile bool stopping;   ///< Whether the writer has to stop
+
+	/**
+	 * Queue a write for the writer thread; drop it when the queue is full,
+	 * as the caller may not wait for the writer. The writer thread is
+	 * started on the first write.
+	 * @param write the write to queue; it is freed by the writer, or here when dropped
+	 */
+	void Enqueue(Write *write);
+
+	/**
+	 * Perform the given writes, in order, on the connection of the writer.
+	 * @param write the first write to perform; all writes are freed
+	 */
+	void Perform(Write *write);
+
+	/**
+	 * Entry point of the thread.
+	 * @param threaded_sql the instance to run the writer of
+	 * @return nothing
+	 */
+	static void *ThreadProc(void *threaded_sql);
+
+	/** Perform the queued writes until we have to stop */
+	void Run();
+
+protected:
+	void MakeServerOnline(const AddressKey &server, uint64 session_key);
+	void MakeServerOffline(const AddressKey &server);
+	void UpdateNetworkGameInfo(const AddressKey &server, const NetworkGameInfo *info);
+
+public:
+	/**
+	 * Create the threaded backend; the writer thread is started on the first write.
+	 * @param reader      the connection to use for the calling thread
+	 * @param writer      the connection to use for the writer thread
+	 * @param max_backlog the maximum number of queued writes
+	 */
+	ThreadedSQL(SQL *reader, SQL *writer, uint max_backlog);
+
+	/** Perform the pending writes, stop the writer and close both connections */
+	~ThreadedSQL();
+
+	uint GetWriteBacklog() const { return this->backlog; }
+	uint GetDroppedWrites() const { return this->dropped; }
+	void RequestActiveServers();
+	bool TakeActiveServers(AddressKeyList &ipv4, AddressKeyList &ipv6);
+
+	void UpdateLastAdvertised(const AddressKeyList &servers);
+	void GetActiveServers(AddressKeyList &result, bool ipv6) { this->reader->GetActiveServers(result, ipv6); }
+	uint GetRequeryServers(NetworkAddress result[], int length, uint interval) { return this->reader->GetRequeryServers(result, length, interval); }
+	void ResetRequeryIntervals() { this->reader->ResetRequeryIntervals(); }
+	void RemoveUnadvertised(uint interval) { this->reader->RemoveUnadvertised(interval); }
+
+	void AddGRF(const GRFIdentifier *grf) { this->reader->AddGRF(grf); }
+	void SetGRFName(const GRFIdentifier *grf, const char *name) { this->reader->SetGRFName(grf, name); }
+
+	bool FillContentDetails(ContentInfo info[], int length, ContentKey key, bool extra_data) { return this->reader->FillContentDetails(info, length, key, extra_data); }
+	uint FindContentDetails(ContentInfo info[], int length, ContentType type, uint32 version) { return this->reader->FindContentDetails(info, length, type, version); }
+	bool GetContentCatalogModified(uint64 *modified, uint64 *now) { return this->reader->GetContentCatalogModified(modified, now); }
+	bool ReadContentCatalog(ContentCatalogBuilder *builder, uint64 since) { return this->reader->ReadContentCatalog(builder, since); }
+	bool AddDownloads(const ContentIDList &downloads) { return this->reader->AddDownloads(downloads); }
+};
+
+#endif /* THREADED_SQL_H */
@@ -10,6 +10,15 @@
 #include "stdafx.h"
 #include "udp_server.h"
 #include "debug.h"
+#include "core/math_func.hpp"
+
+#if defined(__linux__)
+#include <netinet/udp.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#endif
 
 #include "shared/safeguards.h"
 
@@ -17,8 +26,277 @@
  * @file udp_server.cpp Shared UDP server (master server/updater) related functionality
  */
 
+/** Maximum number of datagrams handed to the kernel in one system call */
+static const uint UDP_BATCH_SIZE = 64;
+
+/** Maximum number of bytes in one batch; UDP generic segmentation offload does not like more than 64 KiB */
+static const uint UDP_BATCH_BYTES = 60000;
+
+/** Maximum number of batches to receive per socket in one go, so one socket cannot starve the others */
+static const uint UDP_RECEIVE_MAX_BATCHES = 32;
+
+ServerNetworkUDPSocketHandler::ServerNetworkUDPSocketHandler(NetworkAddressList *addresses) :
+	NetworkUDPSocketHandler(addresses),
+	use_sendmmsg(true),
+	use_gso(true),
+	use_recvmmsg(true),
+	full_batches(0)
+{
+	for (uint i = 0; i < RECEIVE_BATCH_SIZE; i++) {
+		this->receive_packets[i] = new Packet(this);
+	}
+}
+
+ServerNetworkUDPSocketHandler::~ServerNetworkUDPSocketHandler()
+{
+	for (uint i = 0; i < RECEIVE_BATCH_SIZE; i++) {
+		delete this->receive_packets[i];
+	}
+}
+
+bool ServerNetworkUDPSocketHandler::Listen(bool reuse_port)
+{
+	if (!reuse_port) return NetworkUDPSocketHandler::Listen();
+
+#if defined(SO_REUSEPORT)
+	this->Close();
+
+	for (NetworkAddress *addr = this->bind.Begin(); addr != this->bind.End(); addr++) {
+		const sockaddr_storage *address = addr->GetAddress();
+
+		SOCKET s = socket(address->ss_family, SOCK_DGRAM, IPPROTO_UDP);
+		if (s == INVALID_SOCKET) {
+			DEBUG(net, 0, "[udp] could not create socket on %s: %s", addr->GetAddressAsString(), strerror(errno));
+			continue;
+		}
+
+		int on = 1;
+		if ((address->ss_family == AF_INET6 && setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (const char *)&on, sizeof(on)) != 0) ||
+				setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (const char *)&on, sizeof(on)) != 0 ||
+				::bind(s, (const sockaddr *)address, addr->GetAddressLength()) != 0 ||
+				!SetNonBlocking(s)) {
+			DEBUG(net, 0, "[udp] could not bind shared socket on %s: %s", addr->GetAddressAsString(), strerror(errno));
+			closesocket(s);
+			continue;
+		}
+
+		this->sockets.Insert(*addr, s);
+		DEBUG(net, 1, "[udp] listening on %s (shared)", addr->GetAddressAsString());
+	}
+
+	return this->sockets.Length() != 0;
+#else
+	DEBUG(net, 0, "[udp] sharing a port between sockets is not supported");
+	return false;
+#endif /* SO_REUSEPORT */
+}
+
+void ServerNetworkUDPSocketHandler::ReceivePackets()
+{
+	if (this->ReceivePacketsBatched()) return;
+
+	NetworkUDPSocketHandler::ReceivePackets();
+}
+
+bool ServerNetworkUDPSocketHandler::ReceivePacketsBatched()
+{
+#if defined(__linux__)
+	if (!this->use_recvmmsg) return false;
+
+	for (SocketList::iterator s = this->sockets.Begin(); s != this->sockets.End(); s++) {
+		for (uint batch = 0; batch < UDP_RECEIVE_MAX_BATCHES; batch++) {
+			struct sockaddr_storage client_addr[RECEIVE_BATCH_SIZE];
+			struct iovec iov[RECEIVE_BATCH_SIZE];
+			struct mmsghdr msgs[RECEIVE_BATCH_SIZE];
+			memset(msgs, 0, sizeof(msgs));
+
+			for (uint i = 0; i < RECEIVE_BATCH_SIZE; i++) {
+				iov[i].iov_base = this->receive_packets[i]->buffer;
+				iov[i].iov_len  = SEND_MTU;
+
+				msgs[i].msg_hdr.msg_name    = &client_addr[i];
+				msgs[i].msg_hdr.msg_namelen = sizeof(client_addr[i]);
+				msgs[i].msg_hdr.msg_iov     = &iov[i];
+				msgs[i].msg_hdr.msg_iovlen  = 1;
+			}
+
+			int received = recvmmsg(s->second, msgs, RECEIVE_BATCH_SIZE, MSG_DONTWAIT, NULL);
+			if (received < 0) {
+				if (errno == ENOSYS) {
+					DEBUG(net, 1, "[udp] disabling batched receiving; recvmmsg is not supported");
+					this->use_recvmmsg = false;
+					return false;
+				}
+				/* No data, i.e. no packet */
+				this->full_batches = 0;
+				break;
+			}
+
+			/* Determine the backlog before handling the batch, so the handlers can shed load */
+			if (received == (int)RECEIVE_BATCH_SIZE) {
+				this->full_batches++;
+			} else {
+				this->full_batches = 0;
+			}
+
+			for (int i = 0; i < received; i++) {
+				/* Did we get the bytes for the base header of the packet? */
+				if (msgs[i].msg_len <= sizeof(PacketSize)) continue;
+
+				Packet *p = this->receive_packets[i];
+				NetworkAddress address(client_addr[i], msgs[i].msg_hdr.msg_namelen);
+				p->PrepareToRead();
+
+				/* This runs in the worker threads too, so do not use the static buffer of GetAddressAsString */
+				char client[NETWORK_HOSTNAME_LENGTH + 16];
+
+				/* If the size does not match the packet must be corrupted.
+				 * Otherwise it will be marked as corrupted later on. */
+				if (msgs[i].msg_len != p->size) {
+					address.GetAddressAsString(client, lastof(client));
+					DEBUG(net, 1, "received a packet with mismatching size from %s", client);
+					continue;
+				}
+
+				/* HandleUDPPacket logs unknown packet types with that static buffer, so do it here instead */
+				uint8 type = p->buffer[sizeof(PacketSize)];
+				if (type >= PACKET_UDP_END) {
+					address.GetAddressAsString(client, lastof(client));
+					DEBUG(net, 0, "[udp] received invalid packet type %d from %s", type, client);
+					continue;
+				}
+
+				/* Handle the packet */
+				this->HandleUDPPacket(p, &address);
+			}
+
+			/* The socket has been drained */
+			if (received < (int)RECEIVE_BATCH_SIZE) break;
+		}
+	}
+
+	return true;
+#else
+	return false;
+#endif /* __linux__ */
+}
+
+void ServerNetworkUDPSocketHandler::SendPacketList(const Packet * const *packets, uint count, NetworkAddress *recv)
+{
+	/* Find the socket to send on, just like SendPacket does */
+	NetworkAddress send(*recv);
+	SOCKET sock = INVALID_SOCKET;
+	for (SocketList::iterator s = this->sockets.Begin(); s != this->sockets.End(); s++) {
+		if (send.IsFamily(s->first.GetAddress()->ss_family)) {
+			sock = s->second;
+			break;
+		}
+	}
+	if (sock == INVALID_SOCKET) return;
+
+	uint i = this->SendPacketListBatched(sock, packets, count, &send);
+
+	/* Whatever could not be sent in a batch is sent one by one */
+	for (; i < count; i++) {
+		const Packet *p = packets[i];
+		if (sendto(sock, (const char *)p->buffer, p->size, 0, (const sockaddr *)send.GetAddress(), send.GetAddressLength()) < 0) {
+			DEBUG(net, 1, "[udp] sendto failed with: %i", errno);
+			return;
+		}
+	}
+}
+
+uint ServerNetworkUDPSocketHandler::SendPacketListBatched(SOCKET sock, const Packet * const *packets, uint num_packets, NetworkAddress *send)
+{
+	uint first = 0;
+
+#if defined(__linux__)
+	if (!this->use_sendmmsg && !this->use_gso) return first;
+
+	while (first < num_packets) {
+		struct iovec iov[UDP_BATCH_SIZE];
+		uint count = 0;
+		uint bytes = 0;
+
+		/* Gather the next batch of packets */
+		for (; first + count < num_packets && count < UDP_BATCH_SIZE && bytes + packets[first + count]->size <= UDP_BATCH_BYTES; count++) {
+			const Packet *p = packets[first + count];
+			iov[count].iov_base = p->buffer;
+			iov[count].iov_len  = p->size;
+			bytes += p->size;
+		}
+
+#if defined(UDP_SEGMENT)
+		/* With segmentation offload all datagrams, except the last, need to be equally sized */
+		bool equal_sizes = count > 1;
+		for (uint i = 1; equal_sizes && i < count; i++) {
+			equal_sizes = iov[i].iov_len == iov[0].iov_len || (i == count - 1 && iov[i].iov_len < iov[0].iov_len);
+		}
+
+		if (this->use_gso && equal_sizes) {
+			char control[CMSG_SPACE(sizeof(uint16))];
+			memset(control, 0, sizeof(control));
+
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_name       = (void *)send->GetAddress();
+			msg.msg_namelen    = send->GetAddressLength();
+			msg.msg_iov        = iov;
+			msg.msg_iovlen     = count;
+			msg.msg_control    = control;
+			msg.msg_controllen = sizeof(control);
+
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type  = UDP_SEGMENT;
+			cmsg->cmsg_len   = CMSG_LEN(sizeof(uint16));
+			uint16 segment_size = iov[0].iov_len;
+			memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+
+			if (sendmsg(sock, &msg, 0) >= 0) {
+				first += count;
+				continue;
+			}
+
+			/* The socket is just full; let the fallback deal with it */
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return first;
+
+			DEBUG(net, 1, "[udp] disabling segmentation offload; sendmsg failed with: %i", errno);
+			this->use_gso = false;
+		}
+#endif /* UDP_SEGMENT */
+
+		if (!this->use_sendmmsg) return first;
+
+		struct mmsghdr msgs[UDP_BATCH_SIZE];
+		memset(msgs, 0, sizeof(msgs[0]) * count);
+		for (uint i = 0; i < count; i++) {
+			msgs[i].msg_hdr.msg_name    = (void *)send->GetAddress();
+			msgs[i].msg_hdr.msg_namelen = send->GetAddressLength();
+			msgs[i].msg_hdr.msg_iov     = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen  = 1;
+		}
+
+		int sent = sendmmsg(sock, msgs, count, 0);
+		if (sent <= 0) {
+			if (sent < 0 && errno == ENOSYS) {
+				DEBUG(net, 1, "[udp] disabling batched sending; sendmmsg is not supported");
+				this->use_sendmmsg = false;
+			}
+			return first;
+		}
+
+		/* Skip the packets that have been sent; the rest is for the next batch */
+		first += sent;
+	}
+#endif /* __linux__ */
+
+	return first;
+}
+
 UDPServer::UDPServer(SQL *sql) : Server(sql), query_socket(NULL), frame(0)
 {
+	memset(this->timer_wheel, 0, sizeof(this->timer_wheel));
 }
 
 UDPServer::~UDPServer()
@@ -32,19 +310,169 @@ void UDPServer::ReceivePackets()
 	this->query_socket->ReceivePackets();
 }
 
+void UDPServer::ScheduleAttempt(QueriedServer *qs, uint frame)
+{
+	/* Attempts in the past (or now) are done at the next frame */
+	qs->timer_frame = max(frame, this->frame + 1);
+
+	QueriedServer **slot = &this->timer_wheel[qs->timer_frame % TIMER_WHEEL_SIZE];
+	qs->timer_next = *slot;
+	if (qs->timer_next != NULL) qs->timer_next->timer_pprev = &qs->timer_next;
+	qs->timer_pprev = slot;
+	*slot = qs;
+}
+
+/* static */ void UDPServer::UnscheduleAttempt(QueriedServer *qs)
+{
+	if (qs->timer_pprev == NULL) return;
+
+	*qs->timer_pprev = qs->timer_next;
+	if (qs->timer_next != NULL) qs->timer_next->timer_pprev = qs->timer_pprev;
+	qs->timer_next  = NULL;
+	qs->timer_pprev = NULL;
+}
+
 void UDPServer::CheckServers()
 {
-	QueriedServerMap::iterator iter = this->queried_servers.begin();
+	/* Take all queried servers from the slot of this frame, so
+	 * rescheduling them cannot make us visit them again */
+	QueriedServer **slot = &this->timer_wheel[this->frame % TIMER_WHEEL_SIZE];
+	QueriedServer *pending = *slot;
+	*slot = NULL;
+	if (pending != NULL) pending->timer_pprev = &pending;
+
+	while (pending != NULL) {
+		QueriedServer *qs = pending;
+		UnscheduleAttempt(qs);
+
+		/* Not due yet; it is one or more rounds of the wheel away */
+		if (qs->timer_frame > this->frame) {
+			this->ScheduleAttempt(qs, qs->timer_frame);
+			continue;
+		}
+
+		if (qs->DoAttempt(this)) {
+			this->ScheduleAttempt(qs, qs->frame + qs->GetAttemptInterval());
+		} else {
+			delete this->RemoveQueriedServer(qs);
+		}
+	}
+}
+
+void UDPServer::GetSocketHandlers(SocketHandlerList &handlers)
+{
+	*handlers.Append() = this->query_socket;
+}
+
+bool UDPServer::RunEventLoop()
+{
+#if defined(__linux__)
+	int epoll_fd = epoll_create(8);
+	if (epoll_fd < 0) {
+		DEBUG(net, 0, "[udp] could not create epoll instance: %s", strerror(errno));
+		return false;
+	}
+
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+	if (timer_fd < 0) {
+		DEBUG(net, 0, "[udp] could not create timer: %s", strerror(errno));
+		close(epoll_fd);
+		return false;
+	}
+
+	/* Let the timer go off at every whole second since the start */
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	struct itimerspec timer;
+	timer.it_interval.tv_sec  = 1;
+	timer.it_interval.tv_nsec = 0;
+	timer.it_value.tv_sec     = start.tv_sec + 1;
+	timer.it_value.tv_nsec    = start.tv_nsec;
+
+	struct epoll_event ev;
+	ev.events   = EPOLLIN;
+	ev.data.ptr = NULL;
+	bool success = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) == 0 &&
+			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) == 0;
+
+	SocketHandlerList handlers;
+	this->GetSocketHandlers(handlers);
+	for (ServerNetworkUDPSocketHandler **handler = handlers.Begin(); success && handler != handlers.End(); handler++) {
+		const SocketList &sockets = (*handler)->GetSockets();
+		for (SocketList::const_iterator s = sockets.Begin(); success && s != sockets.End(); s++) {
+			ev.data.ptr = *handler;
+			success = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->second, &ev) == 0;
+		}
+	}
+
+	int wakeup_fd = this->GetWakeupFD();
+	if (success && wakeup_fd >= 0) {
+		ev.data.ptr = this;
+		success = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev) == 0;
+	}
 
-	for (; iter != this->queried_servers.end();) {
-		QueriedServer *srv = iter->second;
-		iter++;
-		srv->DoAttempt(this);
+	if (!success) {
+		DEBUG(net, 0, "[udp] could not set up the event loop: %s", strerror(errno));
+		close(timer_fd);
+		close(epoll_fd);
+		return false;
 	}
+
+	/* Handle anything that arrived while we were starting up */
+	this->ReceivePackets();
+
+	while (!this->stop_server) {
+		struct epoll_event events[8];
+		int count = epoll_wait(epoll_fd, events, lengthof(events), -1);
+		/* Interrupted, most likely by the signal telling us to stop */
+		if (count < 0) continue;
+
+		for (int i = 0; i < count; i++) {
+			uint64 expirations;
+
+			if (events[i].data.ptr == this) {
+				/* Another thread woke us up; reset the counter, EventsHandled does the rest */
+				if (read(wakeup_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) DEBUG(net, 1, "[udp] could not reset the wakeup counter");
+				continue;
+			}
+
+			ServerNetworkUDPSocketHandler *handler = (ServerNetworkUDPSocketHandler *)events[i].data.ptr;
+			if (handler != NULL) {
+				handler->ReceivePackets();
+				continue;
+			}
+
+			if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) continue;
+
+			/* Catch up on all seconds that passed, even when we were too busy to notice them */
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			uint new_frame = now.tv_sec - start.tv_sec - (now.tv_nsec < start.tv_nsec ? 1 : 0);
+			while (this->frame < new_frame) {
+				this->frame++;
+
+				/* Check if we have servers that are expired */
+				this->CheckServers();
+			}
+		}
+
+		this->EventsHandled();
+	}
+
+	close(timer_fd);
+	close(epoll_fd);
+	return true;
+#else
+	return false;
+#endif /* __linux__ */
 }
 
 void UDPServer::RealRun()
 {
+	if (this->RunEventLoop()) return;
+
+	/* Fall back to polling the sockets every 100 milliseconds */
 	byte small_frame = 0;
 
 	while (!this->stop_server) {
@@ -60,41 +488,51 @@ void UDPServer::RealRun()
 
 		/* Check if we have any data on the socket */
 		this->ReceivePackets();
+		this->EventsHandled();
 		CSleep(100);
 	}
 }
 
 QueriedServer *UDPServer::GetQueriedServer(NetworkAddress *addr)
 {
-	QueriedServerMap::iterator iter = this->queried_servers.find(addr);
-	if (iter == this->queried_servers.end()) return NULL;
-	return iter->second;
+	AddressKey key;
+	if (!key.FromAddress(addr)) return NULL;
+
+	QueriedServer **qs = this->queried_servers.Find(key);
+	return qs == NULL ? NULL : *qs;
 }
 
 QueriedServer *UDPServer::AddQueriedServer(QueriedServer *qs)
 {
 	QueriedServer *ret = this->RemoveQueriedServer(qs);
 
-	this->queried_servers[qs->GetServerAddress()] = qs;
+	this->queried_servers[qs->GetServerKey()] = qs;
+	this->ScheduleAttempt(qs, qs->frame + qs->GetAttemptInterval());
 	return ret;
 }
 
 QueriedServer *UDPServer::RemoveQueriedServer(QueriedServer *qs)
 {
-	QueriedServerMap::iterator iter = this->queried_servers.find(qs->GetServerAddress());
-	if (iter == this->queried_servers.end()) return NULL;
+	QueriedServer **iter = this->queried_servers.Find(qs->GetServerKey());
+	if (iter == NULL) return NULL;
 
-	QueriedServer *ret = iter->second;
-	this->queried_servers.erase(iter);
+	QueriedServer *ret = *iter;
+	this->queried_servers.Erase(qs->GetServerKey());
+	UnscheduleAttempt(ret);
 
 	return ret;
 }
 
 QueriedServer::QueriedServer(const NetworkAddress &address, uint frame) :
+	timer_next(NULL),
+	timer_pprev(NULL),
+	timer_frame(0),
 	server_address(address),
 	attempts(0),
 	frame(frame)
 {
+	/* Only IPv4 and IPv6 servers are queried, so this cannot really fail */
+	if (!this->server_key.FromAddress(&this->server_address)) memset(&this->server_key, 0, sizeof(this->server_key));
 }
 
 void QueriedServer::SendFindGameServerPacket(NetworkUDPSocketHandler *socket)
@@ -10,10 +10,10 @@
 #ifndef UDP_SERVER_H
 #define UDP_SERVER_H
 
-#include <map>
 #include <vector>
 
 #include "server.h"
+#include "address_map.hpp"
 #include "shared/network/core/udp.h"
 
 /**
@@ -22,13 +22,20 @@
 
 /**
  * A queried server is a server that is already queried and is awaiting
- * reply. It has a DoAttempt that is called every frame, which can be
- * used to either retry or remove the queried server from the list of
- * waiting queried servers
+ * reply. It has a DoAttempt that is called whenever the attempt interval
+ * has passed, which can be used to either retry or remove the queried
+ * server from the list of waiting queried servers
  */
 class QueriedServer {
+private:
+	friend class UDPServer;
+	QueriedServer *timer_next;   ///< Next queried server in the same slot of the timer wheel
+	QueriedServer **timer_pprev; ///< Pointer to the pointer to us in the slot of the timer wheel
+	uint timer_frame;            ///< The frame the next attempt is scheduled for
+
 protected:
 	NetworkAddress server_address; ///< Address of the running game server
+	AddressKey server_key;         ///< Precomputed key of the address of the running game server
 	uint attempts;                 ///< Number of attempts trying to reach the server
 	uint frame;                    ///< Last frame we did an attempt
 public:
@@ -48,8 +55,15 @@ public:
 	 * When we should stop attempting, false has to be returned, when it should
 	 * continue with trying, true has to be returned.
 	 * @param server the server we are querying for
+	 * @return false if the queried server has to be removed and deleted
+	 */
+	virtual bool DoAttempt(class UDPServer *server) { return true; }
+
+	/**
+	 * Gets the number of frames between two attempts.
+	 * @return the number of frames
 	 */
-	virtual void DoAttempt(class UDPServer *server) {}
+	virtual uint GetAttemptInterval() const { return 1; }
 
 	/**
 	 * Sends the PACKET_UDP_CLIENT_FIND_SERVER packet to this queried server,
@@ -64,6 +78,12 @@ public:
 	 */
 	NetworkAddress *GetServerAddress() { return &this->server_address; }
 
+	/**
+	 * Gets the key of the server address of this queried server
+	 * @return the key of the server address
+	 */
+	const AddressKey &GetServerKey() const { return this->server_key; }
+
 	/**
 	 * Get the session key of the server.
 	 * @return the session key of the server.
@@ -71,42 +91,167 @@ public:
 	virtual uint64 GetSessionKey() const { return 0; }
 };
 
-/** Comparator for the struct sockaddr_in's of the QueriedServerMap */
-struct SockAddrInComparator
-{
+/** Definition of the QueriedServerMap, which maps an socket address to a queried server */
+typedef AddressMap<QueriedServer *> QueriedServerMap;
+
+/**
+ * Socket handler with functionality shared by the UDP sockets of the
+ * master server and updater, mostly related to getting many datagrams
+ * in and out of the kernel with as few system calls as possible.
+ */
+class ServerNetworkUDPSocketHandler : public NetworkUDPSocketHandler {
+public:
+	/** Number of datagrams we (try to) receive with a single system call */
+	static const uint RECEIVE_BATCH_SIZE = 32;
+
+	/** Number of full batches in a row after which we consider ourselves to be lagging behind */
+	static const uint RECEIVE_BACKLOG_BATCHES = 4;
+
+private:
+	bool use_sendmmsg; ///< Whether sending multiple datagrams with sendmmsg is possible
+	bool use_gso;      ///< Whether sending with UDP generic segmentation offload is possible
+	bool use_recvmmsg; ///< Whether receiving multiple datagrams with recvmmsg is possible
+
+	Packet *receive_packets[RECEIVE_BATCH_SIZE]; ///< Ring of preallocated packets to receive a batch of datagrams in
+	uint full_batches;                           ///< Number of full batches received in a row
+
+	/**
+	 * Try to send (a part of) the list of packets with as few system
+	 * calls as the kernel allows.
+	 * @param sock        the socket to send the packets on
+	 * @param packets     the packets to send
+	 * @param num_packets the number of packets to send
+	 * @param send        the (resolved) address to send the packets to
+	 * @return the index of the first packet that has not been sent
+	 */
+	uint SendPacketListBatched(SOCKET sock, const Packet * const *packets, uint num_packets, NetworkAddress *send);
+
+	/**
+	 * Receive and handle the waiting datagrams in batches.
+	 * @return false if batched receiving is not possible, i.e. the
+	 *         datagrams still need to be received one by one.
+	 */
+	bool ReceivePacketsBatched();
+
+public:
+	/**
+	 * Create a new socket handler.
+	 * @param addresses the addresses to bind on
+	 */
+	ServerNetworkUDPSocketHandler(NetworkAddressList *addresses);
+
+	/** Free the preallocated packets */
+	virtual ~ServerNetworkUDPSocketHandler();
+
+	/**
+	 * Start listening on the addresses given to the constructor.
+	 * @param reuse_port whether to allow other sockets to bind to the same
+	 *                   addresses and ports too, so the kernel spreads the
+	 *                   incoming datagrams over them
+	 * @return true if at least one address could be bound
+	 */
+	bool Listen(bool reuse_port = false);
+
+	/**
+	 * Receive all waiting datagrams and pass them to the Receive_* handlers.
+	 * When the operating system supports it, many datagrams are received
+	 * with a single system call into preallocated packets.
+	 */
+	void ReceivePackets();
+
+	/**
+	 * Whether the datagrams come in faster than we can handle them, i.e.
+	 * the receive queue of the kernel keeps filling whole batches. Only
+	 * known when receiving in batches.
+	 * @return true if there is a backlog of datagrams to handle
+	 */
+	bool IsBacklogged() const { return this->full_batches >= RECEIVE_BACKLOG_BATCHES; }
+
+	/**
+	 * Send a list of packets to the given address. When the operating system
+	 * supports it, all packets are handed to the kernel at once; otherwise
+	 * they are sent one by one. The packets are not changed, so the same
+	 * packets may be sent by several threads at once.
+	 * @param packets the packets to send, already prepared with Packet::PrepareToSend
+	 * @param count   the number of packets to send
+	 * @param recv    the address to send the packets to
+	 */
+	void SendPacketList(const Packet * const *packets, uint count, NetworkAddress *recv);
+
 	/**
-	 * Compare two sockaddr_in's on IP address and port
+	 * Get the sockets this handler is listening on.
+	 * @return the sockets
 	 */
-	bool operator()(NetworkAddress *s1, NetworkAddress *s2) const
-	{
-		return *s1 < *s2;
-	}
+	const SocketList &GetSockets() const { return this->sockets; }
 };
 
-/** Definition of the QueriedServerMap, which maps an socket address to a queried server */
-typedef std::map<NetworkAddress*, QueriedServer*, SockAddrInComparator> QueriedServerMap;
+/** List of socket handlers that a UDP server listens on */
+typedef SmallVector<ServerNetworkUDPSocketHandler *, 4> SocketHandlerList;
 
 class UDPServer : public Server {
+public:
+	/** Number of slots in the timer wheel; a power of two */
+	static const uint TIMER_WHEEL_SIZE = 64;
+
 private:
-	QueriedServerMap queried_servers; ///< List of servers we have queried and are awaiting replies for
+	QueriedServerMap queried_servers;                ///< List of servers we have queried and are awaiting replies for
+	QueriedServer *timer_wheel[TIMER_WHEEL_SIZE];    ///< Queried servers by the frame their next attempt is due, modulo the wheel size
+
+	/**
+	 * Schedule the next attempt of a queried server.
+	 * @param qs    the queried server to schedule
+	 * @param frame the frame the attempt is due
+	 */
+	void ScheduleAttempt(QueriedServer *qs, uint frame);
+
+	/**
+	 * Cancel the scheduled attempt of a queried server.
+	 * @param qs the queried server to unschedule
+	 */
+	static void UnscheduleAttempt(QueriedServer *qs);
 
 protected:
-	NetworkUDPSocketHandler *query_socket; ///< Address to do queries to game servers on
-	uint frame;                            ///< The current 'frame'/time in the server
+	ServerNetworkUDPSocketHandler *query_socket; ///< Address to do queries to game servers on
+	uint frame;                                  ///< The current 'frame'/time in the server
 
 	/**
-	 * Function that is called approximatelly every second and is used
-	 * to check every server in the queried_servers list whether they
-	 * need to be requeries or not.
+	 * Function that is called every frame and is used to do the attempts
+	 * of the queried servers that are due this frame.
 	 */
 	virtual void CheckServers();
 
 	/** Read packets from all the sockets */
 	virtual void ReceivePackets();
 
+	/**
+	 * Get all socket handlers that packets should be received for.
+	 * @param handlers the list to add the socket handlers to
+	 */
+	virtual void GetSocketHandlers(SocketHandlerList &handlers);
+
+	/**
+	 * Get the file descriptor other threads use to wake up the main loop.
+	 * @return the file descriptor, or -1 when there is none
+	 */
+	virtual int GetWakeupFD() { return -1; }
+
+	/**
+	 * Function that is called by the main loop after it has handled the
+	 * events it has been woken up for.
+	 */
+	virtual void EventsHandled() {}
+
 	/** Function used to tell that a server has gone online/offline */
 	virtual void ServerStateChange() {}
 
+	/**
+	 * Run the main loop waiting on the sockets and a timer, so packets
+	 * are handled as soon as they arrive and frames are based on the
+	 * monotonic clock instead of the number of times we have slept.
+	 * @return false if the event loop could not be set up; nothing has been run then
+	 */
+	bool RunEventLoop();
+
 	virtual void RealRun();
 public:
 	/**
@@ -9,6 +9,7 @@
 
 #include "shared/stdafx.h"
 #include "shared/debug.h"
+#include "shared/object_pool.hpp"
 #include "updater.h"
 
 #include "shared/safeguards.h"
@@ -19,23 +20,67 @@
 
 ///*** Checking for expiration of retries of servers ***///
 
+/** The pool the queried servers are allocated from */
+static ObjectPool<UpdaterQueriedServer> _updater_queried_server_pool;
+
+/** The pool the missing GRFs of the queried servers are allocated from; they are big and rare */
+static ObjectPool<MissingGRFs, 16> _missing_grfs_pool;
+
+/**
+ * Compare two GRFs on their GRF ID and MD5 checksum
+ * @param grf1 the first GRF
+ * @param grf2 the second GRF
+ * @return true if both identify the same GRF
+ */
+static bool IsSameGRF(const GRFIdentifier *grf1, const GRFIdentifier *grf2)
+{
+	return grf1->grfid == grf2->grfid && memcmp(grf1->md5sum, grf2->md5sum, sizeof(grf1->md5sum)) == 0;
+}
+
+void *MissingGRFs::operator new(size_t size)
+{
+	return _missing_grfs_pool.Allocate(size);
+}
+
+void MissingGRFs::operator delete(void *ptr)
+{
+	_missing_grfs_pool.Free(ptr);
+}
+
 UpdaterQueriedServer::UpdaterQueriedServer(const NetworkAddress &address, uint frame) : QueriedServer(address, frame)
 {
 	this->received_game_info = false;
+	this->missing_grfs = NULL;
 }
 
 UpdaterQueriedServer::~UpdaterQueriedServer()
 {
-	/* Free all GRFs we allocated */
-	GRFList::iterator iter = this->missing_grfs.begin();
-	for (; iter != this->missing_grfs.end(); iter++) {
-		delete *iter;
-	}
+	delete this->missing_grfs;
 }
 
-void UpdaterQueriedServer::DoAttempt(UDPServer *server)
+void *UpdaterQueriedServer::operator new(size_t size)
 {
-	if (this->frame + UPDATER_QUERY_TIMEOUT > server->GetFrame()) return;
+	return _updater_queried_server_pool.Allocate(size);
+}
+
+void UpdaterQueriedServer::operator delete(void *ptr)
+{
+	_updater_queried_server_pool.Free(ptr);
+}
+
+/* static */ void UpdaterQueriedServer::LogPoolOccupancy()
+{
+	DEBUG(misc, 4, "[pool] %u of %u queried servers in use, %u bytes allocated",
+			_updater_queried_server_pool.GetItemsInUse(), _updater_queried_server_pool.GetItemsAllocated(),
+			(uint)_updater_queried_server_pool.GetBytesAllocated());
+	DEBUG(misc, 4, "[pool] %u of %u missing GRF lists in use, %u bytes allocated",
+			_missing_grfs_pool.GetItemsInUse(), _missing_grfs_pool.GetItemsAllocated(),
+			(uint)_missing_grfs_pool.GetBytesAllocated());
+}
+
+bool UpdaterQueriedServer::DoAttempt(UDPServer *server)
+{
+	if (this->frame + UPDATER_QUERY_TIMEOUT > server->GetFrame()) return true;
 
 	/* The server did not respond in time, retry */
 	this->attempts++;
@@ -49,9 +94,7 @@ void UpdaterQueriedServer::DoAttempt(UDPServer *server)
 
 			server->GetSQLBackend()->MakeServerOffline(this);
 		}
-		server->RemoveQueriedServer(this);
-		delete this;
-		return;
+		return false;
 	}
 
 	if (!this->received_game_info) {
@@ -67,18 +110,18 @@ void UpdaterQueriedServer::DoAttempt(UDPServer *server)
 	}
 
 	this->frame = server->GetFrame();
+	return true;
 }
 
 void UpdaterQueriedServer::RequestGRFs(NetworkUDPSocketHandler *socket)
 {
-	if (this->missing_grfs.empty()) return;
+	if (this->missing_grfs == NULL) return;
 
 	Packet packet(PACKET_UDP_CLIENT_GET_NEWGRFS);
-	packet.Send_uint8(this->missing_grfs.size());
+	packet.Send_uint8(this->missing_grfs->count);
 
-	GRFList::iterator iter = this->missing_grfs.begin();
-	for (; iter != this->missing_grfs.end(); iter++) {
-		socket->SendGRFIdentifier(&packet, *iter);
+	for (uint i = 0; i < this->missing_grfs->count; i++) {
+		socket->SendGRFIdentifier(&packet, &this->missing_grfs->grfs[i]);
 	}
 
 	socket->SendPacket(&packet, &this->server_address);
@@ -86,7 +129,7 @@ void UpdaterQueriedServer::RequestGRFs(NetworkUDPSocketHandler *socket)
 
 bool UpdaterQueriedServer::DoneQuerying()
 {
-	return this->received_game_info && this->missing_grfs.size() == 0;
+	return this->received_game_info && this->missing_grfs == NULL;
 }
 
 void UpdaterQueriedServer::ReceivedGameInfo()
@@ -96,18 +139,35 @@ void UpdaterQueriedServer::ReceivedGameInfo()
 
 void UpdaterQueriedServer::ReceivedGRF(const GRFIdentifier *grf)
 {
-	GRFList::iterator iter = this->missing_grfs.find(grf);
-	if (iter == this->missing_grfs.end()) return;
+	if (this->missing_grfs == NULL) return;
+
+	MissingGRFs *missing = this->missing_grfs;
+	for (uint i = 0; i < missing->count; i++) {
+		if (!IsSameGRF(&missing->grfs[i], grf)) continue;
 
-	delete *iter;
-	this->missing_grfs.erase(iter);
+		/* Move the last GRF into the gap, and give the list back once it is empty */
+		missing->grfs[i] = missing->grfs[--missing->count];
+		if (missing->count == 0) {
+			delete this->missing_grfs;
+			this->missing_grfs = NULL;
+		}
+		return;
+	}
 }
 
 void UpdaterQueriedServer::AddMissingGRF(const GRFIdentifier *grf)
 {
-	if (this->missing_grfs.find(grf) != this->missing_grfs.end()) return;
+	if (this->missing_grfs == NULL) this->missing_grfs = new MissingGRFs();
+
+	MissingGRFs *missing = this->missing_grfs;
+	for (uint i = 0; i < missing->count; i++) {
+		if (IsSameGRF(&missing->grfs[i], grf)) return;
+	}
+
+	/* A game server cannot have more GRFs than this */
+	if (missing->count == NETWORK_MAX_GRF_COUNT) return;
 
-	this->missing_grfs.insert(new GRFIdentifier(grf));
+	missing->grfs[missing->count++] = GRFIdentifier(grf);
 }
 
 
@@ -178,9 +238,10 @@ void Updater::CheckServers()
 
 		/* Send the game info query */
 		qs->SendFindGameServerPacket(this->GetQuerySocket());
-		this->AddQueriedServer(qs);
+		delete this->AddQueriedServer(qs);
 	}
 
 	if (this->GetFrame() % UPDATER_UNADVERTISE_INTERVAL != 0) return;
 	this->sql->RemoveUnadvertised(UPDATER_SERVER_UNADVERTISE_TIMEOUT);
+	UpdaterQueriedServer::LogPoolOccupancy();
 }
@@ -21,11 +21,13 @@ int main(int argc, char *argv[])
 
 	ParseCommandArguments(argc, argv, addresses, 0, &fork, "updater");
 
-	SQL *sql = new MySQL(MYSQL_MSU_HOST, MYSQL_MSU_USER, MYSQL_MSU_PASS, MYSQL_MSU_DB, MYSQL_MSU_PORT);
+	MySQLPool *pool = new MySQLPool(MYSQL_MSU_HOST, MYSQL_MSU_USER, MYSQL_MSU_PASS, MYSQL_MSU_DB, MYSQL_MSU_PORT, 1);
+	SQL *sql = new MySQL(pool, MYSQL_MSU_BINARY_SCHEMA);
 	Server *server = new Updater(sql, &addresses);
 	server->Run("updater.log", "updater", fork);
 	delete server;
 	delete sql;
+	delete pool;
 
 	return 0;
 }
@@ -34,14 +34,39 @@ enum {
 /** List/set of GRFIdentifiers */
 typedef std::set<const GRFIdentifier*, GRFComparator> GRFList;
 
+/**
+ * The GRFs a queried server is missing the name of. Hardly any server has
+ * them, so they are not part of the queried server itself.
+ */
+struct MissingGRFs {
+	uint count;                                ///< Number of GRFs in the list
+	GRFIdentifier grfs[NETWORK_MAX_GRF_COUNT]; ///< The GRFs; a game server cannot have more than this
+
+	/** Create an empty list */
+	MissingGRFs() : count(0) {}
+
+	/**
+	 * Allocate the memory for a list from the pool.
+	 * @param size the size of the list
+	 * @return the memory
+	 */
+	void *operator new(size_t size);
+
+	/**
+	 * Return the memory of a list to the pool.
+	 * @param ptr the memory of the list
+	 */
+	void operator delete(void *ptr);
+};
+
 /**
  * An UpdaterQueriedServer is a server for which we are getting the current
  * state of the game from and/or the names of the NewGRFs used.
  */
 class UpdaterQueriedServer : public QueriedServer {
 private:
-	bool received_game_info; ///< Whether we have received the 'NetworkGameInfo'
-	GRFList missing_grfs;    ///< GRFs we are missing the name of
+	bool received_game_info;   ///< Whether we have received the 'NetworkGameInfo'
+	MissingGRFs *missing_grfs; ///< GRFs we are missing the name of; NULL when there are none
 public:
 	/**
 	 * Creates a new UpdaterQueriedServer for the server identifier by
@@ -51,14 +76,34 @@ public:
 	 */
 	UpdaterQueriedServer(const NetworkAddress &address, uint frame);
 
-	/** The obvious destructor */
+	/** Return the missing GRFs to their pool */
 	~UpdaterQueriedServer();
 
+	/**
+	 * Allocate the memory for a queried server from the pool.
+	 * @param size the size of the queried server
+	 * @return the memory
+	 */
+	void *operator new(size_t size);
+
+	/**
+	 * Return the memory of a queried server to the pool.
+	 * @param ptr the memory of the queried server
+	 */
+	void operator delete(void *ptr);
+
+	/**
+	 * Log the occupancy of the pools the queried servers and their missing GRFs are allocated from.
+	 */
+	static void LogPoolOccupancy();
+
 	/**
 	 * Checks whether it is time to retry, does that if needed
 	 * @param server the server to send all queries and such to
+	 * @return false if we gave up on the server
 	 */
-	void DoAttempt(UDPServer *server);
+	bool DoAttempt(UDPServer *server);
+	uint GetAttemptInterval() const { return UPDATER_QUERY_TIMEOUT; }
 
 	/**
 	 * Makes and sends the request for the NewGRFs we are missing the
@@ -130,7 +175,7 @@ public:
 };
 
 /** Handler for the query socket of the updater */
-class UpdaterNetworkUDPSocketHandler : public NetworkUDPSocketHandler {
+class UpdaterNetworkUDPSocketHandler : public ServerNetworkUDPSocketHandler {
 protected:
 	UpdaterQueriedServer *current_qs; ///< The query server currently receiving data for
 	Updater *updater;                 ///< The updater associated with this socket
@@ -149,7 +194,7 @@ public:
 	 * @param addresses the host to bind on
 	 */
 	UpdaterNetworkUDPSocketHandler(Updater *updater, NetworkAddressList *addresses) :
-		NetworkUDPSocketHandler(addresses),
+		ServerNetworkUDPSocketHandler(addresses),
 		current_qs(NULL),
 		updater(updater)
 	{}